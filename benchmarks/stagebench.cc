@@ -0,0 +1,882 @@
+/////////////////////////////////
+// File: stagebench.cc
+// Desc: Microbenchmarks of the simulation core. Each primitive is
+//       timed in isolation in several synthetic worlds, and worldfile
+//       parsing is timed on the worldfile test cases and a large
+//       generated world.
+// License: GPL
+/////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <getopt.h>
+#include <glob.h>
+#include <libgen.h>
+#include <sys/time.h>
+#include <algorithm>
+
+#include "stage.hh"
+#include "region.hh"
+#include "worldfile.hh"
+using namespace Stg;
+
+const char* USAGE =
+  "USAGE:  stagebench [options]\n"
+  "Available [options] are:\n"
+  "  --reps N       : time each benchmark N times and report the median [15]\n"
+  "  --min-time S   : make each timing last at least S seconds [0.02]\n"
+  "  --filter STR   : only run benchmarks whose name contains STR\n"
+  "  --worldfiles D : time parsing the worldfile test cases in directory D\n"
+  "                   [" WORLDFILE_TESTS "]\n"
+  "  --json         : print the results as JSON instead of a table\n"
+  "  --help         : print this message\n";
+
+static struct option longopts[] = {
+	{ "reps",  required_argument,   NULL,  'r' },
+	{ "min-time",  required_argument,   NULL,  't' },
+	{ "filter",  required_argument,   NULL,  'f' },
+	{ "worldfiles",  required_argument,   NULL,  'w' },
+	{ "json",  no_argument,   NULL,  'j' },
+	{ "help",  no_argument,   NULL,  'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static double Seconds()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return( tv.tv_sec + tv.tv_usec / 1e6 );
+}
+
+// results are summed into this so that the compiler can't discard
+// the work being timed
+static volatile double sink( 0 );
+
+// where the worldfile test cases live, unless --worldfiles says
+// otherwise
+#ifndef WORLDFILE_TESTS
+#define WORLDFILE_TESTS "../tests/worldfile"
+#endif
+
+// robots in the generated world whose parsing is timed
+static const unsigned int PARSE_ROBOTS( 40000 );
+
+// ---------------------------------------------------------------------
+// synthetic worlds
+
+// robots are this big, in meters
+static const double ROBOT_SIZE( 0.3 );
+
+static void WriteHeader( FILE* f )
+{
+  fprintf( f, "resolution 0.02\n" );
+  fprintf( f, "threads 0\n" );
+  fprintf( f, "interval_sim 100\n\n" );
+  fprintf( f, "define robot position( size [%.2f %.2f 0.2] drive \"diff\" )\n",
+			  ROBOT_SIZE, ROBOT_SIZE );
+  fprintf( f, "define wall model( color_rgba [0.3 0.3 0.3 1] gui_move 0 )\n\n" );
+  // the benchmarks render their own blocks into this model, far
+  // from everything else
+  fprintf( f, "model( name \"bench\" pose [-100 -100 0 0] size [0.1 0.1 0.1] obstacle_return 0 )\n" );
+}
+
+static void WriteRobot( FILE* f, unsigned int i, double x, double y, double a )
+{
+  fprintf( f, "robot( name \"r%u\" pose [%.3f %.3f 0 %.1f] )\n", i, x, y, a );
+}
+
+// one robot in an otherwise empty world
+static unsigned int WriteEmpty( FILE* f )
+{
+  WriteHeader( f );
+  WriteRobot( f, 0, 0, 0, 0 );
+  return 1;
+}
+
+// a 40m square of parallel corridors 2m wide, joined by doorways,
+// with a robot in each corridor every 4m
+static unsigned int WriteCorridors( FILE* f )
+{
+  WriteHeader( f );
+
+  const double side( 40 ), width( 2 ), door( 1 );
+  unsigned int robots(0);
+
+  for( double y( -side/2 ); y <= side/2; y += width )
+	 {
+		// each wall has a doorway, alternately near each end
+		const double doorx( (int)( y / width ) % 2 ? side/2 - 3 : -side/2 + 3 );
+		const double left( ( doorx - door/2 ) - ( -side/2 ) );
+		const double right( side/2 - ( doorx + door/2 ) );
+
+		fprintf( f, "wall( pose [%.3f %.3f 0 0] size [%.3f 0.1 0.5] )\n",
+					-side/2 + left/2, y, left );
+		fprintf( f, "wall( pose [%.3f %.3f 0 0] size [%.3f 0.1 0.5] )\n",
+					side/2 - right/2, y, right );
+
+		if( y + width <= side/2 )
+		  for( double x( -side/2 + 2 ); x < side/2; x += 4, ++robots )
+			 WriteRobot( f, robots, x, y + width/2, 90 * ( robots % 4 ) );
+	 }
+
+  return robots;
+}
+
+// a 40m square scattered with 2000 boxes and 100 robots
+static unsigned int WriteCluttered( FILE* f )
+{
+  WriteHeader( f );
+
+  const double side( 40 );
+
+  srand48( 42 );
+  for( unsigned int i=0; i<2000; ++i )
+	 fprintf( f, "wall( pose [%.3f %.3f 0 %.1f] size [%.3f %.3f 0.5] )\n",
+				 side * ( drand48() - 0.5 ), side * ( drand48() - 0.5 ),
+				 360 * drand48(), 0.2 + 0.8 * drand48(), 0.2 + 0.8 * drand48() );
+
+  for( unsigned int i=0; i<100; ++i )
+	 WriteRobot( f, i, side * ( drand48() - 0.5 ), side * ( drand48() - 0.5 ),
+					 360 * drand48() );
+
+  return 100;
+}
+
+// 10,000 robots on a 100 x 100 grid
+static unsigned int WriteSwarm( FILE* f )
+{
+  WriteHeader( f );
+
+  const unsigned int side( 100 );
+  const double spacing( 2 * ROBOT_SIZE );
+
+  for( unsigned int i=0; i<side*side; ++i )
+	 WriteRobot( f, i,
+					 spacing * ( i % side - side/2.0 ),
+					 spacing * ( i / side - side/2.0 ),
+					 (i * 37) % 360 );
+
+  return side*side;
+}
+
+class Scenario
+{
+public:
+  const char* name;
+  unsigned int (*write)( FILE* f ); ///< returns the number of robots
+
+  std::string path; ///< the generated worldfile
+  World* world;
+  std::vector<Model*> robots;
+  Model* bench; ///< owns the blocks rendered by the benchmarks
+  Bounds xbounds, ybounds; ///< the extent of the world, in meters
+
+  Scenario( const char* name, unsigned int (*write)( FILE* f ) )
+	 : name(name), write(write), path(), world(NULL), robots(), bench(NULL),
+		xbounds(), ybounds()
+  {}
+
+  bool Create()
+  {
+	 char tmpl[] = "/tmp/stagebench-XXXXXX";
+	 const int fd( mkstemp( tmpl ) );
+	 FILE* f( fd < 0 ? NULL : fdopen( fd, "w" ) );
+	 if( f == NULL )
+		{
+		  PRINT_ERR1( "failed to create a temporary worldfile: %s", strerror(errno) );
+		  return false;
+		}
+	 const unsigned int count( write( f ) );
+	 fclose( f );
+	 path = tmpl;
+
+	 world = new World( name );
+	 world->Load( path );
+
+	 char robotname[32];
+	 for( unsigned int i=0; i<count; ++i )
+		{
+		  snprintf( robotname, sizeof(robotname), "r%u", i );
+		  robots.push_back( world->GetModel( robotname ) );
+		  assert( robots.back() );
+		}
+
+	 bench = world->GetModel( "bench" );
+	 assert( bench );
+	 bench->ClearBlocks();
+
+	 const Bounds unbounded( 1e9, -1e9 );
+	 xbounds = ybounds = unbounded;
+	 const std::set<Model*> models( world->GetAllModels() );
+	 FOR_EACH( it, models )
+		{
+		  if( *it == bench )
+			 continue;
+		  const Pose pose( (*it)->GetGlobalPose() );
+		  xbounds.min = std::min( xbounds.min, pose.x );
+		  xbounds.max = std::max( xbounds.max, pose.x );
+		  ybounds.min = std::min( ybounds.min, pose.y );
+		  ybounds.max = std::max( ybounds.max, pose.y );
+		}
+
+	 // keep the rays and polygons off the edge of the world
+	 xbounds.min -= 1; xbounds.max += 1;
+	 ybounds.min -= 1; ybounds.max += 1;
+
+	 return true;
+  }
+
+  void Destroy()
+  {
+	 delete world;
+	 world = NULL;
+	 robots.clear();
+	 unlink( path.c_str() );
+  }
+
+  Pose RandomPose() const
+  {
+	 return Pose( xbounds.min + drand48() * ( xbounds.max - xbounds.min ),
+					  ybounds.min + drand48() * ( ybounds.max - ybounds.min ),
+					  0.1, // below the tops of walls and robots
+					  normalize( 2 * M_PI * drand48() ) );
+  }
+};
+
+// ---------------------------------------------------------------------
+// benchmarks
+
+/** A primitive to be timed. Run(n) performs it n times and returns
+	 the seconds spent in the part being timed, so that setup and
+	 cleanup between batches can be left out. */
+class Bench
+{
+public:
+  /** The names of all the benchmarks, in the order they run */
+  static const char* names[];
+
+  const char* name;
+
+  Bench( const char* name ) : name(name) {}
+  virtual ~Bench() {}
+
+  virtual double Run( unsigned long n ) = 0;
+};
+
+const char* Bench::names[] = {
+  "World::Raytrace",
+  "World::MapPoly",
+  "Cell::AddBlock",
+  "Cell::RemoveBlock",
+  "Block::TestCollision",
+  "Model::GetGlobalPose",
+  "Worldfile::Load",
+  "Worldfile::GetProperty",
+  "Worldfile::LoadCached",
+  NULL
+};
+
+// true if any benchmark in scenario matches filter
+static bool Wanted( const Scenario& scenario, const std::string& filter )
+{
+  for( const char** name( Bench::names ); *name; ++name )
+	 if( ( std::string( scenario.name ) + "/" + *name ).find( filter ) != std::string::npos )
+		return true;
+  return false;
+}
+
+class RaytraceBench : public Bench
+{
+  Scenario& scenario;
+  std::vector<Ray> rays;
+
+public:
+  RaytraceBench( Scenario& scenario )
+	 : Bench( names[0] ), scenario(scenario), rays()
+  {
+	 for( unsigned int i=0; i<4096; ++i )
+		rays.push_back( Ray( scenario.bench, scenario.RandomPose(), 8.0, NULL, NULL, true ) );
+  }
+
+  double Run( unsigned long n )
+  {
+	 const RangerRayMatch match( scenario.bench );
+	 double ranges(0);
+
+	 const double start( Seconds() );
+	 for( unsigned long i=0; i<n; ++i )
+		ranges += scenario.world->Raytrace( rays[ i % rays.size() ], match ).range;
+	 const double elapsed( Seconds() - start );
+
+	 sink = sink + ranges;
+	 return elapsed;
+  }
+};
+
+// renders robot-sized squares, a batch at a time, removing each batch
+// between timings
+class MapPolyBench : public Bench
+{
+  Scenario& scenario;
+  Block* block;
+  std::vector<PointIntVec> polys;
+
+public:
+  MapPolyBench( Scenario& scenario )
+	 : Bench( names[1] ), scenario(scenario), block(NULL), polys()
+  {
+	 block = scenario.bench->AddBlockRect( -0.5, -0.5, 1, 1, 1 );
+	 block->UnMap( 0 );
+	 block->UnMap( 1 );
+
+	 const double r( ROBOT_SIZE / M_SQRT2 );
+	 for( unsigned int i=0; i<256; ++i )
+		{
+		  const Pose pose( scenario.RandomPose() );
+		  PointIntVec poly;
+		  for( unsigned int c=0; c<4; ++c )
+			 {
+				const double a( pose.a + c * M_PI/2 );
+				poly.push_back( scenario.world->MetersToPixels( point_t( pose.x + r * cos(a),
+																							pose.y + r * sin(a) ) ) );
+			 }
+		  polys.push_back( poly );
+		}
+  }
+
+  double Run( unsigned long n )
+  {
+	 double elapsed(0);
+
+	 for( unsigned long done(0); done < n; )
+		{
+		  const unsigned long batch( std::min( n - done, (unsigned long)polys.size() ) );
+
+		  const double start( Seconds() );
+		  for( unsigned long i=0; i<batch; ++i )
+			 scenario.world->MapPoly( polys[i], block, 0 );
+		  elapsed += Seconds() - start;
+
+		  block->UnMap( 0 );
+		  done += batch;
+		}
+
+	 return elapsed;
+  }
+};
+
+// adds a block to, or removes it from, cells scattered over the world,
+// a batch at a time
+class CellBench : public Bench
+{
+  Scenario& scenario;
+  Block* block;
+  std::vector<Cell*> cells;
+  bool remove;
+
+public:
+  CellBench( Scenario& scenario, bool remove )
+	 : Bench( names[ remove ? 3 : 2 ] ),
+		scenario(scenario), block(NULL), cells(), remove(remove)
+  {
+	 block = scenario.bench->AddBlockRect( -0.5, -0.5, 1, 1, 1 );
+	 block->UnMap( 0 );
+	 block->UnMap( 1 );
+
+	 for( unsigned int i=0; i<4096; ++i )
+		{
+		  const Pose pose( scenario.RandomPose() );
+		  const point_int_t pt( scenario.world->MetersToPixels( point_t( pose.x, pose.y ) ) );
+		  cells.push_back( scenario.world->GetCellCreate( pt ) );
+		}
+  }
+
+  double Run( unsigned long n )
+  {
+	 double elapsed(0);
+
+	 for( unsigned long done(0); done < n; )
+		{
+		  const unsigned long batch( std::min( n - done, (unsigned long)cells.size() ) );
+
+		  double start( Seconds() );
+		  for( unsigned long i=0; i<batch; ++i )
+			 cells[i]->AddBlock( block, 0 );
+		  if( ! remove )
+			 elapsed += Seconds() - start;
+
+		  // Block::UnMap() is Cell::RemoveBlock() on every cell the
+		  // block was added to
+		  start = Seconds();
+		  block->UnMap( 0 );
+		  if( remove )
+			 elapsed += Seconds() - start;
+
+		  done += batch;
+		}
+
+	 return elapsed;
+  }
+};
+
+class TestCollisionBench : public Bench
+{
+  std::vector<Block*> blocks;
+
+public:
+  TestCollisionBench( Scenario& scenario )
+	 : Bench( names[4] ), blocks()
+  {
+	 // replace each robot's body with a block we can get at
+	 FOR_EACH( it, scenario.robots )
+		{
+		  (*it)->ClearBlocks();
+		  blocks.push_back( (*it)->AddBlockRect( -0.5, -0.5, 1, 1, 1 ) );
+		}
+  }
+
+  double Run( unsigned long n )
+  {
+	 unsigned long hits(0);
+
+	 const double start( Seconds() );
+	 for( unsigned long i=0; i<n; ++i )
+		if( blocks[ i % blocks.size() ]->TestCollision() )
+		  ++hits;
+	 const double elapsed( Seconds() - start );
+
+	 sink = sink + hits;
+	 return elapsed;
+  }
+};
+
+class GetGlobalPoseBench : public Bench
+{
+  Scenario& scenario;
+
+public:
+  GetGlobalPoseBench( Scenario& scenario )
+	 : Bench( names[5] ), scenario(scenario)
+  {}
+
+  double Run( unsigned long n )
+  {
+	 const std::vector<Model*>& robots( scenario.robots );
+	 double sum(0);
+
+	 const double start( Seconds() );
+	 for( unsigned long i=0; i<n; ++i )
+		sum += robots[ i % robots.size() ]->GetGlobalPose().x;
+	 const double elapsed( Seconds() - start );
+
+	 sink = sink + sum;
+	 return elapsed;
+  }
+};
+
+/** Loads a worldfile, parsing it or, given a cache directory, reading
+	 its compiled form from there */
+class WorldfileBench : public Bench
+{
+  const std::string path;
+  const std::string cache_dir;
+
+public:
+  WorldfileBench( const std::string& path, const std::string& cache_dir = "" )
+	 : Bench( names[ cache_dir.empty() ? 6 : 8 ] ), path(path), cache_dir(cache_dir)
+  {
+	 if( ! cache_dir.empty() )
+		{
+		  Worldfile::cache_dir = cache_dir;
+		  Worldfile wf;
+		  wf.Load( path );
+		  wf.SaveCache();
+		  Worldfile::cache_dir = "";
+		}
+  }
+
+  double Run( unsigned long n )
+  {
+	 double elapsed(0);
+
+	 Worldfile::cache_dir = cache_dir;
+	 for( unsigned long i=0; i<n; ++i )
+		{
+		  Worldfile wf;
+		  const double start( Seconds() );
+		  wf.Load( path );
+		  elapsed += Seconds() - start;
+		}
+	 Worldfile::cache_dir = "";
+
+	 return elapsed;
+  }
+};
+
+/** Looks up the properties Model::Load asks every entity for, most of
+	 which are not set, as in a typical worldfile */
+class PropertyBench : public Bench
+{
+  Worldfile wf;
+
+public:
+  PropertyBench( const std::string& path )
+	 : Bench( names[7] ), wf()
+  {
+	 wf.Load( path );
+  }
+
+  double Run( unsigned long n )
+  {
+	 static const char* keywords[] = {
+		"pose", "size", "origin", "color", "name", "mass", "gui_nose",
+		"obstacle_return", "ranger_return", "fiducial_return", "velocity"
+	 };
+	 const unsigned int nkeywords( sizeof(keywords)/sizeof(keywords[0]) );
+	 const int entities( std::max( 1, wf.GetEntityCount() ) );
+
+	 unsigned long found(0);
+	 const double start( Seconds() );
+	 for( unsigned long i=0; i<n; ++i )
+		if( wf.GetProperty( (i / nkeywords) % entities, keywords[ i % nkeywords ] ) )
+		  ++found;
+	 const double elapsed( Seconds() - start );
+
+	 sink = sink + found;
+	 return elapsed;
+  }
+};
+
+// ---------------------------------------------------------------------
+// worldfile parsing
+
+/** A worldfile whose parsing is timed on its own, without building
+	 its world */
+class ParseCase
+{
+public:
+  std::string name;
+  std::string path;
+
+  ParseCase( const std::string& name, const std::string& path )
+	 : name(name), path(path)
+  {}
+};
+
+// copies a worldfile test case, leaving out the "test" property that
+// makes it dump its contents and refuse to load
+static bool CopyTestCase( const std::string& src, const std::string& dst )
+{
+  FILE* in( fopen( src.c_str(), "r" ) );
+  FILE* out( in ? fopen( dst.c_str(), "w" ) : NULL );
+  if( out == NULL )
+	 {
+		PRINT_ERR2( "failed to copy %s: %s", src.c_str(), strerror(errno) );
+		if( in )
+		  fclose( in );
+		return false;
+	 }
+
+  char* line( NULL );
+  size_t size( 0 );
+  while( getline( &line, &size, in ) != -1 )
+	 if( strncmp( line, "test ", 5 ) != 0 )
+		fputs( line, out );
+
+  free( line );
+  fclose( in );
+  fclose( out );
+  return true;
+}
+
+/** Copies the worldfile test cases in tests into dir, along with the
+	 files they include, and generates a world with robots robots
+	 there. The cases that load are added to cases; the others test
+	 syntax errors, which end the parse early. */
+static bool CreateParseCases( const char* tests, const std::string& dir,
+										unsigned int robots, std::vector<ParseCase>& cases )
+{
+  glob_t found;
+  memset( &found, 0, sizeof(found) );
+  glob( ( std::string( tests ) + "/*.inc" ).c_str(), 0, NULL, &found );
+  glob( ( std::string( tests ) + "/*.world" ).c_str(), GLOB_APPEND, NULL, &found );
+
+  for( size_t i=0; i<found.gl_pathc; ++i )
+	 {
+		char* tmp( strdup( found.gl_pathv[i] ) );
+		const std::string base( basename( tmp ) );
+		free( tmp );
+
+		const std::string path( dir + "/" + base );
+		if( ! CopyTestCase( found.gl_pathv[i], path ) )
+		  {
+			 globfree( &found );
+			 return false;
+		  }
+
+		const size_t ext( base.rfind( ".world" ) );
+		if( ext == std::string::npos )
+		  continue; // an include file
+
+		Worldfile wf;
+		if( wf.Load( path ) )
+		  cases.push_back( ParseCase( base.substr( 0, ext ), path ) );
+		else
+		  fprintf( stderr, "[%s does not load, so its parse is not timed]\n", base.c_str() );
+	 }
+  globfree( &found );
+
+  if( cases.empty() )
+	 PRINT_WARN1( "no worldfile test cases in %s", tests );
+
+  WorldGen gen;
+  gen.robots = robots;
+
+  char name[32];
+  snprintf( name, sizeof(name), "worldgen%uk", robots / 1000 );
+  const std::string path( dir + "/" + name + ".world" );
+  if( ! gen.Save( path ) )
+	 return false;
+
+  cases.push_back( ParseCase( name, path ) );
+  return true;
+}
+
+static void DestroyParseCases( const std::string& dir )
+{
+  glob_t found;
+  memset( &found, 0, sizeof(found) );
+  glob( ( dir + "/*" ).c_str(), 0, NULL, &found );
+  for( size_t i=0; i<found.gl_pathc; ++i )
+	 unlink( found.gl_pathv[i] );
+  globfree( &found );
+
+  rmdir( dir.c_str() );
+}
+
+// ---------------------------------------------------------------------
+// timing
+
+class Result
+{
+public:
+  std::string scenario, bench;
+  unsigned long ops; ///< operations per timing
+  double median, min, mad; ///< nanoseconds per operation
+};
+
+/** Times bench reps times, each timing running enough operations to
+	 last at least min_time, and summarizes the times per operation
+	 with their median, minimum and median absolute deviation. */
+static Result Measure( Bench& bench, unsigned int reps, double min_time )
+{
+  // warm the caches, then find how many operations take min_time
+  unsigned long n( 1 );
+  for( double t( bench.Run( n ) ); t < min_time; t = bench.Run( n ) )
+	 n = ( t > min_time / 100 ) ? (unsigned long)( 1.2 * n * min_time / t ) : n * 10;
+
+  std::vector<double> samples;
+  for( unsigned int r=0; r<reps; ++r )
+	 samples.push_back( 1e9 * bench.Run( n ) / n );
+
+  std::sort( samples.begin(), samples.end() );
+
+  Result result;
+  result.bench = bench.name;
+  result.ops = n;
+  result.min = samples.front();
+  result.median = samples[ samples.size() / 2 ];
+
+  std::vector<double> deviations;
+  FOR_EACH( it, samples )
+	 deviations.push_back( fabs( *it - result.median ) );
+  std::sort( deviations.begin(), deviations.end() );
+  result.mad = deviations[ deviations.size() / 2 ];
+
+  return result;
+}
+
+int main( int argc, char* argv[] )
+{
+  unsigned int reps( 15 );
+  double min_time( 0.02 );
+  const char* filter( "" );
+  const char* tests( WORLDFILE_TESTS );
+  bool json( false );
+
+  int ch=0, optindex=0;
+  while( (ch = getopt_long( argc, argv, "r:t:f:w:jh?", longopts, &optindex )) != -1 )
+	 {
+		switch( ch )
+		  {
+		  case 'r':
+			 reps = std::max( 1, atoi( optarg ) );
+			 break;
+		  case 't':
+			 min_time = atof( optarg );
+			 break;
+		  case 'f':
+			 filter = optarg;
+			 break;
+		  case 'w':
+			 tests = optarg;
+			 break;
+		  case 'j':
+			 json = true;
+			 break;
+		  case 'h':
+		  case '?':
+			 puts( USAGE );
+			 exit(0);
+		  default:
+			 printf("unhandled option %c\n", ch );
+			 puts( USAGE );
+			 exit(1);
+		  }
+	 }
+
+  Stg::Init( &argc, &argv );
+
+  // loading a world prints progress on stdout, so send that to
+  // stderr to leave stdout for the JSON alone
+  const int json_fd( json ? dup( STDOUT_FILENO ) : -1 );
+  if( json )
+	 dup2( STDERR_FILENO, STDOUT_FILENO );
+
+  Scenario scenarios[] = {
+	 Scenario( "empty", WriteEmpty ),
+	 Scenario( "corridors", WriteCorridors ),
+	 Scenario( "cluttered", WriteCluttered ),
+	 Scenario( "swarm10k", WriteSwarm )
+  };
+
+  std::vector<Result> results;
+
+  for( unsigned int s=0; s<sizeof(scenarios)/sizeof(scenarios[0]); ++s )
+	 {
+		Scenario& scenario( scenarios[s] );
+
+		// don't spend time loading worlds we have no use for
+		if( ! Wanted( scenario, filter ) )
+		  continue;
+
+		if( ! scenario.Create() )
+		  exit(1);
+
+		// the same rays and polygons every run
+		srand48( 1 );
+
+		Bench* benches[] = {
+		  new RaytraceBench( scenario ),
+		  new MapPolyBench( scenario ),
+		  new CellBench( scenario, false ),
+		  new CellBench( scenario, true ),
+		  new TestCollisionBench( scenario ),
+		  new GetGlobalPoseBench( scenario ),
+		  new WorldfileBench( scenario.path )
+		};
+
+		for( unsigned int b=0; b<sizeof(benches)/sizeof(benches[0]); ++b )
+		  {
+			 const std::string fullname( std::string(scenario.name) + "/" + benches[b]->name );
+			 if( fullname.find( filter ) != std::string::npos )
+				{
+				  if( ! json )
+					 fprintf( stderr, "[%s]", fullname.c_str() );
+
+				  Result result( Measure( *benches[b], reps, min_time ) );
+				  result.scenario = scenario.name;
+				  results.push_back( result );
+				}
+			 delete benches[b];
+		  }
+
+		scenario.Destroy();
+	 }
+
+  // parse worldfiles alone, without building their worlds
+  char dir[] = "/tmp/stagebench-XXXXXX";
+  if( mkdtemp( dir ) == NULL )
+	 {
+		PRINT_ERR1( "failed to create a temporary directory: %s", strerror(errno) );
+		exit(1);
+	 }
+
+  // loading a worldfile that includes another prints the include on
+  // stdout every time, so hide stdout while they are loaded
+  fflush( stdout );
+  const int stdout_fd( dup( STDOUT_FILENO ) );
+  const int null_fd( open( "/dev/null", O_WRONLY ) );
+  if( null_fd >= 0 )
+	 {
+		dup2( null_fd, STDOUT_FILENO );
+		close( null_fd );
+	 }
+
+  std::vector<ParseCase> cases;
+  if( ! CreateParseCases( tests, dir, PARSE_ROBOTS, cases ) )
+	 exit(1);
+
+  FOR_EACH( it, cases )
+	 {
+		// the compiled worldfiles are kept with the cases, so that
+		// they are removed with them
+		Bench* benches[] = {
+		  new WorldfileBench( it->path ),
+		  new WorldfileBench( it->path, dir ),
+		  new PropertyBench( it->path )
+		};
+
+		for( unsigned int b=0; b<sizeof(benches)/sizeof(benches[0]); ++b )
+		  {
+			 const std::string fullname( it->name + "/" + benches[b]->name );
+			 if( fullname.find( filter ) != std::string::npos )
+				{
+				  if( ! json )
+					 fprintf( stderr, "[%s]", fullname.c_str() );
+
+				  Result result( Measure( *benches[b], reps, min_time ) );
+				  result.scenario = it->name;
+				  results.push_back( result );
+				}
+			 delete benches[b];
+		  }
+	 }
+
+  fflush( stdout );
+  dup2( stdout_fd, STDOUT_FILENO );
+  close( stdout_fd );
+
+  DestroyParseCases( dir );
+
+  if( json )
+	 {
+		fflush( stdout );
+		dup2( json_fd, STDOUT_FILENO );
+		close( json_fd );
+
+		printf( "[" );
+		for( size_t i=0; i<results.size(); ++i )
+		  printf( "%s\n  { \"scenario\": \"%s\", \"bench\": \"%s\", \"ops\": %lu, "
+					 "\"median_ns\": %.2f, \"min_ns\": %.2f, \"mad_ns\": %.2f }",
+					 i ? "," : "", results[i].scenario.c_str(), results[i].bench.c_str(),
+					 results[i].ops, results[i].median, results[i].min, results[i].mad );
+		printf( "\n]\n" );
+	 }
+  else
+	 {
+		printf( "\n\n%-12s %-22s %14s %14s %8s\n",
+				  "world", "benchmark", "median ns/op", "min ns/op", "mad" );
+		FOR_EACH( it, results )
+		  printf( "%-12s %-22s %14.1f %14.1f %7.1f%%\n",
+					 it->scenario.c_str(), it->bench.c_str(), it->median, it->min,
+					 it->median > 0 ? 100 * it->mad / it->median : 0.0 );
+	 }
+
+  return 0;
+}
@@ -251,7 +251,7 @@ public:
 		laser( (ModelRanger*)pos->GetChild( "ranger:1" )),
 		sonar( (ModelRanger*)pos->GetChild( "ranger:0" )),
 		fiducial( (ModelFiducial*)pos->GetUnusedModelOfType( "fiducial" )),	
-		task(random() % tasks.size() ), // choose a task at random
+		task(pos->RandomInt() % tasks.size() ), // choose a task at random
 		fuel_zone(fuel),
 		pool_zone(pool),
 		avoidcount(0), 
@@ -589,7 +589,7 @@ public:
 						if( pos->GetFlagCount() == 0 )
 							{
 								// pick a new task at random
-								SetTask( random() % tasks.size() );
+								SetTask( pos->RandomInt() % tasks.size() );
 								SetGoal( tasks[task].source );
 							}
 						else
@@ -662,7 +662,7 @@ public:
 				if( avoidcount < 1 )
 					{
 						if( verbose ) puts( "Avoid START" );
-						avoidcount = random() % avoidduration + avoidduration;
+						avoidcount = pos->RandomInt() % avoidduration + avoidduration;
 			 
 						if( minleft < minright  )
 							{
@@ -852,7 +852,7 @@ public:
 						//long int waited = (pos->GetWorld()->SimTimeNow() / 1e6) - wait_started_at;
 				
 						// leave with small probability
-						if( drand48() < 0.0005 )
+						if( pos->Random() < 0.0005 )
 							{
 								//printf( "%s abandoning task %s after waiting %ld seconds\n",
 								//		pos->Token(), goal->Token(), waited );
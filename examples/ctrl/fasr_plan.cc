@@ -446,7 +446,7 @@ public:
 	if( avoidcount < 1 )
 	  {
 	    if( verbose ) puts( "Avoid START" );
-	    avoidcount = random() % avoidduration + avoidduration;
+	    avoidcount = pos->RandomInt() % avoidduration + avoidduration;
 			 
 	    if( minleft < minright  )
 	      {
@@ -10,12 +10,13 @@ using namespace Stg;
 
 const double DEVIATION = 0.05;
 
-double simple_normal_deviate( double mean, double stddev )
+// draws from the model's own random stream, so runs are repeatable
+double simple_normal_deviate( Model* mod, double mean, double stddev )
 {
   double x = 0.0;
   
   for( int i=0; i<12; i++ )
-    x += rand()/(RAND_MAX+1.0);
+    x += mod->Random();
   
   return ( stddev * (x - 6.0) + mean );  
 }
@@ -28,7 +29,7 @@ int RangerUpdate( ModelRanger* mod, void* dummy )
 	
   if( scan.size()>0 )
     FOR_EACH( it, scan )
-      *it *= simple_normal_deviate( 1.0, DEVIATION );
+      *it *= simple_normal_deviate( mod, 1.0, DEVIATION );
   
   return 0; // run again
 }
@@ -103,7 +103,7 @@ int RangerUpdate( ModelRanger* rgr, robot_t* robot )
 	{
 	  // front not clear. we might be stuck, so wiggle a bit
 	  if( fabs(turn_speed) < 0.1 )
-		turn_speed = drand48();
+		turn_speed = robot->position->Random();
 	}
   
   robot->position->SetSpeed( forward_speed, side_speed, turn_speed );
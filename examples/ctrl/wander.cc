@@ -110,7 +110,7 @@ int LaserUpdate( Model* mod, robot_t* robot )
       if( robot->avoidcount < 1 )
         {
 			 if( verbose ) puts( "Avoid START" );
-          robot->avoidcount = random() % avoidduration + avoidduration;
+          robot->avoidcount = robot->pos->RandomInt() % avoidduration + avoidduration;
 			 
 			 if( minleft < minright  )
 				{
@@ -16,14 +16,16 @@ Ancestor::Ancestor() :
 
 Ancestor::~Ancestor()
 {
-  FOR_EACH( it, children )
+  // each child erases itself from our list as it is destroyed
+  ModelPtrVec doomed( children );
+  FOR_EACH( it, doomed )
 	 delete (*it);
 }
 
 void Ancestor::AddChild( Model* mod )
 {
   // if the child is already there, this is a serious error
-  if( std::find( children.begin(), children.end(), mod ) != children.end() )
+  if( mod->child_index < children.size() && children[mod->child_index] == mod )
 	 {
 		PRINT_ERR2( "Attempting to add child %s to %s - child already exists",
 						mod->Token(), this->Token() );
@@ -45,7 +47,7 @@ void Ancestor::AddChild( Model* mod )
   
   mod->SetToken( name.str() );
   
-  children.push_back( mod );
+  AttachChild( mod );
   
   child_type_counts[mod->type]++;  
 }
@@ -53,7 +55,24 @@ void Ancestor::AddChild( Model* mod )
 void Ancestor::RemoveChild( Model* mod )
 {
   child_type_counts[mod->type]--;
-  EraseAll( mod, children );
+  DetachChild( mod );
+}
+
+void Ancestor::AttachChild( Model* mod )
+{
+  mod->child_index = children.size();
+  children.push_back( mod );
+}
+
+void Ancestor::DetachChild( Model* mod )
+{
+  assert( mod->child_index < children.size() && children[mod->child_index] == mod );
+
+  // keep the children in the order they were added, renumbering the
+  // ones after the gap
+  children.erase( children.begin() + mod->child_index );
+  for( unsigned int i=mod->child_index; i<children.size(); ++i )
+	 children[i]->child_index = i;
 }
 
 Pose Ancestor::GetGlobalPose()
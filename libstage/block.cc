@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include "region.hh"
 #include "worldfile.hh"
 
@@ -6,6 +7,10 @@ using std::vector;
 
 static void canonicalize_winding(vector<point_t>& pts);
 
+// protects the reference counts of shared block points, which may
+// belong to models in worlds being updated concurrently
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 
 /** Create a new block. A model's body is a list of these
     blocks. The point data is copied, so pts can safely be freed
@@ -19,7 +24,8 @@ Block::Block( Model* mod,
 				  bool wheel ) :
   mod( mod ),
   mpts(),
-  pts(pts),
+  pts( new std::vector<point_t>(pts) ),
+  shared( new unsigned int(1) ),
   local_z( zmin, zmax ),
   color( color ),
   inherit_color( inherit_color ),
@@ -28,7 +34,7 @@ Block::Block( Model* mod,
   gpts()
 {
   assert( mod );
-  canonicalize_winding(this->pts);
+  canonicalize_winding(*this->pts);
 }
 
 /** A from-file  constructor */
@@ -37,7 +43,8 @@ Block::Block(  Model* mod,
 					int entity)
   : mod( mod ),
     mpts(),
-    pts(),
+    pts( new std::vector<point_t> ),
+    shared( new unsigned int(1) ),
 	 local_z(),
     color(),
     inherit_color(true),
@@ -50,7 +57,32 @@ Block::Block(  Model* mod,
   assert(entity);
   
   Load( wf, entity );
-  canonicalize_winding(this->pts);
+  canonicalize_winding(*this->pts);
+}
+
+/** A copy constructor for World::InstantiatePrototype(). The points
+    are shared with proto until either block is changed. */
+Block::Block( Model* mod, const Block& proto )
+  : mod( mod ),
+    mpts( proto.mpts ),
+    pt_count( proto.pt_count ),
+    pts( proto.pts ),
+    shared( proto.shared ),
+    size( proto.size ),
+    local_z( proto.local_z ),
+    color( proto.color ),
+    inherit_color( proto.inherit_color ),
+    wheel( proto.wheel ),
+    global_z(),
+    mapped( false ),
+    rendered_cells(),
+    gpts()
+{
+  assert( mod );
+
+	pthread_mutex_lock( &shared_mutex );
+	++*shared;
+	pthread_mutex_unlock( &shared_mutex );
 }
 
 Block::~Block()
@@ -60,11 +92,37 @@ Block::~Block()
 		UnMap(0);
 		UnMap(1);
 	 }
+
+	pthread_mutex_lock( &shared_mutex );
+	const bool last( --*shared == 0 );
+	pthread_mutex_unlock( &shared_mutex );
+
+	if( last )
+		{
+			delete pts;
+			delete shared;
+		}
+}
+
+void Block::UnsharePoints()
+{
+	pthread_mutex_lock( &shared_mutex );
+	if( *shared > 1 )
+		{
+			// copy before releasing our reference, so the last other
+			// owner can't free the points under us
+			pts = new std::vector<point_t>( *pts );
+			--*shared;
+			shared = new unsigned int(1);
+		}
+	pthread_mutex_unlock( &shared_mutex );
 }
 
 void Block::Translate( double x, double y )
 {
-	FOR_EACH( it, pts )
+	UnsharePoints();
+
+	FOR_EACH( it, *pts )
     {
       it->x += x;
       it->y += y;
@@ -78,7 +136,7 @@ double Block::CenterY()
   double min = billion;
   double max = -billion;
   
-	FOR_EACH( it, pts )
+	FOR_EACH( it, *pts )
     {
       if( it->y > max ) max = it->y;
       if( it->y < min ) min = it->y;
@@ -93,7 +151,7 @@ double Block::CenterX()
   double min = billion;
   double max = -billion;
   
-	FOR_EACH( it, pts )
+	FOR_EACH( it, *pts )
     {
       if( it->x > max ) max = it->x;
       if( it->x < min ) min = it->x;
@@ -199,25 +257,24 @@ Model* Block::TestCollision()
 void Block::Map( unsigned int layer )
 {
 	// calculate the local coords of the block vertices
-	const size_t pt_count(pts.size());
+	const size_t pt_count(pts->size());
 	
   if( mpts.size() == 0 )
 		{
 			// no valid cache of model coord points, so generate them
-			mpts.resize( pts.size() );
+			mpts.resize( pt_count );
 			
 			for( size_t i=0; i<pt_count; ++i )
-				mpts[i] = BlockPointToModelMeters( pts[i] );
+				mpts[i] = BlockPointToModelMeters( (*pts)[i] );
 		}
   
 	// now calculate the global pixel coords of the block vertices
   gpts.clear();
   mod->LocalToPixels( mpts, gpts );
 	
-	// and render this block's polygon into the world
-	mod->world->MapPoly( gpts, this, layer );
-	
-  // update the block's absolute z bounds at this rendering
+  // update the block's absolute z bounds at this rendering. This
+  // must happen before mapping, as the cells record the z range of
+  // the blocks rendered into them.
   Pose gpose( mod->GetGlobalPose() );
   gpose.z += mod->geom.pose.z;
   double scalez( mod->geom.size.z /  mod->blockgroup.GetSize().z );
@@ -225,6 +282,9 @@ void Block::Map( unsigned int layer )
   global_z.min = (scalez * local_z.min) + z;
   global_z.max = (scalez * local_z.max) + z;
   
+	// and render this block's polygon into the world
+	mod->world->MapPoly( gpts, this, layer );
+	
   mapped = true;	
 }
 
@@ -275,12 +335,12 @@ void Block::Rasterize( uint8_t* data,
   //printf( "rasterize block %p : w: %u h: %u  scale %.2f %.2f  offset %.2f %.2f\n",
   //	 this, width, height, scalex, scaley, offsetx, offsety );
 	
-	const size_t pt_count = pts.size();
+	const size_t pt_count = pts->size();
   for( size_t i=0; i<pt_count; ++i )
     {
 		// convert points from local to model coords
-		point_t mpt1 = BlockPointToModelMeters( pts[i] );
-		point_t mpt2 = BlockPointToModelMeters( pts[(i+1)%pt_count] );
+		point_t mpt1 = BlockPointToModelMeters( (*pts)[i] );
+		point_t mpt2 = BlockPointToModelMeters( (*pts)[(i+1)%pt_count] );
 	  
 		// record for debug visualization
 		mod->rastervis.AddPoint( mpt1.x, mpt1.y );
@@ -343,7 +403,7 @@ void Block::DrawTop()
   // draw the top of the block - a polygon at the highest vertical
   // extent
   glBegin( GL_POLYGON);
-  FOR_EACH( it, pts )
+  FOR_EACH( it, *pts )
 	 glVertex3f( it->x, it->y, local_z.max );
   glEnd();
 }
@@ -353,21 +413,21 @@ void Block::DrawSides()
   // construct a strip that wraps around the polygon
   glBegin(GL_QUAD_STRIP);
 
-  FOR_EACH( it, pts )
+  FOR_EACH( it, *pts )
 	 {
       glVertex3f( it->x, it->y, local_z.max );
       glVertex3f( it->x, it->y, local_z.min );
 	 }
   // close the strip
-  glVertex3f( pts[0].x, pts[0].y, local_z.max );
-  glVertex3f( pts[0].x, pts[0].y, local_z.min );
+  glVertex3f( (*pts)[0].x, (*pts)[0].y, local_z.max );
+  glVertex3f( (*pts)[0].x, (*pts)[0].y, local_z.min );
   glEnd();
 }
 
 void Block::DrawFootPrint()
 {
   glBegin(GL_POLYGON);	
-  FOR_EACH( it, pts )
+  FOR_EACH( it, *pts )
 	 glVertex2f( it->x, it->y );
   glEnd();
 }
@@ -402,6 +462,8 @@ void Block::DrawSolid( bool topview )
 
 void Block::Load( Worldfile* wf, int entity )
 {
+	UnsharePoints();
+
 	const size_t pt_count = wf->ReadInt( entity, "points", 0);
 
   char key[128];
@@ -409,7 +471,7 @@ void Block::Load( Worldfile* wf, int entity )
 	 {
 		 snprintf(key, sizeof(key), "point[%d]", (int)p );
 		
-		pts.push_back( point_t(  wf->ReadTupleLength(entity, key, 0, 0),
+		pts->push_back( point_t(  wf->ReadTupleLength(entity, key, 0, 0),
 														 wf->ReadTupleLength(entity, key, 1, 0) ));
 	 }
   
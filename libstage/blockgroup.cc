@@ -12,6 +12,7 @@ using namespace std;
 
 BlockGroup::BlockGroup() 
   : displaylist(0),
+	shared(NULL),
 	blocks(), 
 	minx(0),
 	maxx(0),
@@ -21,6 +22,7 @@ BlockGroup::BlockGroup()
 
 BlockGroup::~BlockGroup()
 {	 
+  ReleaseShared();
   Clear();
 }
 
@@ -71,7 +73,7 @@ void BlockGroup::CalcSize()
 	  // examine all the points in the polygon
 	  Block* block = *it;
 	  
-		FOR_EACH( it, block->pts )
+		FOR_EACH( it, *block->pts )
 		{
 		  if( it->x < minx ) minx = it->x;
 		  if( it->y < miny ) miny = it->y;
@@ -143,10 +145,38 @@ void BlockGroup::DrawFootPrint( const Geom & geom )
   glPopMatrix();
 }
 
+void BlockGroup::ShareDisplayList( BlockGroup& other )
+{
+  if( other.shared == NULL )
+	 {
+		other.shared = new SharedList();
+		other.shared->users = 1;
+	 }
+  
+  ReleaseShared();
+  shared = other.shared;
+  ++shared->users;
+}
+
+void BlockGroup::ReleaseShared()
+{
+  if( shared && --shared->users == 0 )
+	 {
+		if( shared->displaylist )
+		  glDeleteLists( shared->displaylist, 1 );
+		delete shared;
+	 }
+  
+  shared = NULL;
+}
+
 void BlockGroup::BuildDisplayList( Model* mod )
 {
   //puts( "build" );
 
+  // we are about to change, so we need a list of our own
+  ReleaseShared();
+
   if( ! mod->world->IsGUI() )
 	return;
 
@@ -157,8 +187,12 @@ void BlockGroup::BuildDisplayList( Model* mod )
 	  CalcSize();
 	}
   
-  
-  glNewList( displaylist, GL_COMPILE );	
+  CompileDisplayList( mod, displaylist );
+}
+
+void BlockGroup::CompileDisplayList( Model* mod, int list )
+{
+  glNewList( list, GL_COMPILE );	
     
 
   // render each block as a polygon extruded into Z
@@ -238,6 +272,19 @@ void BlockGroup::BuildDisplayList( Model* mod )
 
 void BlockGroup::CallDisplayList( Model* mod )
 {
+  // models copied together all look the same until they change
+  if( shared && ! mod->rebuild_displaylist )
+	 {
+		if( shared->displaylist == 0 )
+		  {
+			 shared->displaylist = glGenLists(1);
+			 CompileDisplayList( mod, shared->displaylist );
+		  }
+		
+		glCallList( shared->displaylist );
+		return;
+	 }
+  
   if( displaylist == 0 || mod->rebuild_displaylist )
 	 {
 		BuildDisplayList( mod );
@@ -275,14 +322,19 @@ void BlockGroup::LoadBitmap( Model* mod, const std::string& bitmapfile, Worldfil
 	
 	std::vector<rotrect_t> rects;
   unsigned int width, height;
-  if( rotrects_from_image_file( full,
-																rects,
-																width, 
-																height ) )
+  if( ! wf->GetCachedBitmap( full, rects, width, height ) )
 	{
-	  PRINT_ERR1( "failed to load rects from image file \"%s\"",
-								full.c_str() );
-	  return;
+	  if( rotrects_from_image_file( full,
+																	rects,
+																	width, 
+																	height ) )
+		{
+		  PRINT_ERR1( "failed to load rects from image file \"%s\"",
+									full.c_str() );
+		  return;
+		}
+	  
+	  wf->CacheBitmap( full, rects, width, height );
 	}
   
   //printf( "found %d rects in \"%s\" at %p\n", 
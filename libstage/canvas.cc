@@ -588,7 +588,6 @@ void Canvas::AddModel( Model*  mod  )
 
 void Canvas::RemoveModel( Model*  mod  )
 {
-  printf( "removing model %s from canvas list\n", mod->Token() );
   EraseAll( mod, models_sorted );
 }
 
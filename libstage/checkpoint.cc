@@ -0,0 +1,344 @@
+/** checkpoint.cc
+    Binary checkpoints of the changing state of a simulation, so that
+    it can be resumed exactly.
+*/
+
+#include <errno.h>
+#include "stage.hh"
+#include "worldfile.hh"
+using namespace Stg;
+
+// first bytes of every checkpoint file
+static const char checkpoint_magic[8] = { 'S','T','G','C','K','P','T','\0' };
+
+// increment whenever the layout of a checkpoint changes
+static const uint32_t checkpoint_version = 2;
+
+// the callbacks that may be saved in a checkpoint's event queues
+typedef enum
+  {
+	 EVENT_UPDATE = 0,
+	 EVENT_MOVE
+  } event_cb_t;
+
+
+void StateArchive::Field( StateArchive& nested )
+{
+  uint32_t len( nested.data.size() );
+  Field( len );
+
+  if( ! reading )
+	 {
+		data.insert( data.end(), nested.data.begin(), nested.data.end() );
+		return;
+	 }
+
+  if( ! ok || pos + len > data.size() )
+	 {
+		ok = false;
+		return;
+	 }
+
+  nested.data.assign( data.begin() + pos, data.begin() + pos + len );
+  nested.Rewind();
+  nested.ok = true;
+  pos += len;
+}
+
+void StateArchive::Field( std::string& str )
+{
+  uint32_t len( str.size() );
+  Field( len );
+
+  if( ! reading )
+	 {
+		data.insert( data.end(), str.begin(), str.end() );
+		return;
+	 }
+
+  if( ! ok || pos + len > data.size() )
+	 {
+		ok = false;
+		return;
+	 }
+
+  str.assign( &data[0] + pos, len );
+  pos += len;
+}
+
+void StateArchive::Field( Pose& pose )
+{
+  Field( pose.x );
+  Field( pose.y );
+  Field( pose.z );
+  Field( pose.a );
+}
+
+void StateArchive::Field( Color& col )
+{
+  Field( col.r );
+  Field( col.g );
+  Field( col.b );
+  Field( col.a );
+}
+
+bool StateArchive::Load( const std::string& path )
+{
+  FILE* fp = fopen( path.c_str(), "rb" );
+  if( fp == NULL )
+	 {
+		PRINT_ERR2( "unable to open checkpoint %s : %s",
+						path.c_str(), strerror(errno) );
+		return( ok = false );
+	 }
+
+  fseek( fp, 0, SEEK_END );
+  const long len( ftell( fp ) );
+  fseek( fp, 0, SEEK_SET );
+
+  data.resize( len > 0 ? len : 0 );
+  ok = ( len >= 0 && fread( &data[0], 1, data.size(), fp ) == data.size() );
+  fclose( fp );
+
+  if( ! ok )
+	 PRINT_ERR1( "unable to read checkpoint %s", path.c_str() );
+
+  Rewind();
+  return ok;
+}
+
+bool StateArchive::Save( const std::string& path )
+{
+  FILE* fp = fopen( path.c_str(), "wb" );
+  if( fp == NULL )
+	 {
+		PRINT_ERR2( "unable to open checkpoint %s : %s",
+						path.c_str(), strerror(errno) );
+		return( ok = false );
+	 }
+
+  ok = ( fwrite( &data[0], 1, data.size(), fp ) == data.size() );
+  ok = ( fclose( fp ) == 0 ) && ok;
+
+  if( ! ok )
+	 PRINT_ERR1( "unable to write checkpoint %s", path.c_str() );
+
+  return ok;
+}
+
+
+bool World::Checkpoint( const std::string& path )
+{
+  StateArchive ar;
+
+  char magic[8];
+  memcpy( magic, checkpoint_magic, sizeof(magic) );
+  ar.Field( magic );
+
+  uint32_t version( checkpoint_version );
+  ar.Field( version );
+
+  std::string worldfile( wf ? wf->filename : "" );
+  ar.Field( worldfile );
+
+  ar.Field( sim_time );
+  ar.Field( updates );
+  ar.Field( quit_time );
+  ar.Field( sim_interval );
+  ar.Field( paused );
+  ar.Field( random_seed );
+
+  // each model is stored as a separate record, so that a reader can
+  // skip models it can't match
+  std::map<Model*,int32_t> entities;
+
+  uint32_t count( models_by_wfentity.size() );
+  ar.Field( count );
+
+  FOR_EACH( it, models_by_wfentity )
+	 {
+		// retired models are saved as missing ones
+		Model* mod( it->second && ! it->second->retired ? it->second : NULL );
+		int32_t entity( it->first );
+		std::string type( mod ? mod->type : "" );
+		StateArchive record;
+
+		if( mod )
+		  {
+			 entities[mod] = entity;
+			 mod->ArchiveState( record );
+		  }
+
+		ar.Field( entity );
+		ar.Field( type );
+		ar.Field( record );
+	 }
+
+  // the events are stored in heap order, so that events due at the
+  // same time are handled in the same order after restoring
+  uint32_t queues( event_queues.size() );
+  ar.Field( queues );
+
+  for( uint32_t q=0; q<queues; ++q )
+	 {
+		std::vector<Event> saved;
+		FOR_EACH( it, EventHeap( event_queues[q] ) )
+		  {
+			 // nothing happens when they are handled
+			 if( it->mod->retired )
+				continue;
+
+			 if( entities.find( it->mod ) == entities.end() ||
+				  it->arg != NULL ||
+				  ( it->cb != Model::UpdateWrapper && it->cb != Model::MoveWrapper ) )
+				{
+				  PRINT_WARN1( "event for model %s can not be saved", it->mod->Token() );
+				  continue;
+				}
+
+			 saved.push_back( *it );
+		  }
+
+		// the reader expects a heap
+		if( saved.size() < event_queues[q].size() )
+		  std::make_heap( saved.begin(), saved.end() );
+
+		uint32_t events( saved.size() );
+		ar.Field( events );
+
+		FOR_EACH( it, saved )
+		  {
+			 usec_t time( it->time );
+			 int32_t entity( entities[it->mod] );
+			 uint8_t cb( it->cb == Model::UpdateWrapper ? EVENT_UPDATE : EVENT_MOVE );
+
+			 ar.Field( time );
+			 ar.Field( entity );
+			 ar.Field( cb );
+		  }
+	 }
+
+  return ar.Save( path );
+}
+
+bool World::Restore( const std::string& path )
+{
+  if( models_by_wfentity.empty() )
+	 {
+		PRINT_ERR1( "world must be loaded or cloned before restoring checkpoint %s", path.c_str() );
+		return false;
+	 }
+
+  StateArchive ar;
+  if( ! ar.Load( path ) )
+	 return false;
+
+  char magic[8] = { 0 };
+  ar.Field( magic );
+  if( ! ar.Ok() || memcmp( magic, checkpoint_magic, sizeof(magic) ) )
+	 {
+		PRINT_ERR1( "%s is not a Stage checkpoint", path.c_str() );
+		return false;
+	 }
+
+  uint32_t version(0);
+  ar.Field( version );
+  if( version != checkpoint_version )
+	 {
+		PRINT_ERR2( "checkpoint %s has unsupported version %u", path.c_str(), version );
+		return false;
+	 }
+
+  // clones have no worldfile of their own, and save none
+  std::string worldfile;
+  ar.Field( worldfile );
+  if( wf && worldfile.size() && worldfile != wf->filename )
+	 PRINT_WARN2( "checkpoint was saved from worldfile %s, not %s",
+					  worldfile.c_str(), wf->filename.c_str() );
+
+  ar.Field( sim_time );
+  ar.Field( updates );
+  ar.Field( quit_time );
+  ar.Field( sim_interval );
+  ar.Field( paused );
+  ar.Field( random_seed );
+
+  uint32_t count(0);
+  ar.Field( count );
+
+  for( uint32_t m=0; m<count && ar.Ok(); ++m )
+	 {
+		int32_t entity(0);
+		std::string type;
+		StateArchive record;
+
+		ar.Field( entity );
+		ar.Field( type );
+		ar.Field( record );
+
+		std::map<int,Model*>::iterator it( models_by_wfentity.find( entity ) );
+		Model* mod( it == models_by_wfentity.end() ? NULL : it->second );
+
+		if( mod == NULL || mod->type != type )
+		  {
+			 if( type.size() )
+				PRINT_WARN2( "no %s model for worldfile entity %d", type.c_str(), entity );
+			 continue;
+		  }
+
+		mod->ArchiveState( record );
+		if( ! record.Ok() )
+		  PRINT_WARN1( "state of model %s is incomplete", mod->Token() );
+	 }
+
+  uint32_t queues(0);
+  ar.Field( queues );
+
+  ClearQueues();
+
+  for( uint32_t q=0; q<queues && ar.Ok(); ++q )
+	 {
+		uint32_t events(0);
+		ar.Field( events );
+		bool skipped( false );
+
+		if( q >= event_queues.size() )
+		  PRINT_WARN1( "world has no event queue %u, so its events are lost", q );
+
+		for( uint32_t e=0; e<events && ar.Ok(); ++e )
+		  {
+			 usec_t time(0);
+			 int32_t entity(0);
+			 uint8_t cb(0);
+
+			 ar.Field( time );
+			 ar.Field( entity );
+			 ar.Field( cb );
+
+			 std::map<int,Model*>::iterator it( models_by_wfentity.find( entity ) );
+			 if( q >= event_queues.size() || it == models_by_wfentity.end() || it->second == NULL )
+				{
+				  skipped = true;
+				  continue;
+				}
+
+			 // appended in the saved order, which is a valid heap
+			 EventHeap( event_queues[q] ).push_back( Event( time, it->second,
+																			cb == EVENT_MOVE ? Model::MoveWrapper : Model::UpdateWrapper,
+																			NULL ) );
+			 ++it->second->queued_events;
+		  }
+
+		if( skipped && q < event_queues.size() )
+		  std::make_heap( EventHeap( event_queues[q] ).begin(), EventHeap( event_queues[q] ).end() );
+	 }
+
+  if( ! ar.Ok() )
+	 {
+		PRINT_ERR1( "checkpoint %s is truncated", path.c_str() );
+		return false;
+	 }
+
+  dirty = true;
+  return true;
+}
@@ -4,13 +4,18 @@ using namespace Stg;
 // static data members
 std::vector<LogEntry> LogEntry::log;
 
+// the log is shared by all worlds, which may be updated concurrently
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 LogEntry::LogEntry( usec_t timestamp, Model* mod ) :
   timestamp( timestamp ),
   mod( mod ),
   pose( mod->GetPose() )
 { 
   // all log entries are added to the static vector history
+  pthread_mutex_lock( &log_mutex );
   log.push_back( *this );
+  pthread_mutex_unlock( &log_mutex );
 }
 
 
@@ -5,8 +5,10 @@
  */
 
 #include <getopt.h>
+#include <sys/resource.h>
 
 #include "stage.hh"
+#include "worldfile.hh"
 #include "config.h"
 using namespace Stg;
 
@@ -20,6 +22,22 @@ const char* USAGE =
   "  --help         : print this message\n"
   "  --args \"str\"   : define an argument string to be passed to all controllers\n"
   "  -a \"str\"       : equivalent to --args \"str\"\n"
+  "  --bench S      : without a GUI, run S simulated seconds as fast as\n"
+  "                   possible, then print the timings as JSON\n"
+  "  -b S           : equivalent to --bench S\n"
+  "  --profile      : count the work done for each model, and print it\n"
+  "                   and write it to <world>.profile.json at exit\n"
+  "  -P             : equivalent to --profile\n"
+  "  --trace        : record what each thread does, and write it to\n"
+  "                   <world>.trace.json at exit for chrome://tracing\n"
+  "  -T             : equivalent to --trace\n"
+  "  --memory       : print the memory used by each world when done\n"
+  "  -m             : equivalent to --memory\n"
+  "  --cache DIR    : keep compiled worldfiles and bitmaps in DIR, and\n"
+  "                   load them from there when nothing has changed\n"
+  "  -C DIR         : equivalent to --cache DIR\n"
+  "  --parallel-worlds N : without a GUI, update up to N worlds at once\n"
+  "  -p N           : equivalent to --parallel-worlds N\n"
   "  -h             : equivalent to --help\n"
   "  -?             : equivalent to --help";
 
@@ -29,9 +47,70 @@ static struct option longopts[] = {
 	{ "clock",  optional_argument,   NULL,  'c' },
 	{ "help",  optional_argument,   NULL,  'h' },
 	{ "args",  required_argument,   NULL,  'a' },
+	{ "parallel-worlds",  required_argument,   NULL,  'p' },
+	{ "bench",  required_argument,   NULL,  'b' },
+	{ "profile",  no_argument,   NULL,  'P' },
+	{ "trace",  no_argument,   NULL,  'T' },
+	{ "memory",  no_argument,   NULL,  'm' },
+	{ "cache",  required_argument,   NULL,  'C' },
 	{ NULL, 0, NULL, 0 }
 };
 
+// the timings of a --bench run, on stdout in JSON, for
+// worlds/benchmark/compare.py
+static void PrintBench( const std::vector<World*>& worlds,
+								const std::vector<std::string>& filenames,
+								const std::vector<double>& load_times,
+								double seconds,
+								double real_seconds )
+{
+  struct rusage usage;
+  getrusage( RUSAGE_SELF, &usage );
+#ifdef __APPLE__
+  const long peak_rss_kb( usage.ru_maxrss / 1024 ); // bytes on OS X
+#else
+  const long peak_rss_kb( usage.ru_maxrss ); // kilobytes on Linux
+#endif
+
+  uint64_t ticks(0);
+  double sim_seconds(0);
+  FOR_EACH( it, worlds )
+	 {
+		ticks += (*it)->GetUpdateCount();
+		sim_seconds += (*it)->SimTimeNow() / 1e6;
+	 }
+
+  printf( "{\n" );
+  printf( "  \"version\": %s,\n", JsonString( VERSION ).c_str() );
+  printf( "  \"bench_seconds\": %.3f,\n", seconds );
+  printf( "  \"real_seconds\": %.6f,\n", real_seconds );
+  printf( "  \"realtime_factor\": %.3f,\n", real_seconds > 0 ? sim_seconds / real_seconds : 0.0 );
+  printf( "  \"ticks\": %llu,\n", (unsigned long long)ticks );
+  printf( "  \"ticks_per_second\": %.3f,\n", real_seconds > 0 ? ticks / real_seconds : 0.0 );
+  printf( "  \"peak_rss_kb\": %ld,\n", peak_rss_kb );
+  printf( "  \"worlds\": [" );
+
+  for( size_t i=0; i<worlds.size(); ++i )
+	 {
+		World* world( worlds[i] );
+
+		printf( "%s\n    {\n", i ? "," : "" );
+		printf( "      \"worldfile\": %s,\n", JsonString( filenames[i] ).c_str() );
+		printf( "      \"models\": %lu,\n", (unsigned long)world->GetAllModels().size() );
+		printf( "      \"sim_seconds\": %.3f,\n", world->SimTimeNow() / 1e6 );
+		printf( "      \"ticks\": %llu,\n", (unsigned long long)world->GetUpdateCount() );
+		printf( "      \"phases\": {\n" );
+		printf( "        \"load\": %.6f", load_times[i] );
+		for( int p=0; p<World::PHASE_COUNT; ++p )
+		  printf( ",\n        \"%s\": %.6f",
+					 World::PhaseName( (World::phase_t)p ),
+					 world->PhaseTime( (World::phase_t)p ) );
+		printf( "\n      }\n    }" );
+	 }
+
+  printf( "\n  ]\n}\n" );
+}
+
 int main( int argc, char* argv[] )
 {
   // initialize libstage - call this first
@@ -42,8 +121,13 @@ int main( int argc, char* argv[] )
   int ch=0, optindex=0;
   bool usegui = true;
   bool showclock = false;
+  unsigned int parallel_worlds = 0;
+  double bench_seconds = 0;
+  bool profile = false;
+  bool trace = false;
+  bool memory = false;
   
-  while ((ch = getopt_long(argc, argv, "cgh?", longopts, &optindex)) != -1)
+  while ((ch = getopt_long(argc, argv, "b:cC:ghmp:PT?", longopts, &optindex)) != -1)
 	 {
 		switch( ch )
 		  {
@@ -61,6 +145,30 @@ int main( int argc, char* argv[] )
 			 usegui = false;
 			 printf( "[GUI disabled]" );
 			 break;
+		  case 'p':
+			 parallel_worlds = atoi(optarg);
+			 printf( "[Parallel worlds %u]", parallel_worlds );
+			 break;
+		  case 'b':
+			 bench_seconds = atof(optarg);
+			 usegui = false;
+			 printf( "[Benchmark %.1f seconds]", bench_seconds );
+			 break;
+		  case 'P':
+			 profile = true;
+			 printf( "[Profiling]" );
+			 break;
+		  case 'T':
+			 trace = true;
+			 printf( "[Tracing]" );
+			 break;
+		  case 'm':
+			 memory = true;
+			 break;
+		  case 'C':
+			 Worldfile::cache_dir = optarg;
+			 printf( "[Cache %s]", optarg );
+			 break;
 		  case 'h':  
 		  case '?':  
 			 puts( USAGE );
@@ -78,30 +186,80 @@ int main( int argc, char* argv[] )
   // arguments at index [optindex] and later are not options, so they
   // must be world file names
   
+  std::vector<World*> worlds;
+  std::vector<std::string> filenames;
+  std::vector<double> load_times;
+
   optindex = optind; //points to first non-option
   while( optindex < argc )
 	 {
 		if( optindex > 0 )
 		  {      
 			 const char* worldfilename = argv[optindex];
+			 const double load_start( World::WallSeconds() );
 			 World* world = ( usegui ? 
 										new WorldGui( 400, 300, worldfilename ) : 
 									new World( worldfilename ) );
 			 world->Load( worldfilename );
 			 world->ShowClock( showclock );
 
-			 if( ! world->paused ) 
+			 if( profile )
+				world->SetProfiling( true );
+
+			 if( trace && ! world->IsTracing() )
+				world->StartTrace();
+
+			 if( bench_seconds > 0 )
+				{
+				  // every world runs for the same time, whatever its
+				  // worldfile says
+				  world->SetQuitTime( (usec_t)( bench_seconds * 1e6 ) );
+				  world->TimePhases( true );
+				  world->Start();
+				}
+			 else if( ! world->paused ) 
 				world->Start();
+
+			 worlds.push_back( world );
+			 filenames.push_back( worldfilename );
+			 load_times.push_back( World::WallSeconds() - load_start );
 		  }
 		optindex++;
 	 }
 
+  const double run_start( World::WallSeconds() );
+
   if( usegui )
-			Fl::run();	 
+	 {
+		if( parallel_worlds > 1 )
+		  PRINT_WARN( "parallel worlds are only used without a GUI" );
+		Fl::run();	 
+	 }
   else
-	 while( ! World::UpdateAll() );
+	 while( ! World::UpdateAll( parallel_worlds ) );
 
   puts( "\n[Stage: done]" );
 
+  // before the benchmark report, which must come last
+  World::DumpProfiles();
+  World::DumpTraces();
+
+  if( memory )
+	 for( size_t i=0; i<worlds.size(); ++i )
+		{
+		  printf( "\n[Memory of %s]\n", filenames[i].c_str() );
+		  worlds[i]->MemoryStats().Print( stdout );
+		}
+
+  if( World::RaytraceStatsEnabled() )
+	 for( size_t i=0; i<worlds.size(); ++i )
+		{
+		  printf( "\n[Raytrace statistics of %s]\n", filenames[i].c_str() );
+		  worlds[i]->GetRaytraceTotals().Print( stdout );
+		}
+
+  if( bench_seconds > 0 )
+	 PrintBench( worlds, filenames, load_times, bench_seconds, World::WallSeconds() - run_start );
+
 	return EXIT_SUCCESS;
 }
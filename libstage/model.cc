@@ -30,6 +30,7 @@
     color_rgba [ 0.0 0.0 0.0 1.0 ]
     bitmap ""
     ctrl ""
+    ctrl_threadsafe 0
 
     # determine how the model appears in various sensors
     fiducial_return 0
@@ -98,6 +99,13 @@
     the entire string as an argument (including the library name). It
     is up to the controller to parse the string if it needs
     arguments."
+
+    - ctrl_threadsafe <int>\n If non-zero, the update callbacks
+    attached to this model and its descendants are thread-safe, so
+    that with "threads" set in the world, callbacks on models updated
+    in worker threads (e.g. rangers) are called in those threads
+    rather than in series in the main thread. Only set this if the
+    controller touches nothing but its own models and data.
  
     - fiducial_return fiducial_id:<int>\n if non-zero, this model is
     detected by fiducialfinder sensors. The value is used as the
@@ -169,6 +177,10 @@ uint64_t Model::trail_interval(5);
 std::map<Stg::id_t,Model*> Model::modelsbyid;
 std::map<std::string, creator_t> Model::name_map;
 
+// protects the model count and id table, which are shared by all
+// worlds
+static pthread_mutex_t ids_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 //static const members
 static const double DEFAULT_FRICTION = 0.0;
 
@@ -184,8 +196,8 @@ void Bounds::Load( Worldfile* wf, const int section, const char* keyword )
 					exit(-1);
 				}
 			
-			min = atof( wf->GetPropertyValue( prop, 0 )) * wf->unit_length;
-			max = atof( wf->GetPropertyValue( prop, 1 )) * wf->unit_length;
+			min = wf->GetPropertyNumber( prop, 0 ) * wf->unit_length;
+			max = wf->GetPropertyNumber( prop, 1 ) * wf->unit_length;
 		}
 }
 
@@ -249,9 +261,9 @@ void Size::Load( Worldfile* wf, const int section, const char* keyword )
 					exit(-1);
 				}
 			
-			x = atof( wf->GetPropertyValue( prop, 0 )) * wf->unit_length;
-			y = atof( wf->GetPropertyValue( prop, 1 )) * wf->unit_length;
-			z = atof( wf->GetPropertyValue( prop, 2 )) * wf->unit_length;
+			x = wf->GetPropertyNumber( prop, 0 ) * wf->unit_length;
+			y = wf->GetPropertyNumber( prop, 1 ) * wf->unit_length;
+			z = wf->GetPropertyNumber( prop, 2 ) * wf->unit_length;
 		}
 }
 
@@ -276,10 +288,10 @@ void Pose::Load( Worldfile* wf, const int section, const char* keyword )
 					exit(-1);
 				}
 			
-			x = atof( wf->GetPropertyValue( prop, 0 )) * wf->unit_length;
-			y = atof( wf->GetPropertyValue( prop, 1 )) * wf->unit_length;
-			z = atof( wf->GetPropertyValue( prop, 2 )) * wf->unit_length;
-			a = atof( wf->GetPropertyValue( prop, 3 )) * wf->unit_angle;
+			x = wf->GetPropertyNumber( prop, 0 ) * wf->unit_length;
+			y = wf->GetPropertyNumber( prop, 1 ) * wf->unit_length;
+			z = wf->GetPropertyNumber( prop, 2 ) * wf->unit_length;
+			a = wf->GetPropertyNumber( prop, 3 ) * wf->unit_angle;
 		}
 }
 
@@ -343,6 +355,13 @@ Model::Model( World* world,
 				  const std::string& type ) :
   Ancestor(), 	 
   mapped(false),
+  shares_map(false),
+  cloned(false),
+  retired(false),
+  child_index(0),
+  queued_events(0),
+  profile(),
+  raytrace_stats( NULL ),
   drawOptions(),
   alwayson(false),
   blockgroup(),
@@ -357,7 +376,7 @@ Model::Model( World* world,
 	friction(DEFAULT_FRICTION),
   geom(),
   has_default_block( true ),
-  id( Model::count++ ),
+  id( 0 ), // set below
   interval((usec_t)1e5), // 100msec
   interval_energy((usec_t)1e5), // 100msec
   interval_pose((usec_t)1e5), // 100msec
@@ -367,6 +386,10 @@ Model::Model( World* world,
   mass(0),
   parent(parent),
   pose(),
+  global_pose(),
+  global_cosa(1.0),
+  global_sina(0.0),
+  global_pose_dirty(true),
   power_pack( NULL ),
   pps_charging(),
   rastervis(),
@@ -376,6 +399,7 @@ Model::Model( World* world,
   stall(false),	 
   subs(0),
   thread_safe( false ),
+  ctrl_threadsafe( false ),
   trail(trail_length),
   trail_index(0),
   type(type),	
@@ -398,7 +422,10 @@ Model::Model( World* world,
 					 parent ? parent->Token() : "(null)",
 					 type.c_str() );
   
+  pthread_mutex_lock( &ids_mutex );
+  id = Model::count++;
   modelsbyid[id] = this;
+  pthread_mutex_unlock( &ids_mutex );
   
   // Adding this model to its ancestor also gives this model a
   // sensible default name
@@ -429,19 +456,50 @@ Model::~Model( void )
 	 {
 		UnMap(0); // remove from the movable model array
 		UnMap(1); // remove from the moveable model array
+
+		// the world must not call us once we're gone
+		if( queued_events )
+		  world->Dequeue( this );
+		world->active_energy.erase( this );
+		world->active_velocity.erase( this );
+		if( vis.fiducial_return )
+		  world->FiducialErase( this );
 	 		
 		// remove myself from my parent's child list, or the world's child
-		// list if I have no parent		
-		EraseAll( this, parent ? parent->children : world->children );			
+		// list if I have no parent, or from the retired models if I'm in
+		// neither
+		if( retired )
+		  {
+			 std::map<std::string,ModelPtrVec>::iterator pool( world->retired_models.find( type ) );
+			 if( pool != world->retired_models.end() )
+				EraseAll( this, pool->second );
+		  }
+		else if( parent )
+		  parent->DetachChild( this );
+		else
+		  world->DetachChild( this );
 		
 		// erase from the static map of all models
+		pthread_mutex_lock( &ids_mutex );
 		modelsbyid.erase(id);			
+		pthread_mutex_unlock( &ids_mutex );
 				
 		world->RemoveModel( this );
 	 }
+
+  delete raytrace_stats;
 }
 
 
+Model* Model::LookupId( uint32_t id )
+{
+  pthread_mutex_lock( &ids_mutex );
+  std::map<id_t,Model*>::const_iterator it( modelsbyid.find( id ) );
+  Model* mod( it == modelsbyid.end() ? NULL : it->second );
+  pthread_mutex_unlock( &ids_mutex );
+  return mod;
+}
+
 void Model::InitControllers()
 {
   CallCallbacks( CB_INIT );
@@ -599,9 +657,10 @@ Pose Model::GlobalToLocal( const Pose& pose ) const
   // get model's global pose
   const Pose org( GetGlobalPose() );
   
-  // compute global pose in local coords
-  const double sx =  (pose.x - org.x) * cos(org.a) + (pose.y - org.y) * sin(org.a);
-  const double sy = -(pose.x - org.x) * sin(org.a) + (pose.y - org.y) * cos(org.a);
+  // compute global pose in local coords, using the trig cached by
+  // GetGlobalPose()
+  const double sx =  (pose.x - org.x) * global_cosa + (pose.y - org.y) * global_sina;
+  const double sy = -(pose.x - org.x) * global_sina + (pose.y - org.y) * global_cosa;
   const double sz = pose.z - org.z;
   const double sa = pose.a - org.a;
   
@@ -666,11 +725,16 @@ void Model::LocalToPixels( const std::vector<point_t>& local,
 {
 	const Pose gpose = GetGlobalPose() + geom.pose;
 	
+	// as gpose + Pose(x,y,0,0), but without the trig for every point
+	const double cosa( cos(gpose.a) );
+	const double sina( sin(gpose.a) );
+	
 	FOR_EACH( it, local )
 		{
-			Pose ptpose = gpose + Pose( it->x, it->y, 0, 0 );
-			global.push_back( point_int_t( (int32_t)floor( ptpose.x * world->ppm) ,
-																		 (int32_t)floor( ptpose.y * world->ppm) ));
+			const double x( gpose.x + it->x * cosa - it->y * sina );
+			const double y( gpose.y + it->x * sina + it->y * cosa );
+			global.push_back( point_int_t( (int32_t)floor( x * world->ppm) ,
+																		 (int32_t)floor( y * world->ppm) ));
 		}
 }
 
@@ -820,12 +884,25 @@ void Model::Update( void )
 	// etc. We queue up the callback into a queue specific to
 
 	if( ! callbacks[Model::CB_UPDATE].empty() )
-		world->pending_update_callbacks[event_queue_num].push(this);					
+		{
+			// callbacks that are known to be thread-safe are called right
+			// here, in a worker thread or not, so that they run before the
+			// models move whatever the number of threads. The rest are
+			// queued for the main thread as above.
+			if( thread_safe )
+				{
+					if( CallCallbacks( CB_UPDATE, CALL_THREADSAFE ) == 0 )
+						return; // nothing left for the main thread
+				}
+			
+			world->pending_update_callbacks[event_queue_num].push_back(this);
+		}
 }
 
 void Model::CallUpdateCallbacks( void )
 {
-	CallCallbacks( CB_UPDATE );
+	// Update() has already called the thread-safe callbacks
+	CallCallbacks( CB_UPDATE, thread_safe ? CALL_UNSAFE : CALL_ALL );
 }
 
 meters_t Model::ModelHeight() const
@@ -858,7 +935,39 @@ void Model::PlaceInFreeSpace( meters_t xmin, meters_t xmax,
 			      meters_t ymin, meters_t ymax )
 {
   while( TestCollision() )
-    SetPose( Pose::Random( xmin,xmax, ymin, ymax ));		
+	 {
+		// as Pose::Random(), from our own stream
+		const meters_t x( xmin + Random() * (xmax-xmin) );
+		const meters_t y( ymin + Random() * (ymax-ymin) );
+		const radians_t a( normalize( Random() * (2.0 * M_PI) ) );
+		SetPose( Pose( x, y, 0, a ) );
+	 }
+}
+
+uint32_t Model::RandomInt()
+{
+  // each update restarts the stream, keyed by the seed and our name
+  if( ! rng.Started() || rng.Tick() != world->updates )
+	 {
+		// FNV-1a
+		uint64_t key( 14695981039346656037ULL );
+		for( int b=0; b<64; b+=8 )
+		  key = (key ^ ((world->random_seed >> b) & 0xff)) * 1099511628211ULL;
+		for( size_t c=0; c<token.size(); ++c )
+		  key = (key ^ (uint8_t)token[c]) * 1099511628211ULL;
+		
+		rng.Seek( key, world->updates );
+	 }
+  
+  return rng.Next();
+}
+
+double Model::Random()
+{
+  // 53 random bits, as many as a double holds
+  const uint32_t hi( RandomInt() >> 5 );
+  const uint32_t lo( RandomInt() >> 6 );
+  return( (hi * 67108864.0 + lo) / 9007199254740992.0 );
 }
 
 void Model::AppendTouchingModels( ModelPtrSet& touchers )
@@ -935,6 +1044,251 @@ void Model::UpdateCharge()
 }
 
 
+void Model::ArchiveState( StateArchive& ar )
+{
+  // match the subscriptions first, since starting up and shutting
+  // down change the state below
+  int s( subs );
+  ar.Field( s );
+  if( ar.Reading() )
+	 {
+		while( subs < s )
+		  Subscribe();
+		while( subs > s )
+		  Unsubscribe();
+	 }
+  
+  Pose p( pose );
+  ar.Field( p );
+  if( ar.Reading() )
+	 SetPose( p );
+  
+  Velocity v( velocity );
+  ar.Field( v );
+  if( ar.Reading() )
+	 SetVelocity( v );
+  
+  ar.Field( velocity_enable );
+  
+  bool active( world->active_velocity.count( this ) );
+  ar.Field( active );
+  if( ar.Reading() )
+	 {
+		if( active )
+		  world->active_velocity.insert( this );
+		else
+		  world->active_velocity.erase( this );
+	 }
+  
+  ar.Field( stall );
+  ar.Field( last_update );
+  ar.Field( event_queue_num );
+  ar.Field( say_string );
+  rng.ArchiveState( ar );
+  
+  bool powered( power_pack );
+  ar.Field( powered );
+  if( powered && power_pack )
+	 power_pack->ArchiveState( ar );
+  else if( powered != ( power_pack != NULL ) ) // the archive doesn't match this model
+	 {
+		ar.Fail();
+		
+		// we can't tell how much power pack state there is to skip
+		if( powered )
+		  return;
+	 }
+  
+  uint32_t flags( flag_list.size() );
+  ar.Field( flags );
+  
+  if( ar.Reading() )
+	 {
+		while( flag_list.size() )
+		  delete PopFlag();
+		
+		// PushFlag() adds to the front, so the last flag comes first
+		std::vector<Flag*> pushed;
+		for( uint32_t f=0; f<flags && ar.Ok(); ++f )
+		  {
+			 Color col;
+			 double size(0);
+			 ar.Field( col );
+			 ar.Field( size );
+			 pushed.push_back( new Flag( col, size ) );
+		  }
+		
+		while( pushed.size() )
+		  {
+			 PushFlag( pushed.back() );
+			 pushed.pop_back();
+		  }
+	 }
+  else
+	 FOR_EACH( it, flag_list )
+		{
+		  Color col( (*it)->GetColor() );
+		  double size( (*it)->GetSize() );
+		  ar.Field( col );
+		  ar.Field( size );
+		}
+}
+
+void Model::CopyState( const Model& src )
+{
+  StateArchive ar;
+  const_cast<Model&>( src ).ArchiveState( ar );
+  ar.Rewind();
+  ArchiveState( ar );
+}
+
+Model* Model::Clone()
+{
+  return world->InstantiatePrototype( this, 1, std::vector<Pose>( 1, pose ) )[0];
+}
+
+void Model::CopyConfig( const Model& proto )
+{
+  ClearBlocks();
+
+  FOR_EACH( it, proto.blockgroup.blocks )
+	 blockgroup.AppendBlock( new Block( this, **it ) );
+
+  has_default_block = proto.has_default_block;
+  blockgroup.CalcSize();
+}
+
+Model* Model::CloneUnmapped( World* into, Model* parent, 
+									  std::map<Model*,Model*>& firsts )
+{
+  Model* mod( into->NewModel( parent, type ) );
+
+  // nothing is mapped until every copy has been made and placed
+  mod->shares_map = true;
+  mod->UnMap(0);
+  mod->UnMap(1);
+
+  mod->cloned = true;
+
+  if( wf )
+	 {
+		mod->Load( wf, wf_entity );
+
+		// a copy in this world is not part of the worldfile, so it
+		// mustn't save its state over ours. A copy in another world
+		// stands for the same entity there.
+		if( into == world )
+		  mod->SetWorldfile( NULL, 0 );
+	 }
+
+  mod->CopyConfig( *this );
+
+  // the first copy of each model draws the display list shared by
+  // the rest
+  std::map<Model*,Model*>::iterator it( firsts.find( this ) );
+  if( it == firsts.end() )
+	 firsts[this] = mod;
+  else
+	 mod->blockgroup.ShareDisplayList( it->second->blockgroup );
+
+  FOR_EACH( it, children )
+	 (*it)->CloneUnmapped( into, mod, firsts );
+
+  return mod;
+}
+
+void Model::MapClone()
+{
+  // the copies look alike from here on, whatever happened while they
+  // were made
+  std::vector<Model*> stack( 1, this );
+  while( stack.size() )
+	 {
+		Model* mod( stack.back() );
+		stack.pop_back();
+
+		mod->shares_map = false;
+		mod->rebuild_displaylist = false;
+		stack.insert( stack.end(), mod->children.begin(), mod->children.end() );
+	 }
+
+  MapWithChildren(0);
+  MapWithChildren(1);
+}
+
+void Model::Retire()
+{
+  assert( children.empty() );
+
+  while( subs > 0 )
+	 Unsubscribe();
+
+  ClearCallbacks();
+  flag_list.clear();
+
+  UnMap(0);
+  UnMap(1);
+
+  if( vis.fiducial_return )
+	 world->FiducialErase( this );
+
+  // keep our name, and its entry in the world's table, in case we are
+  // reused under the same parent
+  if( parent )
+	 parent->DetachChild( this );
+  else
+	 world->DetachChild( this );
+  
+  retired = true;
+  world->dirty = true;
+}
+
+void Model::Reuse( Model* newparent )
+{
+  assert( retired );
+  retired = false;
+  
+  if( newparent == parent )
+	 {
+		if( parent )
+		  parent->AttachChild( this );
+		else
+		  world->AttachChild( this );
+	 }
+  else // we need a name from our new parent
+	 {
+		world->models_by_name.erase( token );
+		parent = newparent;
+		
+		if( parent )
+		  parent->AddChild( this );
+		else
+		  world->AddChild( this );
+		
+		world->AddModelName( this, token );
+
+		// top level models are draggable in the GUI by default
+		gui.move = ( parent == NULL );
+	 }
+
+  // the counters belong to the model's previous life
+  profile.Clear();
+
+  // start at the origin, as a new model does
+  pose = Pose();
+  GlobalPoseChanged();
+  Map(0);
+  Map(1);
+
+  if( vis.fiducial_return )
+	 world->FiducialInsert( this );
+
+  if( alwayson )
+	 Subscribe();
+
+  NeedRedraw();
+}
+
 void Model::Move( void )
 {  
   if( velocity.IsZero() )
@@ -959,6 +1313,7 @@ void Model::Move( void )
   const Pose startpose( pose );
   
   pose = newpose; // do the move provisionally - we might undo it below
+  GlobalPoseChanged();
   
   //const unsigned int layer( world->updates%2 );
   
@@ -972,6 +1327,7 @@ void Model::Move( void )
 		// put things back the way they were
 		// this is expensive, but it happens _very_ rarely for most people
 		pose = startpose;
+		GlobalPoseChanged();
 		UnMapWithChildren( layer );
 		MapWithChildren( layer );
 		SetStall(true);
@@ -998,6 +1354,41 @@ void Model::UpdateTrail()
 	trail_index %= trail_length;
 }
 
+void Model::AddMemoryUsage( MemoryUsage::Models& usage ) const
+{
+  ++usage.count;
+  usage.trails += trail.capacity() * sizeof(TrailItem);
+
+  uint64_t points( 0 );
+  FOR_EACH( it, blockgroup.blocks )
+	 {
+		const Block* b( *it );
+		// shared points are divided between the blocks using them
+		usage.blocks += sizeof(Block) +
+		  ( b->mpts.capacity() + b->pts->capacity() / *b->shared ) * sizeof(point_t) +
+		  b->gpts.capacity() * sizeof(point_int_t) +
+		  b->list_entries.capacity() * sizeof(b->list_entries[0]);
+		usage.rendered_cells += 
+		  ( b->rendered_cells[0].capacity() + b->rendered_cells[1].capacity() ) * sizeof(Cell*);
+		points += b->pts->size();
+	 }
+
+  // a block is drawn as a polygon on top and a quad strip around its
+  // sides, about three vertices of three floats for each point. The
+  // bytes of a shared list are divided between the groups drawing it.
+  const uint64_t list_bytes( points * 3 * 3 * sizeof(float) );
+  if( blockgroup.displaylist )
+	 {
+		++usage.display_lists;
+		usage.display_list_bytes += list_bytes;
+	 }
+  if( blockgroup.shared && blockgroup.shared->displaylist )
+	 {
+		++usage.display_lists;
+		usage.display_list_bytes += list_bytes / std::max( 1u, blockgroup.shared->users );
+	 }
+}
+
 Model* Model::GetUnsubscribedModelOfType( const std::string& type ) const
 {  
   if( (this->type == type) && (this->subs == 0) )
@@ -1075,7 +1466,7 @@ kg_t Model::GetMassOfChildren() const
 
 void Model::Map( unsigned int layer )
 {
-  if( ! mapped )
+  if( ! mapped && ! shares_map )
 	 {
 		// render all blocks in the group at my global pose and size
 		blockgroup.Map( layer );
@@ -1100,6 +1491,7 @@ void Model::BecomeParentOf( Model* child )
 	 world->RemoveChild( child );
   
   child->parent = this;
+  child->GlobalPoseChanged();
   
   this->AddChild( child );
   
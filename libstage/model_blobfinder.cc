@@ -58,6 +58,7 @@ blobfinder
   range 12.0
   fov 3.14159/3.0
   pan 0.0
+  lazy 0
 
   # model properties
   size [ 0.0 0.0 0.0 ]
@@ -75,6 +76,8 @@ blobfinder
   dimensions of the image in pixels. This determines the blobfinder's resolution
 - range <float>\n
   maximum range of the sensor in meters.
+- lazy <int>\n
+  if 1, each update only records the blobfinder's pose, and the image is scanned from that pose the first time the blobs are read with GetBlobs(). The other models are seen where they are at read time. Defaults to 0.
 
  */
 
@@ -86,6 +89,9 @@ blobfinder
 						vis( world ),
 						blobs(),
 						colors(),
+						lazy( false ),
+						stale( false ),
+						scan_pose(),
 						fov( DEFAULT_BLOBFINDERFOV ),
 						pan( DEFAULT_BLOBFINDERPAN ),
 						range( DEFAULT_BLOBFINDERRANGE ),
@@ -104,16 +110,6 @@ ModelBlobfinder::~ModelBlobfinder( void )
 {
 }
 
-static bool blob_match( Model* candidate, 
-								Model* finder,
-								const void* dummy )
-{ 
-  (void)dummy; // avoid warning about unused var
-
-  return( ! finder->IsRelated( candidate ));
-}	
-
-
 static bool ColorMatchIgnoreAlpha( Color a, Color b )
 {
   double epsilon = 1e-5; // small
@@ -155,6 +151,7 @@ void ModelBlobfinder::Load( void )
 	range = wf->ReadFloat( wf_entity, "range", range );
 	fov = wf->ReadAngle( wf_entity, "fov", fov );
 	pan = wf->ReadAngle( wf_entity, "pan", pan );
+	lazy = wf->ReadInt( wf_entity, "lazy", lazy );
 
 	if( wf->PropertyExists( wf_entity, "colors" ) )
 	{
@@ -178,11 +175,41 @@ void ModelBlobfinder::Load( void )
 
 void ModelBlobfinder::Update( void )
 {     
+	if( lazy )
+		{
+			// remember where we were when the scan was due, and leave
+			// the work until someone asks for the data
+			scan_pose = GetGlobalPose();
+			stale = true;
+		}
+	else
+		Scan( GetGlobalPose() );
+
+	Model::Update();
+}
+
+void ModelBlobfinder::Freshen() const
+{
+	if( ! stale )
+		return;
+
+	// the blobs are logically part of our state at the time the scan
+	// was scheduled, so filling them in doesn't change our observable
+	// constness
+	ModelBlobfinder* self( const_cast<ModelBlobfinder*>(this) );
+	self->stale = false;
+	self->Scan( scan_pose );
+}
+
+void ModelBlobfinder::Scan( const Pose& gp )
+{
 	// generate a scan for post-processing into a blob image
 	
 	RaytraceResult* samples = new RaytraceResult[scan_width];
 
-	Raytrace( pan, range, fov, blob_match, NULL, samples, scan_width, false );
+	world->Raytrace( (gp + geom.pose) + Pose( 0,0,0,pan ),
+									 range, fov, UnrelatedRayMatch( this ), this,
+									 samples, scan_width, false );
 
 	// now the colors and ranges are filled in - time to do blob detection
 	double yRadsPerPixel = fov / scan_height;
@@ -263,8 +290,6 @@ void ModelBlobfinder::Update( void )
 	}
 
 	delete [] samples;
-
-	Model::Update();
 }
 
 
@@ -288,6 +313,7 @@ void ModelBlobfinder::Shutdown( void )
 
 	// clear the data - this will unrender it too
 	blobs.clear();
+	stale = false;
 
 	Model::Shutdown();
 }
@@ -369,6 +395,7 @@ void ModelBlobfinder::Vis::Visualize( Model* mod, Camera* cam )
   glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
   
   // draw the blobs on the screen
+  bf->Freshen();
   for( unsigned int s=0; s<bf->blobs.size(); s++ )
 	 {
 		Blob* b = &bf->blobs[s];
@@ -2,13 +2,34 @@
 using namespace Stg;
 using namespace std;
 
+// remove the entries marked for removal from the list, preserving
+// the order of the others
+static void Sweep( Model::CallbackList& list )
+{
+	vector<Model::cb_t>& cbs( list.cbs );
+	
+	size_t keep( 0 );
+	for( size_t i(0); i<cbs.size(); ++i )
+		if( cbs[i].callback )
+			cbs[keep++] = cbs[i];
+	
+	cbs.resize( keep ); // never reallocates
+	list.removed = 0;
+}
 
 void Model::AddCallback( callback_type_t type, 
 												 model_callback_t cb, 
-												 void* user )
+												 void* user,
+												 bool threadsafe )
 {
-  //callbacks[address].insert( cb_t( cb, user ));	
-	callbacks[type].insert( cb_t( cb, user ));
+	vector<cb_t>& cbs( callbacks[type].cbs );
+	
+	// each function/argument pair is attached at most once
+	FOR_EACH( it, cbs )
+		if( it->callback == cb && it->arg == user )
+			return;
+	
+	cbs.push_back( cb_t( cb, user, threadsafe ));
 
 	// debug info - record the global number of registered callbacks
 	if( type == CB_UPDATE )
@@ -22,43 +43,151 @@ void Model::AddCallback( callback_type_t type,
 int Model::RemoveCallback( callback_type_t type,
 													 model_callback_t callback )
 {
-	set<cb_t>& callset = callbacks[type];	
-	callset.erase( cb_t( callback, NULL) );
+	return RemoveCallback( type, cb_t( callback, NULL ), true );
+}
 
+int Model::RemoveCallback( callback_type_t type, 
+													 const cb_t& cb, 
+													 bool all_args )
+{
+	CallbackList& list( callbacks[type] );
 	
-	if( type == CB_UPDATE )
-		{
-			world->update_cb_count--;
-			assert( world->update_cb_count >= 0 );
-		}
+	FOR_EACH( it, list.cbs )
+		if( it->callback == cb.callback && ( all_args || it->arg == cb.arg ) )
+			{
+				// mark it for removal
+				it->callback = NULL;
+				++list.removed;
+				
+				if( type == CB_UPDATE )
+					{
+						world->update_cb_count--;
+						assert( world->update_cb_count >= 0 );
+					}
+			}
+	
+	// if the list is being called, the caller will sweep it
+	if( list.calling == 0 && list.removed )
+		Sweep( list );
 	
 	// return the number of callbacks remaining for this address. Useful
 	// for detecting when there are none.
-	return callset.size();
+	return list.size();
+}
+
+
+void Model::ClearCallbacks()
+{
+	for( size_t type(0); type<callbacks.size(); ++type )
+		{
+			CallbackList& list( callbacks[type] );
+			
+			FOR_EACH( it, list.cbs )
+				if( it->callback )
+					{
+						it->callback = NULL;
+						++list.removed;
+						
+						if( type == CB_UPDATE )
+							world->update_cb_count--;
+					}
+			
+			// if the list is being called, the caller will sweep it
+			if( list.calling == 0 && list.removed )
+				Sweep( list );
+		}
 }
 
+void Model::CopyCallbacks( const Model& src )
+{
+	ClearCallbacks();
+	
+	for( size_t type(0); type<src.callbacks.size(); ++type )
+		FOR_EACH( it, src.callbacks[type].cbs )
+			if( it->callback ) // skip those removed while being called
+				AddCallback( (callback_type_t)type, it->callback, it->arg, it->threadsafe );
+}
 
 int Model::CallCallbacks( callback_type_t type )
 {
-	// maintain a list of callbacks that should be cancelled
-	vector<cb_t> doomed;
+	CallCallbacks( type, CALL_ALL );
+
+	// return the number of callbacks remaining for this address. Useful
+	// for detecting when there are none.
+	return callbacks[type].size();
+}
+
+int Model::CallCallbacks( callback_type_t type, call_filter_t filter )
+{
+	CallbackList& list( callbacks[type] );
+	
+	// callbacks added by the callbacks are not called until next time
+	const size_t count( list.cbs.size() );
+	
+	// a thread-safe controller makes all its callbacks thread-safe
+	const bool ctrl_threadsafe( filter != CALL_ALL && CtrlThreadSafe() );
 	
-	set<cb_t>& callset = callbacks[type];
+	int skipped( 0 );
 	
-	FOR_EACH( it, callset )
+	// don't read the clock for the many empty lists
+	const bool profiling( world->profiling && count > 0 );
+	const double start( profiling ? World::WallSeconds() : 0 );
+
+	++list.calling;
+	
+	for( size_t i(0); i<count; ++i )
 	  {  
-			const cb_t& cba = *it;  
+			// take a copy, since adding a callback may move the list
+			const cb_t cba( list.cbs[i] );  
+			
+			// skip callbacks removed since we started
+			if( cba.callback == NULL )
+				continue;
+			
+			if( filter != CALL_ALL && 
+					(cba.threadsafe || ctrl_threadsafe) != (filter == CALL_THREADSAFE) )
+				{
+					++skipped;
+					continue;
+				}
+			
 			// callbacks return true if they should be cancelled
-			if( (cba.callback)( this, cba.arg ) )
-				doomed.push_back( cba );
+			if( (cba.callback)( this, cba.arg ) && list.cbs[i].callback )
+				{
+					list.cbs[i].callback = NULL;
+					++list.removed;
+					
+					// the count is shared by all threads, so only the main
+					// thread changes it. Worker threads count their own
+					// cancellations for it to take off.
+					if( type == CB_UPDATE )
+						{
+							if( filter == CALL_THREADSAFE )
+								world->cancelled_update_callbacks[event_queue_num]++;
+							else
+								world->update_cb_count--;
+						}
+				}
 	  }      
 	
-	FOR_EACH( it, doomed )
-		callset.erase( *it );
+	if( --list.calling == 0 && list.removed )
+		Sweep( list );
 
-	// return the number of callbacks remaining for this address. Useful
-	// for detecting when there are none.
-	return callset.size();
-}
+	if( profiling )
+		{
+			const double elapsed( World::WallSeconds() - start );
+			profile.callback_time += elapsed;
+			if( type == CB_UPDATE )
+				profile.controller_time += elapsed;
+		}
 
+	return skipped;
+}
 
+bool Model::CtrlThreadSafe() const
+{
+	for( const Model* mod(this); mod; mod = mod->parent )
+		if( mod->ctrl_threadsafe )
+			return true;
+	return false;
+}
@@ -43,6 +43,7 @@ fiducial
   range_max_id 5.0
   fov 3.14159
   ignore_zloc 0
+  lazy 0
 
   # model properties
   size [ 0.1 0.1 0.1 ]
@@ -62,6 +63,8 @@ fiducial
 - ignore_zloc <1/0>\n
   default is 0.  When set to 1, the fiducial finder ignores the z component when checking a fiducial.  Using the default behaviour, a short object would not been seen
   by a fiducial finder placed on top of a tall robot.  With this flag set to 1, the fiducial finder will see the shorter robot.   
+- lazy <1/0>\n
+  default is 0. When set to 1, each update only records the finder's pose, and the scan is done from that pose the first time the data is read with GetFiducials(). Useful when the controller reads the fiducials less often than the sensor updates. The fiducials are found where they are at read time.
  */
   
   ModelFiducial::ModelFiducial( World* world, 
@@ -69,6 +72,9 @@ fiducial
 										  const std::string& type ) : 
   Model( world, parent, type ),
   fiducials(),
+  lazy(false),
+  stale( false ),
+  scan_pose(),
   max_range_anon( 8.0 ),
   max_range_id( 5.0 ),
   min_range( 0.0 ),
@@ -100,16 +106,7 @@ ModelFiducial::~ModelFiducial( void )
 {
 }
 
-static bool fiducial_raytrace_match( Model* candidate, 
-												 Model* finder, 
-												 const void* dummy )
-{
-  (void)dummy; // avoid warning about unused var
-  return( ! finder->IsRelated( candidate ) );
-}	
-
-
-void ModelFiducial::AddModelIfVisible( Model* him )  
+void ModelFiducial::AddModelIfVisible( Model* him, const Pose& gp )  
 {
 	//PRINT_DEBUG2( "Fiducial %s is testing model %s", token, him->Token() );
 
@@ -124,7 +121,7 @@ void ModelFiducial::AddModelIfVisible( Model* him )
 		return;
 	}
 
-	Pose mypose = this->GetGlobalPose();
+	const Pose& mypose = gp;
 
 	// are we within range?
 	Pose hispose = him->GetGlobalPose();
@@ -176,11 +173,13 @@ void ModelFiducial::AddModelIfVisible( Model* him )
 
 	//printf( "range %.2f\n", range );
 	
-	RaytraceResult ray( Raytrace( dtheta,
-																max_range_anon, // TODOscan only as far as the object
-																fiducial_raytrace_match,
-																NULL,
-																true ) );
+	RaytraceResult ray( world->Raytrace( Ray( this,
+																						(mypose + geom.pose) + Pose(0,0,0,dtheta),
+																						max_range_anon, // TODOscan only as far as the object
+																						NULL,
+																						NULL,
+																						true ),
+																			 UnrelatedRayMatch( this ) ) );
 	
 	// TODO
 	if( ignore_zloc && ray.mod == NULL ) // i.e. we didn't hit anything *else*
@@ -236,6 +235,30 @@ void ModelFiducial::Update( void )
 	if( subs < 1 )
 		return;
 
+	if( lazy )
+		{
+			// remember where we were when the scan was due, and leave
+			// the work until someone asks for the data
+			scan_pose = GetGlobalPose();
+			stale = true;
+		}
+	else
+		Scan( GetGlobalPose() );
+
+	Model::Update();
+}
+
+void ModelFiducial::Freshen()
+{
+	if( ! stale )
+		return;
+
+	stale = false;
+	Scan( scan_pose );
+}
+
+void ModelFiducial::Scan( const Pose& gp )
+{
 	// reset the array of detected fiducials
 	fiducials.clear();
 
@@ -246,7 +269,6 @@ void ModelFiducial::Update( void )
 	// the two different axes
 	
 	double rng = max_range_anon;
-	Pose gp = GetGlobalPose();	
 	Model edge;	// dummy model used to find bounds in the sets
 	
 	edge.pose = Pose( gp.x-rng, gp.y, 0, 0 ); // LEFT
@@ -284,17 +306,15 @@ void ModelFiducial::Update( void )
 			
 	// create sets sorted by x and y position
  	FOR_EACH( it, nearby ) 
- 			AddModelIfVisible( *it );	
+ 			AddModelIfVisible( *it, gp );	
 #else
 	// create sets sorted by x and y position
  	FOR_EACH( it, world->models_with_fiducials )
- 			AddModelIfVisible( *it );	
+ 			AddModelIfVisible( *it, gp );	
 
 #endif
 
 	// find the range of fiducials within range in X
-
-	Model::Update();
 }
 
 void ModelFiducial::Load( void )
@@ -309,6 +329,7 @@ void ModelFiducial::Load( void )
 	max_range_id          = wf->ReadLength( wf_entity, "range_max_id", max_range_id );
 	fov                   = wf->ReadAngle ( wf_entity, "fov",          fov );
   ignore_zloc            = wf->ReadInt  ( wf_entity, "ignore_zloc",  ignore_zloc);
+	lazy                  = wf->ReadInt   ( wf_entity, "lazy",         lazy );
 }  
 
 
@@ -346,6 +367,7 @@ void ModelFiducial::DataVisualize( Camera* cam )
 		 glLineStipple( 1, 0x00FF );
 		 
 		 // draw lines to the fiducials
+		 Freshen();
 		 FOR_EACH( it, fiducials )
 			{
 			  Fiducial& fid = *it;
@@ -385,5 +407,6 @@ void ModelFiducial::Shutdown( void )
 { 
   //PRINT_DEBUG( "fiducial shutdown" );
 	fiducials.clear();	
+	stale = false;
 	Model::Shutdown();
 }
@@ -8,6 +8,7 @@ void Model::SetGeom( const Geom& val )
   UnMapWithChildren(1);
   
   geom = val;
+  GlobalPoseChanged(); // stacked children sit on top of us
   
   blockgroup.CalcSize();
   
@@ -125,6 +126,7 @@ int Model::SetParent( Model* newparent)
     world->RemoveChild( this );
   // link from the model to its new parent
   this->parent = newparent;
+  GlobalPoseChanged();
   
   if( newparent )
     newparent->AddChild( this );
@@ -173,19 +175,53 @@ void Model::SetGlobalVelocity( const Velocity& gv )
 // get the model's position in the global frame
 Pose Model::GetGlobalPose() const
 { 
+  if( ! global_pose_dirty )
+    return global_pose;
+  
   // if I'm a top level model, my global pose is my local pose
   if( parent == NULL )
-    return pose;
-  
-  // otherwise    
-  Pose global_pose = parent->GetGlobalPose() + pose;		
+    global_pose = pose;
+  else
+    {
+      // otherwise compose our pose with our parent's, as in
+      // Pose::operator+() but using the parent's cached trig
+      const Pose pp( parent->GetGlobalPose() );
+      global_pose = Pose( pp.x + pose.x * parent->global_cosa - pose.y * parent->global_sina,
+                          pp.y + pose.x * parent->global_sina + pose.y * parent->global_cosa,
+                          pp.z + pose.z,
+                          normalize( pp.a + pose.a ) );
+      
+      if ( parent->stack_children ) // should we be on top of our parent?
+        global_pose.z += parent->geom.size.z;
+    }
   
-  if ( parent->stack_children ) // should we be on top of our parent?
-    global_pose.z += parent->geom.size.z;
+  global_cosa = cos( global_pose.a );
+  global_sina = sin( global_pose.a );
+  global_pose_dirty = false;
   
   return global_pose;
 }
 
+void Model::GlobalPoseChanged()
+{
+  // the descendants of a dirty model are always dirty too, so there's
+  // no need to go any further
+  if( global_pose_dirty )
+    return;
+  
+  global_pose_dirty = true;
+  
+  if( world ) // not a worldless dummy model
+	 {
+		pthread_mutex_lock( &world->dirty_poses_mutex );
+		world->dirty_poses.push_back( this );
+		pthread_mutex_unlock( &world->dirty_poses_mutex );
+	 }
+  
+  FOR_EACH( it, children )
+    (*it)->GlobalPoseChanged();
+}
+
 void Model::VelocityEnable()
 {
 	velocity_enable = true;
@@ -213,6 +249,7 @@ void Model::SetPose( const Pose& newpose )
     {
       pose = newpose;
       pose.a = normalize(pose.a);
+      GlobalPoseChanged();
 
 //       if( isnan( pose.a ) )
 // 		  printf( "SetPose bad angle %s [%.2f %.2f %.2f %.2f]\n",
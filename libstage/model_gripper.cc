@@ -155,6 +155,10 @@ void ModelGripper::Save()
 {
   Model::Save();
 
+  // models that were not loaded have no worldfile
+  if( wf == NULL )
+	 return;
+
   wf->WriteTupleFloat( wf_entity, "paddle_size", 0, cfg.paddle_size.x );
   wf->WriteTupleFloat( wf_entity, "paddle_size", 1, cfg.paddle_size.y );
   wf->WriteTupleFloat( wf_entity, "paddle_size", 2, cfg.paddle_size.z );    
@@ -163,6 +167,13 @@ void ModelGripper::Save()
   wf->WriteTupleString( wf_entity, "paddle_state", 1, (cfg.lift == LIFT_UP ) ? "up" : "down" );
 }
 
+void ModelGripper::CopyConfig( const Model& proto )
+{
+  // Load() made our blocks from the same configuration as proto's,
+  // and we keep pointers to the paddles, so keep them instead of
+  // copying proto's
+}
+
 void ModelGripper::FixBlocks()
 {
   // get rid of the default cube
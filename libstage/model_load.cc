@@ -5,6 +5,7 @@
 #include <limits.h> 
 #include <libgen.h> // for dirname()
 #include <string.h>
+#include <pthread.h>
 #include <ltdl.h> // for library module loading
 
 #include "stage.hh"
@@ -13,6 +14,13 @@
 #include "config.h"
 using namespace Stg;
 
+// the init function of each library opened so far, so that many
+// models with the same controller search for it only once. Shared by
+// all worlds, which may be loaded in different threads, so it and
+// libltdl are used only with initfuncs_mutex held.
+static std::map<std::string,model_callback_t> initfuncs;
+static pthread_mutex_t initfuncs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 //#define DEBUG
 
 void Model::Load()
@@ -79,7 +87,7 @@ void Model::Load()
   this->debug = wf->ReadInt( wf_entity, "debug", this->debug );
   
   const std::string& name = wf->ReadString(wf_entity, "name", token );
-  if( name != token )
+  if( name != token && ! cloned )
 	 {
 		//printf( "adding name %s to %s\n", name, this->token );
 		this->token = name ;
@@ -123,7 +131,11 @@ void Model::Load()
 		if( colorstr != "" )
 		  {
 			 if( colorstr == "random" )
-				col = Color( drand48(), drand48(), drand48() );
+				{
+				  // in order, since argument evaluation order is unspecified
+				  const double r( Random() ), g( Random() ), b( Random() );
+				  col = Color( r, g, b );
+				}
 			 else
 				col = Color( colorstr );
 		  }
@@ -157,7 +169,8 @@ void Model::Load()
 		  }		
 	 }
   
-  if( wf->PropertyExists( wf_entity, "bitmap" ) )
+  // copies take their blocks from the prototype instead
+  if( wf->PropertyExists( wf_entity, "bitmap" ) && ! cloned )
     {
       const std::string bitmapfile = wf->ReadString( wf_entity, "bitmap", "" );
 		if( bitmapfile == "" )
@@ -194,6 +207,7 @@ void Model::Load()
   
   this->stack_children =
     wf->ReadInt( wf_entity, "stack_children", this->stack_children );
+  GlobalPoseChanged();
   
   kg_t m = wf->ReadFloat(wf_entity, "mass", this->mass );
   if( m != this->mass ) 
@@ -228,6 +242,8 @@ void Model::Load()
 				LoadControllerModule( lib );
 		  }
     }
+  
+  ctrl_threadsafe = wf->ReadInt( wf_entity, "ctrl_threadsafe", ctrl_threadsafe );
     
 	// internally interval is in usec, but we use msec in worldfiles
 	interval = 1000 * wf->ReadInt( wf_entity, "update_interval", interval/1000 );
@@ -318,6 +334,22 @@ void Model::LoadControllerModule( const char* lib )
   //printf( "[Ctrl \"%s\"", lib );
   //fflush(stdout);
 
+  // the library name is the first word in the string
+  char libname[256];
+  sscanf( lib, "%s %*s", libname );
+  
+  pthread_mutex_lock( &initfuncs_mutex );
+
+  std::map<std::string,model_callback_t>::iterator it( initfuncs.find( libname ) );
+  if( it != initfuncs.end() )
+	 {
+		model_callback_t initfunc( it->second );
+		pthread_mutex_unlock( &initfuncs_mutex );
+
+		AddCallback( CB_INIT, initfunc, new CtrlArgs(lib,World::ctrlargs) ); // pass complete string into initfunc
+		return;
+	 }
+
   /* Initialise libltdl. */
   int errors = lt_dlinit();
   if (errors)
@@ -336,10 +368,6 @@ void Model::LoadControllerModule( const char* lib )
 
   lt_dlhandle handle = NULL;
   
-  // the library name is the first word in the string
-  char libname[256];
-  sscanf( lib, "%s %*s", libname );
-  
   if(( handle = lt_dlopenext( libname ) ))
     {
       //printf( "]" );
@@ -354,6 +382,9 @@ void Model::LoadControllerModule( const char* lib )
 			 exit(-1);
 		  }
 		
+		initfuncs[libname] = initfunc;
+		pthread_mutex_unlock( &initfuncs_mutex );
+
 		AddCallback( CB_INIT, initfunc, new CtrlArgs(lib,World::ctrlargs) ); // pass complete string into initfunc
     }
   else
@@ -93,10 +93,7 @@ ModelPosition::ModelPosition( World* world,
   control_mode( CONTROL_VELOCITY ),
   drive_mode( DRIVE_DIFFERENTIAL ),
   localization_mode( LOCALIZATION_GPS ),
-  integration_error( drand48() * INTEGRATION_ERROR_MAX_X - INTEGRATION_ERROR_MAX_X/2.0,
-							drand48() * INTEGRATION_ERROR_MAX_Y - INTEGRATION_ERROR_MAX_Y/2.0,
-							drand48() * INTEGRATION_ERROR_MAX_Z - INTEGRATION_ERROR_MAX_Z/2.0,
-							drand48() * INTEGRATION_ERROR_MAX_A - INTEGRATION_ERROR_MAX_A/2.0 ),
+  integration_error(),
   wheelbase( 1.0 ),
   //public
   waypoints(),
@@ -112,6 +109,12 @@ ModelPosition::ModelPosition( World* world,
 	// position devices respond to velocity settings by default
 	velocity_enable = true;
 
+  // each robot's odometry is wrong in its own way
+  integration_error.x = Random() * INTEGRATION_ERROR_MAX_X - INTEGRATION_ERROR_MAX_X/2.0;
+  integration_error.y = Random() * INTEGRATION_ERROR_MAX_Y - INTEGRATION_ERROR_MAX_Y/2.0;
+  integration_error.z = Random() * INTEGRATION_ERROR_MAX_Z - INTEGRATION_ERROR_MAX_Z/2.0;
+  integration_error.a = Random() * INTEGRATION_ERROR_MAX_A - INTEGRATION_ERROR_MAX_A/2.0;
+
   this->SetBlobReturn( true );
   
   AddVisualizer( &wpvis, true );
@@ -415,6 +418,20 @@ void ModelPosition::Update( void  )
   Model::Update();
 }
 
+void ModelPosition::ArchiveState( StateArchive& ar )
+{
+  Model::ArchiveState( ar );
+  
+  ar.Field( goal );
+  ar.Field( control_mode );
+  ar.Field( drive_mode );
+  ar.Field( localization_mode );
+  ar.Field( integration_error );
+  ar.Field( est_pose );
+  ar.Field( est_pose_error );
+  ar.Field( est_origin );
+}
+
 void ModelPosition::Startup( void )
 {
   Model::Startup();
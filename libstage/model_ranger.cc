@@ -34,6 +34,11 @@
          range [min max]
     )
 
+      # trace the rays when the data is read, not when it is scheduled
+      lazy 0
+      # reuse the last scan while nothing it could see has changed
+      scan_cache 0
+
 		 # generic model properties with non-default values
      watts 2.0
      color_rgba [ 0 1 0 0.15 ]
@@ -59,6 +64,10 @@
    - minimum range and maximum range in meters, field of view angle in degrees. Currently fov has no effect on the sensor model, other than being shown in the confgiuration graphic for the ranger device.
    - sview[\<transducer index\>] [float float float]
    - per-transducer version of the sview property. Overrides the common setting.
+   - lazy <int>\n
+   if 1, each update only records the ranger's pose, and the rays are traced from that pose the first time the data is read (e.g. by GetRanges()). Scans that are never read cost nothing, which helps controllers that poll the sensor less often than its update interval. The world is traced as it stands at read time. Defaults to 0.
+   - scan_cache <int>\n
+   if 1, each sensor remembers the regions of the world its last scan passed through. If the sensor hasn't moved and no block has been added to or removed from those regions since, the previous ranges are reused instead of tracing the rays again. This makes stationary robots in a static neighbourhood almost free. Changing a model's ranger_return from visible to invisible (or back) without moving it is not noticed until something in the scanned regions changes. Defaults to 0.
 
 */
 
@@ -67,6 +76,7 @@
 #include "stage.hh"
 #include "worldfile.hh"
 #include "option.hh"
+#include "region.hh"
 using namespace Stg;
 
 static const watts_t RANGER_WATTSPERSENSOR = 0.2;
@@ -88,7 +98,12 @@ ModelRanger::ModelRanger( World* world,
 													Model* parent,
 													const std::string& type ) 
   : Model( world, parent, type ),
-		vis( world ) 
+		vis( world ),
+		sensors(),
+		lazy( false ),
+		scan_cache( false ),
+		stale( false ),
+		scan_pose()
 {
   PRINT_DEBUG2( "Constructing ModelRanger %d (%s)\n", 
 								id, type.c_str() );
@@ -110,6 +125,14 @@ ModelRanger::ModelRanger( World* world,
 
 ModelRanger::~ModelRanger()
 {
+	world->RemoveBatchMember( this );
+}
+
+void ModelRanger::Retire()
+{
+	// the batch controller must not steer a robot that has gone
+	world->RemoveBatchMember( this );
+	Model::Retire();
 }
 
 void ModelRanger::Startup( void )
@@ -125,9 +148,29 @@ void ModelRanger::Shutdown( void )
 
   this->SetWatts( 0 );
 
+	// nobody is listening, so don't bother tracing a pending scan
+	stale = false;
+
   Model::Shutdown();
 }
 
+void ModelRanger::ArchiveState( StateArchive& ar )
+{
+  Model::ArchiveState( ar );
+  
+  if( ! ar.Reading() )
+	 Freshen(); // store the scan we would report
+  
+  uint32_t count( sensors.size() );
+  ar.Field( count );
+  
+  for( uint32_t s=0; s<count && s<sensors.size(); s++ )
+	 {
+		ar.Field( sensors[s].ranges );
+		ar.Field( sensors[s].intensities );
+	 }
+}
+
 void ModelRanger::LoadSensor( Worldfile* wf, int entity )
 {
 	//static int c=0;
@@ -138,6 +181,30 @@ void ModelRanger::LoadSensor( Worldfile* wf, int entity )
 }
 
 
+void ModelRanger::CopyConfig( const Model& proto )
+{
+  Model::CopyConfig( proto );
+  
+  // sensors are loaded from entities of their own, so copy them, but
+  // not their data
+  const ModelRanger* rgr( dynamic_cast<const ModelRanger*>( &proto ) );
+  if( rgr == NULL )
+	 return;
+  
+  sensors.clear();
+  FOR_EACH( it, rgr->sensors )
+	 {
+		Sensor s;
+		s.pose = it->pose;
+		s.size = it->size;
+		s.range = it->range;
+		s.fov = it->fov;
+		s.sample_count = it->sample_count;
+		s.col = it->col;
+		sensors.push_back(s);
+	 }
+}
+
 void ModelRanger::Sensor::Load( Worldfile* wf, int entity )
 {
 	//static int c=0;
@@ -156,29 +223,88 @@ void ModelRanger::Sensor::Load( Worldfile* wf, int entity )
 void ModelRanger::Load( void )
 {
   Model::Load();
+
+	lazy = wf->ReadInt( wf_entity, "lazy", lazy );
+	scan_cache = wf->ReadInt( wf_entity, "scan_cache", scan_cache );
 }
 
-static bool ranger_match( Model* hit, 
-													Model* finder,
-													const void* dummy )
+// Remove repeated entries from the vector, preserving the order of
+// first appearance. Uses a small open-addressed hash table, which is
+// much faster than sorting the few thousand entries a laser scan
+// produces.
+static void RemoveDuplicates( std::vector<Region*>& regions, 
+															std::vector<Region*>& table )
 {
-  (void)dummy; // avoid warning about unused var
+	size_t size( 64 );
+	while( size < 2 * regions.size() )
+		size <<= 1;
+	
+	table.assign( size, (Region*)NULL );
+	const size_t mask( size - 1 );
+
+	size_t out( 0 );
+	for( size_t i(0); i<regions.size(); i++ )
+		{
+			Region* reg( regions[i] );
+			
+			// regions are allocated in arrays, so the low bits of the
+			// address are mostly alike: mix them before masking
+			size_t h( ((size_t)reg / sizeof(void*)) * 2654435761UL );
+			h ^= h >> 16;
+
+			for( h &= mask; table[h]; h = (h+1) & mask )
+				if( table[h] == reg )
+					break;
+			
+			if( table[h] == NULL ) // first sighting
+				{
+					table[h] = reg;
+					regions[out++] = reg;
+				}
+		}
 	
-  // Ignore the model that's looking and things that are invisible to
-  // rangers 
-  return( (!hit->IsRelated( finder )) && (sgn(hit->vis.ranger_return) != -1 ) );
-}	
+	regions.resize( out );
+}
 
 void ModelRanger::Update( void )
 {     
-	  // raytrace new range data for all sensors
-  FOR_EACH( it, sensors )
-		it->Update( this );
+	if( lazy )
+		{
+			// remember where we were when the scan was due, and leave
+			// the raytracing until someone asks for the data
+			scan_pose = GetGlobalPose();
+			stale = true;
+		}
+	else
+		{
+			const Pose origin( GetGlobalPose() + geom.pose );
+			
+			// raytrace new range data for all sensors
+			FOR_EACH( it, sensors )
+				it->Update( this, origin );
+		}
   
   Model::Update();
 }
 
-void ModelRanger::Sensor::Update( ModelRanger* mod )
+void ModelRanger::Freshen() const
+{
+	if( ! stale )
+		return;
+	
+	// the scan data is logically part of our state at the time the
+	// scan was scheduled, so filling it in doesn't change our
+	// observable constness
+	ModelRanger* self( const_cast<ModelRanger*>(this) );
+	self->stale = false;
+
+	const Pose origin( scan_pose + geom.pose );
+
+	FOR_EACH( it, self->sensors )
+		it->Update( self, origin );
+}
+
+void ModelRanger::Sensor::Update( ModelRanger* mod, const Pose& origin )
 {
 	ranges.resize( sample_count );
 	intensities.resize( sample_count );
@@ -193,20 +319,64 @@ void ModelRanger::Sensor::Update( ModelRanger* mod )
   Pose rayorg( pose );//mod->GetPose() );
 	rayorg.a += bearing;
   rayorg.z += size.z/2.0;
-  rayorg = mod->LocalToGlobal(rayorg);
+  rayorg = origin + rayorg;
   
-  // set up a ray to trace
-  Ray ray( mod, rayorg, range.max, ranger_match, NULL, true );
+  // set up a ray to trace. The predicate is given to Raytrace()
+  // below, so it is inlined into the raytrace loop.
+  Ray ray( mod, rayorg, range.max, NULL, NULL, true );
+  const RangerRayMatch match( mod );
   
 	World* world = mod->GetWorld();
 
+	Coherence* cached( NULL );
+
+	if( mod->scan_cache )
+		{
+			// the raytracer reads this layer of the world
+			const unsigned int layer( (world->GetUpdateCount()+1) % 2 );
+			const size_t superregions( world->GetSuperRegionCount() );
+			
+			cached = &cache[layer];
+			
+			if( cached->Matches( rayorg, fov, range.max, sample_count, 
+													 superregions, layer ) )
+				{
+					// nothing we could see has changed, so neither has the scan
+					for( size_t t(0); t<sample_count; t++ )
+						{
+							ranges[t] = cached->ranges[t];
+							Model* hit( cached->hits[t] );
+							intensities[t] = hit ? hit->vis.ranger_return : 0.0;
+						}
+					return;
+				}
+			
+			cached->valid = false;
+			cached->origin = rayorg;
+			cached->fov = fov;
+			cached->range = range.max;
+			cached->sample_count = sample_count;
+			cached->superregions = superregions;
+			cached->regions.clear();
+			cached->ranges.resize( sample_count );
+			cached->hits.resize( sample_count );
+			
+			ray.regions = &cached->regions;
+		}
+
   // trace the ray, incrementing its heading for each sample
   for( size_t t(0); t<sample_count; t++ )
     {
-			const RaytraceResult& r ( world->Raytrace( ray ) );
+			const RaytraceResult& r ( world->Raytrace( ray, match ) );
 			ranges[t] = r.range;
 			intensities[t] = r.mod ? r.mod->vis.ranger_return : 0.0;
 			
+			if( cached )
+				{
+					cached->ranges[t] = r.range;
+					cached->hits[t] = r.mod;
+				}
+			
 			// point the ray to the next angle
 			ray.origin.a += sample_incr;			
 
@@ -218,6 +388,44 @@ void ModelRanger::Sensor::Update( ModelRanger* mod )
 			//			ranges[t].range, 
 			//			ranges[t].reflectance );
     }
+
+	if( cached )
+		{
+			// neighbouring rays cross many of the same regions, so store
+			// each one once along with its current stamp
+			std::vector<Region*>& regions( cached->regions );
+			RemoveDuplicates( regions, cached->seen );
+			
+			const unsigned int layer( (world->GetUpdateCount()+1) % 2 );
+			
+			cached->stamps.resize( regions.size() );
+			for( size_t i(0); i<regions.size(); i++ )
+				cached->stamps[i] = regions[i]->GetStamp( layer );
+			
+			cached->valid = true;
+		}
+}
+
+bool ModelRanger::Sensor::Coherence::Matches( const Pose& origin, 
+																							radians_t fov, 
+																							meters_t range,
+																							unsigned int sample_count,
+																							size_t superregions,
+																							unsigned int layer ) const
+{
+	if( ! valid ||
+			sample_count != this->sample_count ||
+			fov != this->fov ||
+			range != this->range ||
+			superregions != this->superregions ||
+			memcmp( &origin, &this->origin, sizeof(Pose) ) != 0 )
+		return false;
+	
+	for( size_t i(0); i<regions.size(); i++ )
+		if( regions[i]->GetStamp( layer ) != stamps[i] )
+			return false;
+	
+	return true;
 }
 
 std::string ModelRanger::Sensor::String() const
@@ -365,6 +573,8 @@ void ModelRanger::Sensor::Visualize( ModelRanger::Vis* vis, ModelRanger* rgr ) c
 void ModelRanger::Print( char* prefix ) const
 {
 	Model::Print( prefix );
+
+	Freshen();
 	
 	printf( "\tRanges " );
 	for( size_t i(0); i<sensors.size(); i++ )
@@ -15,6 +15,17 @@ joules_t PowerPack::global_input = 0.0;
 joules_t PowerPack::global_capacity = 0.0;
 joules_t PowerPack::global_dissipated = 0.0;
 
+// the totals are shared by all worlds, which may be updated
+// concurrently
+static pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void AddGlobal( joules_t& total, joules_t j )
+{
+  pthread_mutex_lock( &global_mutex );
+  total += j;
+  pthread_mutex_unlock( &global_mutex );
+}
+
 PowerPack::PowerPack( Model* mod ) :
   event_vis( 2.0 * std::max( fabs(ceil(mod->GetWorld()->GetExtent().x.max)),
 									  fabs(floor(mod->GetWorld()->GetExtent().x.min))),
@@ -163,7 +174,7 @@ void PowerPack::Add( joules_t j )
 {
   joules_t amount = std::min( RemainingCapacity(), j );
   stored += amount;
-  global_stored += amount;
+  AddGlobal( global_stored, amount );
   
   if( amount > 0 ) charging = true;
 }
@@ -172,14 +183,14 @@ void PowerPack::Subtract( joules_t j )
 {
   if( stored < 0 ) // infinte supply!
 	 {
-		global_input += j; // record energy entering the system
+		AddGlobal( global_input, j ); // record energy entering the system
 		return;
 	 }
 
   joules_t amount = std::min( stored, j );  
 
   stored -= amount;  
-  global_stored -= amount;
+  AddGlobal( global_stored, -amount );
 }
 
 void PowerPack::TransferTo( PowerPack* dest, joules_t amount )
@@ -207,15 +218,13 @@ void PowerPack::TransferTo( PowerPack* dest, joules_t amount )
 
 void PowerPack::SetCapacity( joules_t cap )
 {
-  global_capacity -= capacity;
+  AddGlobal( global_capacity, cap - capacity );
   capacity = cap;
-  global_capacity += capacity;
   
   if( stored > cap )
 	 {
-		global_stored -= stored;
+		AddGlobal( global_stored, cap - stored );
 		stored = cap;
-		global_stored += stored;		
 	 }
 }
 
@@ -236,9 +245,28 @@ joules_t PowerPack::GetDissipated() const
 
 void PowerPack::SetStored( joules_t j ) 
 {
-  global_stored -= stored;
+  AddGlobal( global_stored, j - stored );
   stored = j;
-  global_stored += stored;  
+}
+
+void PowerPack::ArchiveState( StateArchive& ar )
+{
+  joules_t j( stored );
+  ar.Field( j );
+  if( ar.Reading() )
+	 SetStored( j );
+  
+  j = dissipated;
+  ar.Field( j );
+  if( ar.Reading() )
+	 {
+		AddGlobal( global_dissipated, j - dissipated );
+		dissipated = j;
+	 }
+  
+  ar.Field( charging );
+  ar.Field( last_joules );
+  ar.Field( last_watts );
 }
 
 void PowerPack::Dissipate( joules_t j )
@@ -247,7 +275,7 @@ void PowerPack::Dissipate( joules_t j )
   
   Subtract( amount );
   dissipated += amount;
-  global_dissipated += amount;
+  AddGlobal( global_dissipated, amount );
 
   output_vis.AppendValue( amount );
   stored_vis.AppendValue( stored );
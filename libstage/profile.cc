@@ -0,0 +1,456 @@
+/** profile.cc
+    Counters of the work done for each model, and the reports made
+    from them, traces of the work done by each thread, statistics of
+    raytracing and accounts of memory. See World::GetProfile(),
+    World::StartTrace(), World::GetRaytraceStats() and
+    World::MemoryStats().
+*/
+
+#include <errno.h>
+#include "stage.hh"
+#include "region.hh"
+using namespace Stg;
+
+void ProfileCounters::Clear()
+{
+  update_time = 0;
+  move_time = 0;
+  callback_time = 0;
+  controller_time = 0;
+  updates = 0;
+  moves = 0;
+  raytraces = 0;
+  cells = 0;
+  regions_skipped = 0;
+}
+
+ProfileCounters& ProfileCounters::operator+=( const ProfileCounters& other )
+{
+  update_time += other.update_time;
+  move_time += other.move_time;
+  callback_time += other.callback_time;
+  controller_time += other.controller_time;
+  updates += other.updates;
+  moves += other.moves;
+  raytraces += other.raytraces;
+  cells += other.cells;
+  regions_skipped += other.regions_skipped;
+  return *this;
+}
+
+Profile::Profile() :
+  world(),
+  sim_seconds( 0 ),
+  phase_times(),
+  world_callback_time( 0 ),
+  types(),
+  models()
+{
+}
+
+static void PrintRow( FILE* file, const Profile::Entry& entry, const char* name )
+{
+  const ProfileCounters& c( entry.counters );
+  fprintf( file, "%-24s %6u %10.3f %10.3f %10.3f %10.3f %10.3f %12llu %8.1f %8.1f\n",
+			  name,
+			  entry.count,
+			  1e3 * c.TotalTime(),
+			  1e3 * c.update_time,
+			  1e3 * c.move_time,
+			  1e3 * c.callback_time,
+			  1e3 * c.controller_time,
+			  (unsigned long long)c.raytraces,
+			  c.raytraces ? c.cells / (double)c.raytraces : 0.0,
+			  c.raytraces ? c.regions_skipped / (double)c.raytraces : 0.0 );
+}
+
+static void PrintHeader( FILE* file, const char* what )
+{
+  fprintf( file, "%-24s %6s %10s %10s %10s %10s %10s %12s %8s %8s\n",
+			  what, "count", "total ms", "update ms", "move ms",
+			  "callbk ms", "ctrl ms", "raytraces", "cells/r", "skips/r" );
+}
+
+void Profile::Print( FILE* file, size_t max_models ) const
+{
+  double phases( 0 );
+  FOR_EACH( it, phase_times )
+	 phases += *it;
+
+  fprintf( file, "\n[Profile of %s after %.1f simulated seconds: %.3f s updating, "
+			  "%.3f s in world callbacks]\n",
+			  world.c_str(), sim_seconds, phases, world_callback_time );
+
+  PrintHeader( file, "type" );
+  FOR_EACH( it, types )
+	 PrintRow( file, *it, it->name.c_str() );
+
+  const size_t shown( std::min( max_models, models.size() ) );
+  if( shown == 0 )
+	 return;
+
+  fprintf( file, "\n" );
+  PrintHeader( file, "model" );
+  for( size_t i=0; i<shown; ++i )
+	 PrintRow( file, models[i], models[i].name.c_str() );
+
+  if( shown < models.size() )
+	 fprintf( file, "(%u cheaper models not shown)\n", (unsigned int)( models.size() - shown ) );
+}
+
+static void PrintEntryJSON( FILE* file, const Profile::Entry& entry, bool with_type )
+{
+  const ProfileCounters& c( entry.counters );
+  fprintf( file, "{ \"name\": %s, ", JsonString( entry.name ).c_str() );
+  if( with_type )
+	 fprintf( file, "\"type\": %s, ", JsonString( entry.type ).c_str() );
+  else
+	 fprintf( file, "\"count\": %u, ", entry.count );
+  fprintf( file, "\"total_time\": %.6f, \"update_time\": %.6f, \"move_time\": %.6f, "
+			  "\"callback_time\": %.6f, \"controller_time\": %.6f, "
+			  "\"updates\": %llu, \"moves\": %llu, \"raytraces\": %llu, "
+			  "\"cells\": %llu, \"regions_skipped\": %llu }",
+			  c.TotalTime(), c.update_time, c.move_time,
+			  c.callback_time, c.controller_time,
+			  (unsigned long long)c.updates,
+			  (unsigned long long)c.moves,
+			  (unsigned long long)c.raytraces,
+			  (unsigned long long)c.cells,
+			  (unsigned long long)c.regions_skipped );
+}
+
+void Profile::PrintJSON( FILE* file ) const
+{
+  fprintf( file, "{\n  \"world\": %s,\n  \"sim_seconds\": %.3f,\n",
+			  JsonString( world ).c_str(), sim_seconds );
+
+  fprintf( file, "  \"phases\": {" );
+  for( size_t i=0; i<phase_times.size(); ++i )
+	 fprintf( file, "%s %s: %.6f", i ? "," : "",
+				 JsonString( World::PhaseName( (World::phase_t)i ) ).c_str(),
+				 phase_times[i] );
+  fprintf( file, " },\n" );
+
+  fprintf( file, "  \"world_callback_time\": %.6f,\n", world_callback_time );
+
+  fprintf( file, "  \"types\": [" );
+  for( size_t i=0; i<types.size(); ++i )
+	 {
+		fprintf( file, "%s\n    ", i ? "," : "" );
+		PrintEntryJSON( file, types[i], false );
+	 }
+  fprintf( file, "\n  ],\n" );
+
+  fprintf( file, "  \"models\": [" );
+  for( size_t i=0; i<models.size(); ++i )
+	 {
+		fprintf( file, "%s\n    ", i ? "," : "" );
+		PrintEntryJSON( file, models[i], true );
+	 }
+  fprintf( file, "\n  ]\n}\n" );
+}
+
+TraceRing::TraceRing( size_t capacity ) :
+  spans( capacity ),
+  next( 0 ),
+  recorded( 0 )
+{
+}
+
+void World::StartTrace( size_t spans )
+{
+  // the first world to trace arranges for the traces to be written,
+  // however the program exits
+  static bool registered( false );
+  if( ! registered )
+	 {
+		atexit( DumpTraces );
+		registered = true;
+	 }
+
+  // a ring for the main thread and each worker thread. Load() may not
+  // have made the workers' event queues yet.
+  trace_rings.assign( std::max( (size_t)worker_threads + 1, event_queues.size() ),
+							 TraceRing( spans ) );
+  trace_start = WallSeconds();
+  tracing = true;
+}
+
+bool World::WriteTrace( const std::string& filename ) const
+{
+  FILE* file( fopen( filename.c_str(), "w" ) );
+  if( file == NULL )
+	 {
+		PRINT_ERR2( "unable to write trace %s : %s",
+						filename.c_str(), strerror(errno) );
+		return false;
+	 }
+
+  uint64_t dropped( 0 );
+  FOR_EACH( it, trace_rings )
+	 dropped += it->Dropped();
+
+  const std::string world( JsonString( ReportFilename( "" ) ) );
+
+  fprintf( file, "{\n\"displayTimeUnit\": \"ms\",\n"
+			  "\"otherData\": { \"world\": %s, \"dropped_spans\": %llu },\n"
+			  "\"traceEvents\": [\n",
+			  world.c_str(), (unsigned long long)dropped );
+
+  fprintf( file, "{ \"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0,"
+			  " \"args\": { \"name\": %s } }", world.c_str() );
+
+  for( size_t t=0; t<trace_rings.size(); ++t )
+	 {
+		char thread[32];
+		if( t == 0 )
+		  snprintf( thread, sizeof(thread), "main" );
+		else
+		  snprintf( thread, sizeof(thread), "worker %u", (unsigned int)t );
+
+		fprintf( file, ",\n{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %u,"
+					" \"args\": { \"name\": \"%s\" } }", (unsigned int)t, thread );
+
+		const TraceRing& ring( trace_rings[t] );
+		for( size_t i=0; i<ring.Size(); ++i )
+		  {
+			 const TraceRing::Span& span( ring.Get(i) );
+
+			 // spans done for a model are named after it
+			 std::string name( span.name );
+			 std::string category( "world" );
+			 std::string type;
+			 if( span.model != TraceRing::NO_MODEL )
+				{
+				  category = span.name;
+				  Model* mod( Model::LookupId( span.model ) );
+				  if( mod )
+					 {
+						name = mod->Token();
+						type = mod->GetModelType();
+					 }
+				  else
+					 {
+						char buf[32];
+						snprintf( buf, sizeof(buf), "model %u", span.model );
+						name = buf;
+					 }
+				}
+
+			 fprintf( file, ",\n{ \"name\": %s, \"cat\": %s, \"ph\": \"X\", \"pid\": 0, \"tid\": %u,"
+						 " \"ts\": %.3f, \"dur\": %.3f",
+						 JsonString( name ).c_str(), JsonString( category ).c_str(), (unsigned int)t,
+						 1e6 * ( span.start - trace_start ), 1e6 * ( span.end - span.start ) );
+			 if( ! type.empty() )
+				fprintf( file, ", \"args\": { \"type\": %s }", JsonString( type ).c_str() );
+			 fprintf( file, " }" );
+		  }
+	 }
+
+  fprintf( file, "\n]\n}\n" );
+
+  const bool ok( ferror( file ) == 0 );
+  fclose( file );
+  return ok;
+}
+
+void World::DumpTraces()
+{
+  static bool dumped( false );
+  if( dumped )
+	 return;
+  dumped = true;
+
+  FOR_EACH( it, world_set )
+	 {
+		World* world( *it );
+		if( ! world->tracing )
+		  continue;
+
+		const std::string filename( world->ReportFilename( ".trace.json" ) );
+		if( world->WriteTrace( filename ) )
+		  printf( "[Trace written to %s]\n", filename.c_str() );
+	 }
+
+  fflush( stdout );
+}
+
+void RaytraceStats::Counters::Clear()
+{
+  rays = 0;
+  hits = 0;
+  misses = 0;
+  cells = 0;
+  region_jumps = 0;
+  predicate_calls = 0;
+  for( unsigned int i=0; i<BINS; ++i )
+	 histogram[i] = 0;
+}
+
+void RaytraceStats::Counters::Add( bool hit, uint64_t ray_cells,
+											  uint64_t ray_region_jumps, uint64_t ray_predicate_calls )
+{
+  ++rays;
+  if( hit )
+	 ++hits;
+  else
+	 ++misses;
+  cells += ray_cells;
+  region_jumps += ray_region_jumps;
+  predicate_calls += ray_predicate_calls;
+
+  // the bin is the number of bits in ray_cells
+  unsigned int bin( 0 );
+  while( ray_cells && bin < BINS-1 )
+	 {
+		ray_cells >>= 1;
+		++bin;
+	 }
+  ++histogram[bin];
+}
+
+RaytraceStats::Counters& RaytraceStats::Counters::operator+=( const Counters& other )
+{
+  rays += other.rays;
+  hits += other.hits;
+  misses += other.misses;
+  cells += other.cells;
+  region_jumps += other.region_jumps;
+  predicate_calls += other.predicate_calls;
+  for( unsigned int i=0; i<BINS; ++i )
+	 histogram[i] += other.histogram[i];
+  return *this;
+}
+
+void RaytraceStats::Clear()
+{
+  total.Clear();
+  types.clear();
+}
+
+RaytraceStats& RaytraceStats::operator+=( const RaytraceStats& other )
+{
+  total += other.total;
+  FOR_EACH( it, other.types )
+	 types[ it->first ] += it->second;
+  return *this;
+}
+
+static void PrintRaytraceRow( FILE* file, const char* name, const RaytraceStats::Counters& c )
+{
+  const double rays( c.rays ? c.rays : 1 );
+  fprintf( file, "%-16s %12llu %7.1f%% %10.1f %10.2f %10.2f\n",
+			  name, (unsigned long long)c.rays, 100.0 * c.hits / rays,
+			  c.cells / rays, c.region_jumps / rays, c.predicate_calls / rays );
+}
+
+void RaytraceStats::Print( FILE* file ) const
+{
+  if( ! World::RaytraceStatsEnabled() )
+	 {
+		fprintf( file, "[Raytrace statistics need a build with RAYTRACE_STATS]\n" );
+		return;
+	 }
+
+  fprintf( file, "%-16s %12s %8s %10s %10s %10s\n",
+			  "caster", "rays", "hits", "cells/r", "jumps/r", "tests/r" );
+  FOR_EACH( it, types )
+	 PrintRaytraceRow( file, it->first.empty() ? "(none)" : it->first.c_str(), it->second );
+  PrintRaytraceRow( file, "total", total );
+
+  // a histogram column for each type, up to the longest rays seen
+  unsigned int bins( 1 );
+  for( unsigned int i=0; i<BINS; ++i )
+	 if( total.histogram[i] )
+		bins = i+1;
+
+  fprintf( file, "\n%-16s", "cells per ray" );
+  FOR_EACH( it, types )
+	 fprintf( file, " %12s", it->first.empty() ? "(none)" : it->first.c_str() );
+  fprintf( file, "\n" );
+
+  for( unsigned int i=0; i<bins; ++i )
+	 {
+		char range[32];
+		if( i <= 1 )
+		  snprintf( range, sizeof(range), "%u", i );
+		else if( i == BINS-1 )
+		  snprintf( range, sizeof(range), "%u+", 1u << (i-1) );
+		else
+		  snprintf( range, sizeof(range), "%u-%u", 1u << (i-1), (1u << i) - 1 );
+
+		fprintf( file, "%-16s", range );
+		FOR_EACH( it, types )
+		  fprintf( file, " %12llu", (unsigned long long)it->second.histogram[i] );
+		fprintf( file, "\n" );
+	 }
+}
+
+MemoryUsage::Models::Models() :
+  count( 0 ),
+  blocks( 0 ),
+  rendered_cells( 0 ),
+  display_lists( 0 ),
+  display_list_bytes( 0 ),
+  trails( 0 )
+{
+}
+
+MemoryUsage::Models& MemoryUsage::Models::operator+=( const Models& other )
+{
+  count += other.count;
+  blocks += other.blocks;
+  rendered_cells += other.rendered_cells;
+  display_lists += other.display_lists;
+  display_list_bytes += other.display_list_bytes;
+  trails += other.trails;
+  return *this;
+}
+
+MemoryUsage::MemoryUsage() :
+  superregion_count( 0 ),
+  region_count( 0 ),
+  superregions( 0 ),
+  regions( 0 ),
+  cells( 0 ),
+  cell_blocks( 0 ),
+  mips( 0 ),
+  logs( 0 ),
+  types()
+{
+}
+
+MemoryUsage::Models MemoryUsage::AllModels() const
+{
+  Models all;
+  FOR_EACH( it, types )
+	 all += it->second;
+  return all;
+}
+
+static void PrintModelsRow( FILE* file, const char* name, const MemoryUsage::Models& m )
+{
+  fprintf( file, "%-16s %8u %12.3f %12.3f %8u %12.3f %12.3f %12.3f\n",
+			  name, m.count, m.blocks / 1e6, m.rendered_cells / 1e6,
+			  m.display_lists, m.display_list_bytes / 1e6, m.trails / 1e6,
+			  m.Total() / 1e6 );
+}
+
+void MemoryUsage::Print( FILE* file ) const
+{
+  fprintf( file, "%-24s %10s %12s\n", "grid", "count", "MB" );
+  fprintf( file, "%-24s %10u %12.3f\n", "superregions", superregion_count, superregions / 1e6 );
+  fprintf( file, "%-24s %10u %12.3f\n", "regions", superregion_count * SUPERREGIONSIZE, regions / 1e6 );
+  fprintf( file, "%-24s %10u %12.3f\n", "cell arrays", region_count, cells / 1e6 );
+  fprintf( file, "%-24s %10s %12.3f\n", "cell block vectors", "", cell_blocks / 1e6 );
+  fprintf( file, "%-24s %10s %12.3f\n", "coarse occupancy maps", "", mips / 1e6 );
+  fprintf( file, "%-24s %10s %12.3f\n", "log (all worlds)", "", logs / 1e6 );
+
+  fprintf( file, "\n%-16s %8s %12s %12s %8s %12s %12s %12s\n",
+			  "type", "models", "blocks MB", "rendered MB", "lists", "lists MB", "trails MB", "total MB" );
+  FOR_EACH( it, types )
+	 PrintModelsRow( file, it->first.c_str(), it->second );
+  PrintModelsRow( file, "all", AllModels() );
+
+  fprintf( file, "\n%-24s %10s %12.3f\n", "total", "", Total() / 1e6 );
+}
@@ -8,50 +8,230 @@
 #include "region.hh"
 using namespace Stg;
 
-std::vector<Cell*> Region::dead_pool;
+// protects the reference counts of shared cells, which may belong
+// to worlds being updated concurrently
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 Region::Region() : 
   cells(), 
   count(0),
+  mip(NULL),
+  shared(NULL),
   superregion(NULL)
 {
+	stamp[0] = stamp[1] = 0;
+	layer_count[0] = layer_count[1] = 0;
 }
 
 Region::~Region()
 {
-	if( cells )
+	if( shared )
+		ReleaseShared();
+	else if( cells )
 		delete[] cells;
+	if( mip )
+		delete[] mip;
 }
 
-void Region::AddBlock()
+void Region::ReleaseShared()
+{
+	pthread_mutex_lock( &shared_mutex );
+	const bool last( --*shared == 0 );
+	pthread_mutex_unlock( &shared_mutex );
+
+	if( last )
+		{
+			delete[] cells;
+			delete shared;
+		}
+	
+	cells = NULL;
+	shared = NULL;
+}
+
+Cell* Region::Unshare( Cell* cell )
+{
+	const int32_t index( cell ? cell - cells : 0 );
+	
+	Cell* old( cells );
+	Cell* copy( new Cell[REGIONSIZE] );
+	
+	for( int32_t c=0; c<REGIONSIZE; ++c )
+		{
+			copy[c].blocks[0] = old[c].blocks[0];
+			copy[c].blocks[1] = old[c].blocks[1];
+			copy[c].region = this;
+		}
+	
+	// our own blocks remember the shared cells they were rendered
+	// into, and must be pointed at the copies. Blocks borrowed from
+	// other worlds are left alone.
+	World* world( superregion->GetWorld() );
+	std::set<Block*> moved;
+	
+	for( int32_t c=0; c<REGIONSIZE; ++c )
+		for( unsigned int layer=0; layer<2; ++layer )
+			FOR_EACH( it, copy[c].blocks[layer] )
+				{
+					Block* b( *it );
+					if( b->mod->world != world || ! moved.insert( b ).second )
+						continue;
+					
+					for( unsigned int l=0; l<2; ++l )
+						FOR_EACH( rc, b->rendered_cells[l] )
+							if( *rc >= old && *rc < old + REGIONSIZE )
+								*rc = copy + (*rc - old);
+				}
+	
+	ReleaseShared();
+	cells = copy;
+	
+	return( cell ? &cells[index] : NULL );
+}
+
+bool Region::IsMapBlock( const Block* b, const World* world, 
+												 const std::set<Model*>& map_models )
+{
+	return( b->mod->world != world || map_models.count( b->mod->Root() ) );
+}
+
+void Region::CopyMap( Region& src, const std::set<Model*>& map_models )
+{
+	assert( count == 0 && shared == NULL );
+	
+	if( src.cells == NULL || src.count == 0 )
+		return;
+	
+	const World* world( src.superregion->GetWorld() );
+	
+	bool all_map( true );
+	for( int32_t c=0; c<REGIONSIZE && all_map; ++c )
+		for( unsigned int layer=0; layer<2 && all_map; ++layer )
+			FOR_EACH( it, src.cells[c].blocks[layer] )
+				if( ! IsMapBlock( *it, world, map_models ) )
+					{
+						all_map = false;
+						break;
+					}
+	
+	if( all_map )
+		{
+			pthread_mutex_lock( &shared_mutex );
+			if( src.shared == NULL )
+				src.shared = new unsigned int(1);
+			++*src.shared;
+			pthread_mutex_unlock( &shared_mutex );
+			
+			// any cells of ours are empty
+			if( cells )
+				delete[] cells;
+			
+			cells = src.cells;
+			shared = src.shared;
+			count = src.count;
+			
+			for( unsigned int layer=0; layer<2; ++layer )
+				{
+					layer_count[layer] = src.layer_count[layer];
+					zbounds[layer] = src.zbounds[layer];
+					superregion->AddBlocks( layer, layer_count[layer], zbounds[layer] );
+				}
+			
+			CreateMip();
+			if( mip && src.mip )
+				memcpy( mip, src.mip, 2 * MIPSIZE * sizeof(unsigned int) );
+			else if( mip ) // count them ourselves
+				for( int32_t c=0; c<REGIONSIZE; ++c )
+					for( unsigned int layer=0; layer<2; ++layer )
+						for( size_t b=0; b<cells[c].blocks[layer].size(); ++b )
+							UpdateMip( layer, GETCELL(c), c >> RBITS, 1 );
+			return;
+		}
+	
+	// a mixture, so copy the map blocks into cells of our own. This
+	// is Cell::AddBlock() without touching the borrowed blocks.
+	for( int32_t c=0; c<REGIONSIZE; ++c )
+		for( unsigned int layer=0; layer<2; ++layer )
+			FOR_EACH( it, src.cells[c].blocks[layer] )
+				{
+					Block* b( *it );
+					if( ! IsMapBlock( b, world, map_models ) )
+						continue;
+					
+					GetCell( GETCELL(c), c >> RBITS )->blocks[layer].push_back( b );
+					++stamp[layer];
+					AddBlock( layer, b->global_z );
+					
+					if( mip )
+						UpdateMip( layer, GETCELL(c), c >> RBITS, 1 );
+				}
+}
+
+void Region::CreateMip()
+{
+	if( mip == NULL && superregion->GetWorld()->GetOccupancyMipmap() )
+		mip = new unsigned int[2*MIPSIZE](); // zeroed
+}
+
+// extend the z range of a layer to include z, or start a new range
+// if the layer was empty
+static inline void ExtendZ( Bounds& bounds, unsigned long& count, const Bounds& z )
+{
+	if( count++ == 0 )
+		bounds = z;
+	else
+		{
+			if( z.min < bounds.min ) bounds.min = z.min;
+			if( z.max > bounds.max ) bounds.max = z.max;
+		}
+}
+
+void Region::AddBlock( unsigned int layer, const Bounds& z )
 { 
 
 	++count; 
 	assert(count>0);
-	superregion->AddBlock();
+	ExtendZ( zbounds[layer], layer_count[layer], z );
+	superregion->AddBlock( layer, z );
 }
 
-void Region::RemoveBlock()
+void Region::RemoveBlock( unsigned int layer )
 {
 	--count; 
 	assert(count>=0); 
-	superregion->RemoveBlock();
+	--layer_count[layer];
+	superregion->RemoveBlock( layer );
+}
+
+void Region::AddMemoryUsage( MemoryUsage& usage ) const
+{
+	if( mip )
+		usage.mips += 2 * MIPSIZE * sizeof(unsigned int);
 	
-	// if there's nothing in this region, we can garbage collect the
-	// cells to keep memory usage under control
-	/*	if( count == 0 )
- 		{
-			if( cells )
-			  {
-				 // stash this on the pool for reuse
-				 dead_pool.push_back(cells);					
-				 //printf( "retiring cells @ %p (pool %u)\n", cells, dead_pool.size() );
-				 cells = NULL;
-			  }
-			else
-			  PRINT_ERR( "region.count == 0 but cells == NULL" );			
- 		}		
-	*/
+	if( cells == NULL )
+		return;
+	
+	// divide shared cells between the regions sharing them. The count
+	// may change while we read it, which only skews the estimate.
+	const unsigned int users( shared ? *shared : 1 );
+	
+	uint64_t blocks( 0 );
+	for( int32_t c=0; c<REGIONSIZE; ++c )
+		blocks += cells[c].blocks[0].capacity() + cells[c].blocks[1].capacity();
+	
+	++usage.region_count;
+	usage.cells += REGIONSIZE * sizeof(Cell) / users;
+	usage.cell_blocks += blocks * sizeof(Block*) / users;
+}
+
+void SuperRegion::AddMemoryUsage( MemoryUsage& usage ) const
+{
+	++usage.superregion_count;
+	usage.superregions += sizeof(SuperRegion) - sizeof(regions);
+	usage.regions += sizeof(regions);
+	
+	for( int32_t r=0; r<SUPERREGIONSIZE; ++r )
+		regions[r].AddMemoryUsage( usage );
 }
 
 SuperRegion::SuperRegion( World* world, point_int_t origin ) 
@@ -62,6 +242,7 @@ SuperRegion::SuperRegion( World* world, point_int_t origin )
 		world(world)
 {
 	pthread_rwlock_init(&rwlock,NULL);
+	layer_count[0] = layer_count[1] = 0;
 
 	for( int32_t c=0; c<SUPERREGIONSIZE;++c)
 		regions[c].superregion = this;
@@ -72,18 +253,43 @@ SuperRegion::~SuperRegion()
 }
 
 
-void SuperRegion::AddBlock()
+void SuperRegion::AddBlock( unsigned int layer, const Bounds& z )
 { 
 	++count; 
 	assert(count>0);
+	ExtendZ( zbounds[layer], layer_count[layer], z );
 }
 
-void SuperRegion::RemoveBlock()
+void SuperRegion::RemoveBlock( unsigned int layer )
 {
 	--count; 
 	assert(count>=0); 
+	--layer_count[layer];
 }		
 
+void SuperRegion::AddBlocks( unsigned int layer, unsigned long n, const Bounds& z )
+{
+	if( n == 0 )
+		return;
+	
+	count += n;
+	
+	if( layer_count[layer] == 0 )
+		zbounds[layer] = z;
+	else
+		{
+			if( z.min < zbounds[layer].min ) zbounds[layer].min = z.min;
+			if( z.max > zbounds[layer].max ) zbounds[layer].max = z.max;
+		}
+	layer_count[layer] += n;
+}
+
+void SuperRegion::CopyMap( SuperRegion& src, const std::set<Model*>& map_models )
+{
+	for( int32_t r=0; r<SUPERREGIONSIZE; ++r )
+		regions[r].CopyMap( src.regions[r], map_models );
+}
+
 
 void SuperRegion::DrawOccupancy( unsigned int layer ) const
 {
@@ -292,15 +498,31 @@ void SuperRegion::DrawVoxels(unsigned int layer) const
 void Cell::AddBlock( Block* b, unsigned int layer )
 {			
   assert( layer < 2 );
+  assert( region->shared == NULL ); // Region::GetCell() unshares
   blocks[layer].push_back( b );   
   b->rendered_cells[layer].push_back(this);
-  region->AddBlock();
+  ++region->stamp[layer];
+  region->AddBlock( layer, b->global_z );
+	
+  if( region->mip )
+		{
+			const int32_t index( this - region->cells );
+			region->UpdateMip( layer, GETCELL(index), index >> RBITS, 1 );
+		}
 }
 
 void Cell::RemoveBlock( Block* b, unsigned int layer )
 {
   assert( layer<2 );
   
+  // shared cells are copied before they change. This cell may be
+  // freed by the copy, so use the copy from here on.
+  if( region->shared )
+	 {
+		region->Unshare( this )->RemoveBlock( b, layer );
+		return;
+	 }
+  
   std::vector<Block*>& blks = blocks[layer];
 
   size_t len = blks.size();
@@ -340,5 +562,12 @@ void Cell::RemoveBlock( Block* b, unsigned int layer )
 #endif
 	 }
 
-  region->RemoveBlock();
+  ++region->stamp[layer];
+  region->RemoveBlock( layer );
+
+  if( region->mip )
+		{
+			const int32_t index( this - region->cells );
+			region->UpdateMip( layer, GETCELL(index), index >> RBITS, -1 );
+		}
 }
@@ -24,6 +24,13 @@ namespace Stg
   const int32_t CELLMASK( ~((~0x00)<< RBITS ));
   const int32_t REGIONMASK( ~((~0x00)<< SRBITS ));
 		
+  // regions optionally keep occupancy counts at these many coarser
+  // levels, each half the resolution of the one before
+  const int32_t MIPLEVELS( 3 );
+  
+  // the number of coarse cells per layer over all levels
+  const int32_t MIPSIZE( (REGIONSIZE>>2) + (REGIONSIZE>>4) + (REGIONSIZE>>6) );
+
   inline int32_t GETCELL( const int32_t x ) { return( x & CELLMASK); }
   inline int32_t GETREG(  const int32_t x ) { return( ( x & REGIONMASK ) >> RBITS); }
   inline int32_t GETSREG( const int32_t x ) { return( x >> SRBITS); }
@@ -35,6 +42,7 @@ namespace Stg
   {
 		friend class SuperRegion;
 		friend class World;
+		friend class Region; // for sharing cells between worlds
 	 
   private:
 	 std::vector<Block*> blocks[2];		
@@ -57,14 +65,52 @@ namespace Stg
   {
 	 friend class SuperRegion;
 	 friend class World; // for raytracing
+	 friend class Cell; // for change stamps
 	 
   private:
 	 Cell* cells;
 	 unsigned long count; // number of blocks rendered into this region
 	 
-	 // vector of garbage collected cell arrays to reallocate before
-	 // using new in GetCell()
-	 static std::vector<Cell*> dead_pool;
+	 // incremented every time a block is added to or removed from a
+	 // cell in this region, one counter per layer. If the stamp
+	 // hasn't changed, the region contents haven't either.
+	 unsigned long stamp[2];
+	 
+	 // number of blocks in each layer, and the range of heights they
+	 // occupy. The range only grows while the layer is occupied, and
+	 // is reset when it empties.
+	 unsigned long layer_count[2];
+	 Bounds zbounds[2];
+	 
+	 // if the world uses coarse occupancy maps, the number of blocks
+	 // in each coarse cell of this region, for each layer and level,
+	 // otherwise NULL. Allocated along with the cells.
+	 unsigned int* mip;
+	 
+	 // if non-NULL, the cells are shared with regions of worlds
+	 // cloned from or into this one, and this counts the regions
+	 // sharing them. Shared cells are never changed: each region
+	 // copies them before its first change. See World::Clone().
+	 unsigned int* shared;
+	 
+	 // give up our reference to shared cells, freeing them if we are
+	 // the last user
+	 void ReleaseShared();
+	 
+	 // true if clones of world should borrow block b rather than copy
+	 // it. See CopyMap().
+	 static bool IsMapBlock( const Block* b, const World* world, 
+													 const std::set<Model*>& map_models );
+	 
+	 // index into mip of the coarse cell at the given level (1 to
+	 // MIPLEVELS) that contains cell (x,y)
+	 static inline int32_t MipIndex( unsigned int layer, int32_t level, 
+																	 int32_t x, int32_t y )
+	 {
+		// each level has a quarter as many cells as the one before
+		const int32_t offset( (REGIONSIZE - (REGIONSIZE >> (2*(level-1)))) / 3 );
+		return( layer * MIPSIZE + offset + (x>>level) + (y>>level) * (REGIONWIDTH>>level) );
+	 }
 	 
   public:
 	 Region();
@@ -76,23 +122,72 @@ namespace Stg
 		  {
 			 assert(count == 0 );
 			 
-			 if( dead_pool.size() )
-				{
-				  cells = dead_pool.back();
-				  dead_pool.pop_back();
-				  //printf( "reusing cells @ %p (pool %u)\n", cells, dead_pool.size() );
-				}
-			 else
-				cells = new Cell[REGIONSIZE];
+			 cells = new Cell[REGIONSIZE];
 		  	 
 			 for( int32_t c=0; c<REGIONSIZE;++c)
 				cells[c].region = this;
+			 
+			 CreateMip();
 		  } 
+		else if( shared )
+		  Unshare( NULL );
+		
 		return( &cells[ x + y * REGIONWIDTH ] );
 	 }
+	 
+	 /** Replace shared cells with a copy of our own, so that they can
+			 be changed. Returns the copy of cell, which may be NULL. */
+	 Cell* Unshare( Cell* cell );
+	 
+	 /** Add the map blocks of src, a region of another world, to this
+			 empty region. If src holds nothing else, its cells are shared
+			 rather than copied. Map blocks are those of the models in
+			 map_models, and any src has itself borrowed from another
+			 world. */
+	 void CopyMap( Region& src, const std::set<Model*>& map_models );
 	 	 
-	 inline void AddBlock();
-	 inline void RemoveBlock(); 
+	 inline void AddBlock( unsigned int layer, const Bounds& z );
+	 inline void RemoveBlock( unsigned int layer ); 
+	 
+	 // allocate the coarse occupancy maps, if the world uses them
+	 void CreateMip();
+	 
+	 // add delta to the count of the coarse cells containing cell
+	 // (x,y) in the indicated layer
+	 inline void UpdateMip( unsigned int layer, int32_t x, int32_t y, int delta )
+	 {
+		for( int32_t l(1); l<=MIPLEVELS; ++l )
+		  mip[ MipIndex( layer, l, x, y ) ] += delta;
+	 }
+	 
+	 /** Returns false if no block in the indicated layer of this
+			 region spans height z. */
+	 bool Occupied( unsigned int layer, meters_t z ) const
+	 { 
+		return( layer_count[layer] && 
+						z >= zbounds[layer].min && z <= zbounds[layer].max ); 
+	 }
+	 
+	 /** Returns the coarsest level (1 to MIPLEVELS) at which the
+			 coarse cell containing cell (x,y) is empty in the indicated
+			 layer, or 0 if there is no such level or no coarse maps. */
+	 int32_t EmptyMipLevel( unsigned int layer, int32_t x, int32_t y ) const
+	 {
+		int32_t level(0);
+		// a coarse cell can only be empty if the finer ones inside it are
+		if( mip ) 
+		  while( level < MIPLEVELS && mip[ MipIndex( layer, level+1, x, y ) ] == 0 )
+			 ++level;
+		return level;
+	 }
+	 
+	 /** Returns the change stamp of the indicated layer. */
+	 unsigned long GetStamp( unsigned int layer ) const { return stamp[layer]; }
+	 
+	 /** Add the memory used by the cells and coarse maps of this
+			 region to usage. Cells shared with other worlds are divided
+			 between them. */
+	 void AddMemoryUsage( MemoryUsage& usage ) const;
 	 
 	 SuperRegion* superregion;	
 	 
@@ -102,6 +197,11 @@ namespace Stg
   {
   private:
 	 unsigned long count; // number of blocks rendered into this superregion
+	 
+	 // as in Region
+	 unsigned long layer_count[2];
+	 Bounds zbounds[2];
+	 
 	 pthread_rwlock_t rwlock;
 	 point_int_t origin;
 	 Region regions[SUPERREGIONSIZE];
@@ -123,10 +223,30 @@ namespace Stg
 	 inline void WriteLock(){ pthread_rwlock_wrlock( &rwlock); }
 	 inline void Unlock(){ pthread_rwlock_unlock( &rwlock); }
 	 
-	 inline void AddBlock();
-	 inline void RemoveBlock();		
+	 inline void AddBlock( unsigned int layer, const Bounds& z );
+	 inline void RemoveBlock( unsigned int layer );		
+	 
+	 // account for n blocks spanning z being added to the layer at once
+	 void AddBlocks( unsigned int layer, unsigned long n, const Bounds& z );
+	 
+	 /** As Region::CopyMap(), for every region of this empty
+			 superregion. */
+	 void CopyMap( SuperRegion& src, const std::set<Model*>& map_models );
+	 
+	 /** Returns false if no block in the indicated layer of this
+			 superregion spans height z. */
+	 bool Occupied( unsigned int layer, meters_t z ) const
+	 { 
+		return( layer_count[layer] && 
+						z >= zbounds[layer].min && z <= zbounds[layer].max ); 
+	 }
 	 
 	 const point_int_t& GetOrigin() const { return origin; }
+	 World* GetWorld() const { return world; }
+	 
+	 /** Add the memory used by this superregion and its regions to
+			 usage */
+	 void AddMemoryUsage( MemoryUsage& usage ) const;
   }; // class SuperRegion;
   
   }; // namespace Stg
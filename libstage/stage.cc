@@ -202,6 +202,52 @@ point_t* Stg::unit_square_points_create( void )
   return pts;
 }
 
+// RANDOM NUMBERS ---------------------------------------------------
+
+void RandomStream::Seek( uint64_t key, uint64_t tick )
+{
+  this->key = key;
+  this->tick = tick;
+  count = 0;
+  started = true;
+  cached = NONE;
+}
+
+void RandomStream::Generate( uint32_t block )
+{
+  uint32_t ctr[4] = { block, (uint32_t)tick, (uint32_t)(tick >> 32), 0 };
+  uint32_t k[2] = { (uint32_t)key, (uint32_t)(key >> 32) };
+  
+  for( int round=0; round<10; ++round )
+	 {
+		const uint64_t p0( (uint64_t)0xD2511F53 * ctr[0] );
+		const uint64_t p1( (uint64_t)0xCD9E8D57 * ctr[2] );
+		
+		const uint32_t next[4] = { (uint32_t)(p1 >> 32) ^ ctr[1] ^ k[0],
+											(uint32_t)p1,
+											(uint32_t)(p0 >> 32) ^ ctr[3] ^ k[1],
+											(uint32_t)p0 };
+		memcpy( ctr, next, sizeof(ctr) );
+		
+		k[0] += 0x9E3779B9;
+		k[1] += 0xBB67AE85;
+	 }
+  
+  memcpy( out, ctr, sizeof(out) );
+  cached = block;
+}
+
+void RandomStream::ArchiveState( StateArchive& ar )
+{
+  ar.Field( key );
+  ar.Field( tick );
+  ar.Field( count );
+  ar.Field( started );
+  
+  if( ar.Reading() )
+	 cached = NONE;
+}
+
 // return a value based on val, but limited minval <= val >= maxval  
 double Stg::constrain( double val, const double minval, const double maxval )
 {
@@ -214,3 +260,16 @@ double Stg::constrain( double val, const double minval, const double maxval )
   return val;
 }
 
+// quote str for JSON
+std::string Stg::JsonString( const std::string& str )
+{
+  std::string quoted( "\"" );
+  FOR_EACH( it, str )
+	 {
+		if( *it == '"' || *it == '\\' )
+		  quoted += '\\';
+		quoted += *it;
+	 }
+  return quoted + '"';
+}
+
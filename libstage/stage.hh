@@ -569,6 +569,9 @@ namespace Stg
   
   // return val, or minval if val < minval, or maxval if val > maxval
   double constrain( double val, double minval, double maxval );
+
+  // return str in double quotes, escaped for JSON
+  std::string JsonString( const std::string& str );
     
   typedef struct 
   {
@@ -700,6 +703,14 @@ namespace Stg
 
 	 void Load( Worldfile* wf, int section );
 	 void Save( Worldfile* wf, int section );	 
+
+	 /** Append mod to the children, keeping its name */
+	 virtual void AttachChild( Model* mod );
+
+	 /** Remove mod from the children in constant time, by moving the
+		  last child into its place. Unlike RemoveChild(), the name of
+		  mod is not given to the next child of its type. */
+	 virtual void DetachChild( Model* mod );
 	 	 	 
   public:	
     Ancestor();
@@ -732,6 +743,175 @@ namespace Stg
 		}
   };
 
+  // defined in stage_internal.hh
+  class Region;
+  class SuperRegion;
+  class BlockGroup;
+  class PowerPack;
+  class StateArchive;
+
+  /** A stream of random numbers from the Philox4x32-10 counter-based
+      generator (Salmon et al., "Parallel random numbers: as easy as
+      1, 2, 3", SC 2011). The n'th number of the stream with a given
+      key and tick is a pure function of the key, the tick and n, so
+      streams share no state, and any stream can be restarted at any
+      tick. See Model::Random(). */
+  class RandomStream
+  {
+  public:
+	 RandomStream() : key(0), tick(0), count(0), started(false), cached(NONE) {}
+	 
+	 /** Restart the stream at its first number for the given key and
+		  tick */
+	 void Seek( uint64_t key, uint64_t tick );
+	 
+	 /** Returns the next number in the stream */
+	 uint32_t Next()
+	 {
+		const uint32_t block( count / 4 );
+		if( block != cached )
+		  Generate( block );
+		return out[ count++ % 4 ];
+	 }
+	 
+	 bool Started() const { return started; }
+	 uint64_t Tick() const { return tick; }
+	 
+	 /** Read or write the position in the stream */
+	 void ArchiveState( StateArchive& ar );
+	 
+  private:
+	 uint64_t key;
+	 uint64_t tick;
+	 uint32_t count; ///< numbers drawn since the last Seek()
+	 bool started; ///< false until the first Seek()
+	 
+	 static const uint32_t NONE = 0xffffffff;
+	 uint32_t cached; ///< the block of four numbers held in out, or NONE
+	 uint32_t out[4];
+	 
+	 /** Compute the block'th block of four numbers into out */
+	 void Generate( uint32_t block );
+  };
+
+  /** Reads or writes the changing state of a simulation as binary
+      data in memory. The same Field() calls do both, so each class
+      lists its state once. Used by World::Checkpoint(),
+      World::Restore() and World::Clone(). Values are stored in the
+      byte order of the host, so checkpoints are not portable between
+      machines of different endianness. */
+  class StateArchive
+  {
+  public:
+	 /** An empty archive, ready for writing */
+	 StateArchive() : data(), pos(0), reading(false), ok(true) {}
+	 
+	 /** true if Field() reads values from the archive into its
+		  arguments, false if it writes its arguments into the archive */
+	 bool Reading() const { return reading; }
+	 
+	 /** false if a read ran past the end of the data, a file could
+		  not be read or written, or a reader called Fail() */
+	 bool Ok() const { return ok; }
+	 
+	 /** Mark the archive as not ok, for a reader that finds data that
+		  doesn't match what it is reading into */
+	 void Fail(){ ok = false; }
+	 
+	 /** Start reading from the beginning of the data */
+	 void Rewind(){ reading = true; pos = 0; }
+	 
+	 /** Read or write a value of a plain type, such as a number or an
+		  enum */
+	 template <class T> void Field( T& value )
+	 {
+		if( reading )
+		  {
+			 if( pos + sizeof(T) > data.size() )
+				{
+				  ok = false;
+				  return;
+				}
+			 memcpy( &value, &data[pos], sizeof(T) );
+			 pos += sizeof(T);
+		  }
+		else
+		  {
+			 data.resize( data.size() + sizeof(T) );
+			 memcpy( &data[data.size() - sizeof(T)], &value, sizeof(T) );
+		  }
+	 }
+	 
+	 /** Read or write a vector of plain values */
+	 template <class T> void Field( std::vector<T>& values )
+	 {
+		uint32_t count( values.size() );
+		Field( count );
+		if( ! ok ) 
+		  return;
+		if( reading )
+		  values.resize( count );
+		for( uint32_t i=0; i<count; ++i )
+		  Field( values[i] );
+	 }
+	 
+	 /** Read or write a vector of values of a plain type as a single
+		  block, which is much faster for long vectors than Field() */
+	 template <class T> void Array( std::vector<T>& values )
+	 {
+		uint32_t count( values.size() );
+		Field( count );
+		if( ! ok )
+		  return;
+		
+		const size_t len( count * sizeof(T) );
+		if( reading )
+		  {
+			 if( pos + len > data.size() )
+				{
+				  ok = false;
+				  return;
+				}
+			 values.resize( count );
+			 if( len )
+				memcpy( &values[0], &data[pos], len );
+			 pos += len;
+		  }
+		else if( len )
+		  {
+			 data.resize( data.size() + len );
+			 memcpy( &data[data.size() - len], &values[0], len );
+		  }
+	 }
+	 
+	 /** Read or write another archive as a single value, so that a
+		  reader can skip it. After reading, nested is ready to be read
+		  from. */
+	 void Field( StateArchive& nested );
+	 
+	 void Field( std::string& str );
+	 void Field( Pose& pose );
+	 void Field( Velocity& vel ){ Field( (Pose&)vel ); }
+	 void Field( Color& col );
+	 
+	 /** Replace the data with the contents of the file at path.
+		  Returns false on failure. */
+	 bool Load( const std::string& path );
+	 
+	 /** Write the data to the file at path. Returns false on
+		  failure. */
+	 bool Save( const std::string& path );
+	 
+	 /** Bytes of data in the archive */
+	 size_t Size() const { return data.size(); }
+	 
+  private:
+	 std::vector<char> data;
+	 size_t pos; ///< where the next value is read from
+	 bool reading;
+	 bool ok;
+  };
+
   /** raytrace sample
    */
   class RaytraceResult
@@ -752,10 +932,10 @@ namespace Stg
   {
   public:
 	 Ray( const Model* mod, const Pose& origin, const meters_t range, const ray_test_func_t func, const void* arg, const bool ztest ) :
-		mod(mod), origin(origin), range(range), func(func), arg(arg), ztest(ztest)
+		mod(mod), origin(origin), range(range), func(func), arg(arg), ztest(ztest), regions(NULL)
 	 {}
 
-	 Ray() : mod(NULL), origin(0,0,0,0), range(0), func(NULL), arg(NULL), ztest(true)
+	 Ray() : mod(NULL), origin(0,0,0,0), range(0), func(NULL), arg(NULL), ztest(true), regions(NULL)
 	 {}
 		
 		const Model* mod;
@@ -764,14 +944,48 @@ namespace Stg
 		ray_test_func_t func;
 		const void* arg;
 	 bool ztest;		
+		/** If non-NULL, every region the ray passes through is appended
+				to this vector. */
+		std::vector<Region*>* regions;
   };
-		
 
-  // defined in stage_internal.hh
-  class Region;
-  class SuperRegion;
-  class BlockGroup;
-  class PowerPack;
+  /** Ray predicates that can be passed to World::Raytrace() instead
+			of a ray_test_func_t. The raytrace loop is compiled separately
+			for each of these, so the test is inlined rather than called
+			through a pointer for every block the ray meets. */
+
+  /** Calls a ray_test_func_t, for user-supplied predicates. */
+  class FuncRayMatch
+  {
+  public:
+	 FuncRayMatch( const ray_test_func_t func, const Model* finder, const void* arg )
+		: func(func), finder((Model*)finder), arg(arg) {}
+	 inline bool operator()( Model* candidate ) const;
+  private:
+	 ray_test_func_t func;
+	 Model* finder;
+	 const void* arg;
+  };
+
+  /** Matches any model not related to the finder, i.e. not in the
+			same tree of models. Used by fiducial and blobfinder. */
+  class UnrelatedRayMatch
+  {
+  public:
+	 explicit UnrelatedRayMatch( const Model* finder );
+	 inline bool operator()( Model* candidate ) const;
+  protected:
+	 const Model* root; ///< the top-level ancestor of the finder
+  };
+
+  /** Matches models not related to the finder that are visible to
+			rangers. */
+  class RangerRayMatch : public UnrelatedRayMatch
+  {
+  public:
+	 explicit RangerRayMatch( const Model* finder ) : UnrelatedRayMatch(finder) {}
+	 inline bool operator()( Model* candidate ) const;
+  };
 
   class LogEntry
   {
@@ -804,6 +1018,288 @@ namespace Stg
 	 CtrlArgs( std::string w, std::string c ) : worldfile(w), cmdline(c) {}
   };
 
+  class ModelRanger;
+  class ModelPosition;
+
+  /** A group of robots driven by a single controller. Each member is
+			a ranger and the position model that carries it. Once per
+			update in which any member's ranger has produced a new scan,
+			the batch callback is called with the scans and poses of all
+			the members packed into contiguous arrays, and returns a
+			velocity command for each member in the output arrays. The
+			commands are applied with ModelPosition::SetSpeed() after the
+			callback returns. Member i's data is at index i of each
+			per-member array. */
+  class RangerBatch
+  {
+		friend class World;
+  public:
+		typedef void (*callback_t)( World* world, RangerBatch& batch, void* user );
+
+		// members
+		std::vector<ModelRanger*> rangers;
+		std::vector<ModelPosition*> positions;
+
+		// inputs, refreshed before each call
+		std::vector<meters_t> x; ///< global x of each position model
+		std::vector<meters_t> y; ///< global y of each position model
+		std::vector<radians_t> a; ///< global heading of each position model
+		std::vector<meters_t> ranges; ///< all samples of all members' sensors, member by member
+		std::vector<radians_t> bearings; ///< direction of each sample in ranges, relative to its position model's heading
+		/** member i's samples are ranges[offsets[i]] up to but not
+				including ranges[offsets[i+1]]. Within a member, samples are
+				in sensor order, then in scan order. */
+		std::vector<size_t> offsets;
+
+		// outputs, preset to each member's current velocity
+		// command. Members whose commands are left unchanged are not
+		// sent a new one.
+		std::vector<double> vx; ///< forward speed command for each member
+		std::vector<double> vy; ///< sideways speed command for each member
+		std::vector<double> va; ///< turn speed command for each member
+
+		/** Returns the number of members */
+		size_t Size() const { return rangers.size(); }
+
+  private:
+		callback_t cb;
+		void* user;
+		usec_t last_call; ///< sim time of the last call, for spotting new scans
+		std::vector<Velocity> preset; ///< the outputs as they were before the call
+
+		RangerBatch( callback_t cb, void* user );
+
+		void Add( ModelRanger* ranger, ModelPosition* position );
+		bool Remove( ModelRanger* ranger );
+
+		/** Fill the input and output arrays from the members. Returns
+				false if no member has a new scan since the last call, in
+				which case the callback need not be called. */
+		bool Pack( usec_t now );
+
+		/** Send the output arrays to the members' position models */
+		void Apply();
+  };
+
+  /** Counts the work done for a model, or for all the models of a
+			type, in a world with profiling enabled. Times are wall-clock
+			seconds. The time of a model's callbacks is counted only in
+			callback_time, not in the update or move that called them. See
+			World::GetProfile(). */
+  class ProfileCounters
+  {
+  public:
+	 double update_time; ///< in the model's events, which are mostly Update()
+	 double move_time; ///< in Move()
+	 double callback_time; ///< in CallCallbacks(), for callbacks of all types
+	 double controller_time; ///< the part of callback_time in CB_UPDATE callbacks, which run the controllers
+	 uint64_t updates; ///< events handled
+	 uint64_t moves; ///< calls of Move()
+	 uint64_t raytraces; ///< rays traced on behalf of the model
+	 uint64_t cells; ///< cells examined by those rays
+	 uint64_t regions_skipped; ///< empty regions those rays jumped over
+
+	 ProfileCounters() { Clear(); }
+
+	 void Clear();
+
+	 /** Returns the time spent on the model in all */
+	 double TotalTime() const { return( update_time + move_time + callback_time ); }
+
+	 ProfileCounters& operator+=( const ProfileCounters& other );
+  };
+
+  /** A snapshot of the profile of a world, summed by model type and
+			listed by model. See World::GetProfile(). */
+  class Profile
+  {
+  public:
+	 class Entry
+	 {
+	 public:
+		std::string name; ///< the model's token, or the type's name
+		std::string type; ///< the model's type
+		unsigned int count; ///< the number of models summed
+		ProfileCounters counters;
+
+		Entry() : name(), type(), count(0), counters() {}
+	 };
+
+	 std::string world; ///< the world's token
+	 double sim_seconds; ///< simulated time when the snapshot was taken
+	 std::vector<double> phase_times; ///< indexed by World::phase_t, as World::PhaseTime()
+	 double world_callback_time; ///< in batch and world update callbacks
+	 std::vector<Entry> types; ///< one per model type, most expensive first
+	 std::vector<Entry> models; ///< one per model, most expensive first
+
+	 Profile();
+
+	 /** Print the types, and the max_models most expensive models, as
+			 a table */
+	 void Print( FILE* file, size_t max_models=20 ) const;
+
+	 /** Print everything as a JSON object */
+	 void PrintJSON( FILE* file ) const;
+  };
+
+  /** A ring of the spans of time recorded by one thread of a world
+			that is tracing. Each ring is written by one thread only, so
+			recording a span takes no lock. When the ring is full the
+			oldest spans are overwritten. See World::StartTrace(). */
+  class TraceRing
+  {
+  public:
+	 /** the model of a span not done for any one model */
+	 static const uint32_t NO_MODEL = 0xFFFFFFFF;
+
+	 class Span
+	 {
+	 public:
+		const char* name; ///< what was done. Must be a string constant.
+		uint32_t model; ///< the id of the model it was done for, or NO_MODEL
+		double start; ///< wall-clock seconds, as World::WallSeconds()
+		double end;
+	 };
+
+	 TraceRing( size_t capacity=0 );
+
+	 void Record( const char* name, uint32_t model, double start, double end )
+	 {
+		if( spans.empty() )
+		  return;
+
+		Span& span( spans[next] );
+		span.name = name;
+		span.model = model;
+		span.start = start;
+		span.end = end;
+
+		if( ++next == spans.size() )
+		  next = 0;
+		++recorded;
+	 }
+
+	 /** Returns the number of spans held */
+	 size_t Size() const { return( recorded < spans.size() ? recorded : spans.size() ); }
+
+	 /** Returns the ith span held, oldest first */
+	 const Span& Get( size_t i ) const
+	 { return spans[ recorded < spans.size() ? i : ( next + i ) % spans.size() ]; }
+
+	 /** Returns the number of spans overwritten */
+	 uint64_t Dropped() const { return( recorded - Size() ); }
+
+	 void Clear() { next = 0; recorded = 0; }
+
+  private:
+	 std::vector<Span> spans;
+	 size_t next; ///< where the next span goes
+	 uint64_t recorded; ///< spans recorded since the last Clear()
+
+	 /** keeps the counters of rings written by different threads out
+		  of each other's cache lines */
+	 char padding[64];
+  };
+
+  /** Counts of the work done by World::Raytrace(), summed for all
+			rays and for the rays cast by each model type. Counted only if
+			Stage was built with the CMake option RAYTRACE_STATS, since
+			counting slows the raytrace loop. See
+			World::GetRaytraceStats(). */
+  class RaytraceStats
+  {
+  public:
+	 /** bins of the histogram of cells stepped through per ray. Bin 0
+		  counts rays that stepped through no cells, and bin i>0 rays
+		  that stepped through [2^(i-1),2^i) cells, the last bin taking
+		  all longer rays. */
+	 static const unsigned int BINS = 16;
+
+	 class Counters
+	 {
+	 public:
+		uint64_t rays;
+		uint64_t hits; ///< rays that found a matching block
+		uint64_t misses; ///< rays that reached their range
+		uint64_t cells; ///< cells stepped through
+		uint64_t region_jumps; ///< empty regions jumped over
+		uint64_t predicate_calls; ///< blocks tested with the ray's match predicate
+		uint64_t histogram[BINS];
+
+		Counters() { Clear(); }
+
+		void Clear();
+
+		/** Count a ray */
+		void Add( bool hit, uint64_t cells, uint64_t region_jumps, uint64_t predicate_calls );
+
+		Counters& operator+=( const Counters& other );
+	 };
+
+	 Counters total; ///< all the rays
+	 std::map<std::string,Counters> types; ///< the rays cast by each model type, or by no model ("")
+
+	 void Clear();
+
+	 RaytraceStats& operator+=( const RaytraceStats& other );
+
+	 /** Print the counters of each model type and the total as a
+		  table, followed by their histograms */
+	 void Print( FILE* file ) const;
+  };
+
+  /** The memory used by a world, in bytes, by the structures that
+			grow with its size and number of models. Memory allocated by
+			the models' own subclasses is not counted. See
+			World::MemoryStats(). */
+  class MemoryUsage
+  {
+  public:
+	 /** The memory of the models of one type */
+	 class Models
+	 {
+	 public:
+		unsigned int count; ///< models of the type
+		uint64_t blocks; ///< Block objects and the point vectors inside them
+		uint64_t rendered_cells; ///< Block::rendered_cells, the cells each block is mapped into
+		unsigned int display_lists; ///< OpenGL display lists drawing the models' blocks, counting shared lists once per model
+		uint64_t display_list_bytes; ///< an estimate of the vertex data in them, held by the OpenGL driver
+		uint64_t trails; ///< the recent poses drawn as trails
+
+		Models();
+
+		uint64_t Total() const
+		{ return( blocks + rendered_cells + display_list_bytes + trails ); }
+
+		Models& operator+=( const Models& other );
+	 };
+
+	 unsigned int superregion_count;
+	 unsigned int region_count; ///< regions that have cells
+	 uint64_t superregions; ///< SuperRegion objects, without the regions inside them
+	 uint64_t regions; ///< Region objects, allocated a superregion at a time
+	 uint64_t cells; ///< the arrays of cells of regions
+	 uint64_t cell_blocks; ///< the vectors of blocks in each cell
+	 uint64_t mips; ///< coarse occupancy maps, if the world uses them
+	 uint64_t logs; ///< LogEntry::log, shared by all worlds
+	 std::map<std::string,Models> types; ///< the models of each type
+
+	 MemoryUsage();
+
+	 /** Returns the memory used by the raytracing grid */
+	 uint64_t Grid() const
+	 { return( superregions + regions + cells + cell_blocks + mips ); }
+
+	 /** Returns the memory used by the models of all types */
+	 Models AllModels() const;
+
+	 uint64_t Total() const { return( Grid() + logs + AllModels().Total() ); }
+
+	 /** Print a table of the memory used by each structure and each
+		  model type */
+	 void Print( FILE* file ) const;
+  };
+
   /// %World class
   class World : public Ancestor
   {
@@ -830,6 +1326,18 @@ namespace Stg
 	 static std::vector<std::string> args;
 	 static std::string ctrlargs;
 
+	 /** The phases of Update(), timed while TimePhases() is enabled */
+	 typedef enum
+		{
+		  PHASE_FIDUCIALS = 0, ///< sorting the fiducial models by position
+		  PHASE_MAIN_QUEUE, ///< handling the events of the main thread
+		  PHASE_WORKER_QUEUES, ///< waiting for the worker threads' events
+		  PHASE_MOVE, ///< moving the models that have velocities
+		  PHASE_CALLBACKS, ///< calling the update callbacks
+		  PHASE_ENERGY, ///< charging and draining power packs
+		  PHASE_COUNT
+		} phase_t;
+
   private:
 	
     static std::set<World*> world_set; ///< all the worlds that exist
@@ -839,6 +1347,49 @@ namespace Stg
 	 
     bool destroy;
     bool dirty; ///< iff true, a gui redraw would be required
+
+	 bool time_phases; ///< iff true, Update() accumulates phase_times
+	 double phase_times[PHASE_COUNT]; ///< wall-clock seconds spent in each phase of Update()
+
+	 bool profiling; ///< iff true, the models count their work. See GetProfile().
+	 double world_callback_time; ///< time in batch and world callbacks while profiling
+
+	 bool tracing; ///< iff true, spans of time are recorded in trace_rings. See StartTrace().
+	 double trace_start; ///< wall-clock time when tracing started
+	 std::vector<TraceRing> trace_rings; ///< one for each event queue, written by the thread that consumes it
+
+	 /** Record a span from start until now, done by the thread that
+		  consumes event queue thread */
+	 void Trace( unsigned int thread, const char* name, uint32_t model, double start )
+	 {
+		if( thread < trace_rings.size() )
+		  trace_rings[thread].Record( name, model, start, WallSeconds() );
+	 }
+
+	 /** Returns the name of a file for a report on this world, made
+		  from the world's name without its directory and the suffix */
+	 std::string ReportFilename( const char* suffix ) const;
+
+	 /** Add the time since start to the time spent in phase, and
+		  restart the clock, if phases are being timed */
+	 void EndPhase( phase_t phase, double& start );
+
+	 /** Add a ray's work to the profile of the model that cast it */
+	 void CountRaytrace( const Model* mod, uint64_t cells, uint64_t regions_skipped ) const;
+
+	 RaytraceStats raytrace_stats; ///< the rays of the latest Update()
+	 RaytraceStats raytrace_totals; ///< the rays since the world was created
+	 RaytraceStats::Counters raytrace_unowned; ///< rays cast by no model since the last Update()
+	 pthread_mutex_t raytrace_stats_mutex; ///< protects raytrace_unowned
+
+	 /** Add a ray to the raytrace statistics of the model that cast
+		  it, if Stage was built with RAYTRACE_STATS */
+	 void CountRaytraceStats( const Model* mod, bool hit, uint64_t cells,
+										uint64_t region_jumps, uint64_t predicate_calls );
+
+	 /** Replace raytrace_stats with the rays cast since the last
+		  Update(), and add them to raytrace_totals */
+	 void CollectRaytraceStats();
 	 
 	 /** Pointers to all the models in this world. */
 	 std::set<Model*> models;
@@ -848,6 +1399,23 @@ namespace Stg
 
 	 /** pointers to the models that make up the world, indexed by worldfile entry index */
 	 std::map<int,Model*> models_by_wfentity;
+
+	 /** Models retired by RetireModel(), indexed by type, waiting to
+		  be reused by CreateModel(). */
+	 std::map<std::string,ModelPtrVec> retired_models;
+
+	 /** Create a model of the given type, never reusing a retired
+		  one. Models loaded from a worldfile or copied from a
+		  prototype must start from scratch. */
+	 Model* NewModel( Model* parent, const std::string& typestr );
+
+	 /** Remove every event queued for mod. Takes time in proportion to
+		  the number of queued events, so it is only used when a model
+		  with events still queued is destroyed. */
+	 void Dequeue( Model* mod );
+
+	 /** Remove all the queued events */
+	 void ClearQueues();
 		
 	 /** Keep a list of all models with detectable fiducials. This
 		  avoids searching the whole world for fiducials. */
@@ -863,6 +1431,13 @@ namespace Stg
 			bool operator()(const Model* a, const Model* b) const;
 		};
 		
+		/** Orders models by id, which unlike their addresses is the same
+				from run to run */
+		struct ltid
+		{
+			bool operator()(const Model* a, const Model* b) const;
+		};
+		
 		/** maintain a set of models with fiducials sorted by pose.x, for
 				quickly finding nearby fidcucials */
 		std::set<Model*,ltx> models_with_fiducials_byx;
@@ -884,7 +1459,13 @@ namespace Stg
 		EraseAll( mod, models_with_fiducials );
 	 }
 
+	 /** The raytrace loop, compiled once for each predicate type and
+		  z-test setting. */
+	 template <class Match, bool ztest>
+	 RaytraceResult RaytraceKernel( const Ray& ray, const Match& match );
+
     double ppm; ///< the resolution of the world model in pixels per meter   
+    bool occupancy_mipmap; ///< iff true, regions keep coarse occupancy maps for raytracing
     bool quit; ///< quit this world ASAP  
 	 
 	 bool show_clock; ///< iff true, print the sim time on stdout
@@ -892,6 +1473,8 @@ namespace Stg
 		
     pthread_mutex_t sync_mutex; ///< protect the worker thread management stuff
 		unsigned int threads_working; ///< the number of worker threads not yet finished
+		unsigned int worker_rounds; ///< the number of times the worker threads have been started
+		unsigned int worker_rounds_at_start; ///< worker_rounds when the worker threads were created
     pthread_cond_t threads_start_cond; ///< signalled to unblock worker threads
     pthread_cond_t threads_done_cond; ///< signalled by last worker thread to unblock main thread
     int total_subs; ///< the total number of subscriptions to all models
@@ -916,6 +1499,11 @@ namespace Stg
 	 
     uint64_t updates; ///< the number of simulated time steps executed so far
     Worldfile* wf; ///< If set, points to the worldfile used to create this world
+		uint64_t random_seed; ///< keys the random streams of all models. See Model::Random().
+
+		/** Returns true if clones of this world should share mod and its
+				descendants rather than copy them. See Clone(). */
+		bool IsMapModel( Model* mod ) const;
 
 	 void CallUpdateCallbacks(); ///< Call all calbacks in cb_list, removing any that return true;
 
@@ -947,6 +1535,26 @@ namespace Stg
 		  AddUpdateCallback is not automatically freed. */
 	 int RemoveUpdateCallback( world_callback_t cb, void* user );
 
+	 /** Add a robot to the batch controlled by callback cb with
+		  argument user, creating the batch if this is its first
+		  member. The ranger and position models must be subscribed by
+		  the caller as usual. Typically called from each robot's
+		  controller Init() function with the same cb and user, so that
+		  the whole swarm ends up in one batch. */
+	 void AddBatchMember( RangerBatch::callback_t cb, void* user,
+								 ModelRanger* ranger, ModelPosition* position );
+
+	 /** Remove a robot from the batch controlled by callback cb with
+		  argument user. The batch is destroyed when its last member is
+		  removed. Returns the number of members left in the batch. Must
+		  not be called from within the batch's own callback. */
+	 int RemoveBatchMember( RangerBatch::callback_t cb, void* user,
+								  ModelRanger* ranger );
+
+	 /** Remove a ranger from every batch it belongs to. Called when
+		  the ranger is destroyed. */
+	 void RemoveBatchMember( ModelRanger* ranger );
+
 	 /** Log the state of a Model */
 	 void Log( Model* mod );
 
@@ -960,7 +1568,25 @@ namespace Stg
 		  time. */
     virtual std::string ClockString( void ) const;
 		
+	 /** Create a model of the given type, as a child of parent or at
+		  the top level if parent is NULL. If a model of the same type
+		  has been retired with RetireModel(), it is reused instead of
+		  allocating a new one. */
 	 Model* CreateModel( Model* parent, const std::string& typestr );	 
+
+	 /** Remove mod and its descendants from the simulation, keeping
+		  them to be reused by CreateModel(), so that a world where
+		  models come and go does not allocate once it has reached its
+		  largest population. The models are unsubscribed, lose all
+		  their callbacks, including those of their controllers, and
+		  are removed from the world in constant time. A reused model
+		  is placed at the origin of its new parent, but otherwise
+		  keeps the configuration it had when it was retired, such as
+		  its size, color and blocks. If it goes back to the parent it
+		  was retired from, it also keeps its name. Retired models are
+		  owned by the world, and must not be deleted. */
+	 void RetireModel( Model* mod );
+
     void LoadModel( Worldfile* wf, int entity );
     void LoadBlock( Worldfile* wf, int entity );
     void LoadBlockGroup( Worldfile* wf, int entity );
@@ -977,6 +1603,10 @@ namespace Stg
     SuperRegion* AddSuperRegion( const point_int_t& coord );
     SuperRegion* GetSuperRegion( const point_int_t& org );
     SuperRegion* GetSuperRegionCreate( const point_int_t& org );
+
+		/** Returns the cell containing the indicated pixel in global
+				coordinates, creating it if necessary. */
+		Cell* GetCellCreate( const point_int_t& glob );
     //void ExpireSuperRegion( SuperRegion* sr );
 		
     /** convert a distance in meters to a distance in world occupancy
@@ -1001,6 +1631,25 @@ namespace Stg
 	 /** trace a ray. */
 	 RaytraceResult Raytrace( const Ray& ray );
 
+	 /** trace a ray, using the predicate match instead of ray.func
+			 and ray.arg. Match is one of FuncRayMatch, UnrelatedRayMatch
+			 or RangerRayMatch. */
+	 template <class Match>
+	 RaytraceResult Raytrace( const Ray& ray, const Match& match );
+
+	 /** trace a fan of sample_count rays spread over fov, using the
+			 predicate match. Match is as above. The rays are cast by
+			 model mod. */
+	 template <class Match>
+	 void Raytrace( const Pose &pose,
+									const meters_t range,
+									const radians_t fov,
+									const Match& match,
+									const Model* mod,
+									RaytraceResult* samples,
+									const uint32_t sample_count,
+									const bool ztest );
+
     RaytraceResult Raytrace( const Pose& pose, 			 
 												const meters_t range,
 												const ray_test_func_t func,
@@ -1061,9 +1710,33 @@ namespace Stg
 		/** Queue of pending simulation events for the main thread to handle. */
 	 std::vector<std::priority_queue<Event> > event_queues;
 
-		/** Queue of pending simulation events for the main thread to handle. */
-		std::vector<std::queue<Model*> > pending_update_callbacks;
-		
+		/** The heap under an event queue, in the order the queue keeps
+				it. Lets Clone() and Restore() reproduce the order in which
+				events due at the same time are handled. */
+		static std::vector<Event>& EventHeap( std::priority_queue<Event>& queue );
+
+		/** Models with CB_UPDATE callbacks to be called by the main
+				thread, one list per thread. The lists are cleared but not
+				freed after each update, so they don't allocate once
+				they've grown to size. */
+		std::vector<ModelPtrVec> pending_update_callbacks;
+
+		/** Models whose cached global pose has been invalidated since
+				the last Update(), possibly more than once. Update()
+				refreshes only these before it starts the worker
+				threads. */
+		ModelPtrVec dirty_poses;
+		pthread_mutex_t dirty_poses_mutex; ///< protects dirty_poses, as the workers may move their own models
+
+		/** The number of CB_UPDATE callbacks cancelled in each worker
+				thread during this update. The main thread takes them off
+				update_cb_count, which the workers don't touch. */
+		std::vector<int> cancelled_update_callbacks;
+
+		/** Groups of robots that share a batch controller, called after
+				the models' update callbacks each update. */
+		std::vector<RangerBatch*> batches;
+
 		/** Create a new simulation event to be handled in the future.
 
 				@param queue_num Specify which queue the event should be on. The main
@@ -1075,14 +1748,16 @@ namespace Stg
 				@param mod The model that should have its Update() method
 				called at the specified time.
 		*/
-		void Enqueue( unsigned int queue_num, usec_t delay, Model* mod, model_callback_t cb, void* arg )
-		{  event_queues[queue_num].push( Event( sim_time + delay, mod, cb, arg ) ); }
+		void Enqueue( unsigned int queue_num, usec_t delay, Model* mod, model_callback_t cb, void* arg );
 		
-		/** Set of models that require energy calculations at each World::Update(). */
-	 std::set<Model*> active_energy;
-
-		/** Set of models that require their positions to be recalculated at each World::Update(). */
-	 std::set<Model*> active_velocity;
+		/** Set of models that require energy calculations at each
+				World::Update(), in id order. */
+	 std::set<Model*,ltid> active_energy;
+
+		/** Set of models that require their positions to be recalculated
+				at each World::Update(), in id order so that models move in the
+				same order whatever the number of threads. */
+	 std::set<Model*,ltid> active_velocity;
 		
 	 /** The amount of simulated time to run for each call to Update() */
 	 usec_t sim_interval;
@@ -1095,13 +1770,31 @@ namespace Stg
 	 /** consume events from the queue up to and including the current sim_time */
 	 void ConsumeQueue( unsigned int queue_num );
 
+	 /** Size the event queues and the per-thread lists for
+		  worker_threads, and start the worker threads. Used by Load()
+		  and Clone(). */
+	 void StartWorkerThreads();
+
 	 /** returns an event queue index number for a model to use for
 		  updates */
 	 unsigned int GetEventQueue( Model* mod ) const;
 
   public:
-    /** returns true when time to quit, false otherwise */
-    static bool UpdateAll(); 
+    /** Update every world once. If threads is greater than one and
+				there are several worlds, up to that many worlds are updated
+				at once, each in its own thread. The threads are kept between
+				calls while the number asked for stays the same. Returns true
+				when time to quit, false otherwise.
+
+				Worlds updated at once still share some process-wide state:
+				the model ids and Model::LookupId(), the model type table
+				Model::name_map, World::next_id and LogEntry::log. These
+				are locked, or only read during updates. They also share the
+				drand48() generator, used by Pose::Random() and
+				Color::RandomColor(), so anything that draws from it during
+				an update makes the worlds' results depend on thread timing. Controllers should use
+				Model::Random() instead. */
+    static bool UpdateAll( unsigned int threads = 0 ); 
 	 
     World( const std::string& name = "MyWorld", 
 			  double ppm = DEFAULT_PPM );
@@ -1111,6 +1804,14 @@ namespace Stg
 		/** Returns the current simulated time in this world, in microseconds. */
     usec_t SimTimeNow(void) const { return sim_time; }
 		
+		/** Returns the seed of the random numbers drawn by models. See
+				Model::Random(). */
+		uint64_t GetRandomSeed() const { return random_seed; }
+		
+		/** Set the seed of the random numbers drawn by models, from the
+				next update on. See Model::Random(). */
+		void SetRandomSeed( uint64_t seed ){ random_seed = seed; }
+		
 		/** Returns a pointer to the currently-open worlddfile object, or
 				NULL if there is none. */
     Worldfile* GetWorldFile()	{ return wf; };
@@ -1131,6 +1832,76 @@ namespace Stg
 
     virtual void Reload();
 
+		/** Returns a new world, without a GUI, that is an independent
+				copy of this one at the current time. The worldfile is not
+				read again: every model is copied from its original, as by
+				Model::Clone(), along with its state - pose, velocity, power
+				pack charge, subscriptions, random stream and pending
+				updates.
+
+				The controllers of the copies are started again through
+				their Init(), as when the worldfile is loaded, so that they
+				drive the copies and never touch this world. A
+				controller's private state is not carried over. If
+				copy_callbacks is true, the model and world callbacks and
+				the batch controllers are copied instead, with the same
+				arguments as the originals. Ask for that only if every
+				callback looks up the models it is given in each call;
+				the stock controllers keep pointers to their models in
+				their arguments, so copies of them would drive this
+				world's models.
+
+				The copy does not duplicate the static map. Top-level
+				models that cannot be moved in the GUI and carry no position
+				model, such as floorplans, are shared with this world
+				copy-on-write: the copy's versions of them are never mapped,
+				and the copy's ray tracing and collisions see this world's
+				versions instead. Because of that, this world must outlive
+				its copies and must not delete its map models while they
+				exist. Moving a map model in either world is seen only in
+				that world. */
+		World* Clone( bool copy_callbacks = false );
+
+		/** Write the state of the simulation to a binary file at path,
+				so that it can be resumed by Restore(). The file holds the
+				simulation clock, the pending events and the changing state
+				of each model loaded from the worldfile, but not the
+				worldfile itself. Returns false on failure. */
+		bool Checkpoint( const std::string& path );
+
+		/** Resume the simulation saved by Checkpoint(). The checkpoint
+				holds only the changing state, so the models must already
+				exist: this world must have been loaded from the same
+				worldfile, or cloned from a world that was. Loading with a
+				worldfile cache (see Worldfile::cache_dir) saves most of
+				the parsing and bitmap rasterizing. The world is then set to
+				exactly the saved state. The state of controllers is not
+				saved, so they carry on with whatever they hold now.
+				Returns false on failure, which may leave the world partly
+				restored. */
+		bool Restore( const std::string& path );
+
+		/** Create count copies of the model proto and its descendants,
+				as siblings of proto, and return the top model of each
+				copy. Copy i is placed at poses[i], or at the pose of proto
+				if there are fewer poses than copies. Each model is
+				configured from the worldfile entity that proto's was loaded
+				from, but the blocks and ranger sensors are copied from
+				proto instead of being parsed again, and the copies draw a
+				single display list between them until one of them
+				changes. The copies are mapped into the world once, when
+				they have all been placed, and only then are their
+				controllers started.
+
+				This is much faster than loading a worldfile with as many
+				models. Like models made with CreateModel(), the copies
+				have names generated from their type, are not part of the
+				worldfile, and so are not saved by Save() or included in
+				Clone() and Checkpoint(). See Model::Clone(). */
+		ModelPtrVec InstantiatePrototype( Model* proto,
+																			unsigned int count,
+																			const std::vector<Pose>& poses );
+
 		/** Save the current world state into a worldfile with the given
 				filename.  @param Filename to save as. */
     virtual bool Save( const char* filename );
@@ -1162,6 +1933,11 @@ namespace Stg
     /** Get the resolution in pixels-per-metre of the underlying
 		  discrete raytracing model */ 
     double Resolution() const { return ppm; };
+
+    /** Returns true iff regions keep coarse occupancy maps to speed
+		  up raytracing, as set by the worldfile property
+		  occupancy_mipmap. */
+    bool GetOccupancyMipmap() const { return occupancy_mipmap; }
    
     /** Returns a pointer to the model identified by name, or NULL if
 		  nonexistent */
@@ -1176,12 +1952,99 @@ namespace Stg
     /** Return the number of times the world has been updated. */
     uint64_t GetUpdateCount() const { return updates; }
 
+    /** Return the number of superregions allocated so far. This only
+		  grows, so a change means that new regions have appeared. */
+    size_t GetSuperRegionCount() const { return superregions.size(); }
+
 	 /// Register an Option for pickup by the GUI
 	 void RegisterOption( Option* opt );	
 	 
 	 /// Control printing time to stdout
 	 void ShowClock( bool enable ){ show_clock = enable; };
 
+	 /** Stop the simulation when its time reaches t, as the worldfile
+		  property quit_time does. Zero means never. */
+	 void SetQuitTime( usec_t t ){ quit_time = t; }
+
+	 /** Start or stop accumulating the wall-clock time spent in each
+		  phase of Update(). Off by default, since it reads the clock
+		  several times per update. */
+	 void TimePhases( bool enable ){ time_phases = enable; }
+
+	 /** Returns the wall-clock seconds spent in phase by Update() while
+		  TimePhases() was enabled */
+	 double PhaseTime( phase_t phase ) const { return phase_times[phase]; }
+
+	 /** Returns a short name for phase, such as "main_queue" */
+	 static const char* PhaseName( phase_t phase );
+
+	 /** Start or stop counting the work done for each model, as the
+		  worldfile property "profile" does. Profiling also times the
+		  phases of Update(), as TimePhases(). A program that exits
+		  while any world is profiling prints the profile of each such
+		  world as a table, and writes it as JSON to
+		  <world>.profile.json. */
+	 void SetProfiling( bool enable );
+
+	 bool IsProfiling() const { return profiling; }
+
+	 /** Returns the counts of the work done by the raytraces of the
+		  latest Update(), which are zero unless Stage was built with
+		  the CMake option RAYTRACE_STATS */
+	 const RaytraceStats& GetRaytraceStats() const { return raytrace_stats; }
+
+	 /** Returns the counts of the work done by all the raytraces
+		  since the world was created, as GetRaytraceStats() */
+	 const RaytraceStats& GetRaytraceTotals() const { return raytrace_totals; }
+
+	 /** Returns true iff Stage was built with RAYTRACE_STATS */
+	 static bool RaytraceStatsEnabled();
+
+	 /** Returns the memory used by the grid, the models of each type
+		  and the log. Visits every cell of the grid, so it takes a few
+		  milliseconds for a large world. */
+	 MemoryUsage MemoryStats() const;
+
+	 /** Returns the wall-clock time in seconds, from gettimeofday(2) */
+	 static double WallSeconds();
+
+	 /** Returns the work counted for each model, and summed for each
+		  model type, while profiling was enabled */
+	 Profile GetProfile() const;
+
+	 /** Zero the counters of all the models and the phase times */
+	 void ClearProfile();
+
+	 /** Print the profile of each profiling world, and write it as
+		  JSON to <world>.profile.json. Only the first call does
+		  anything, so that programs can dump the profiles before other
+		  output and not again at exit, where it is called via
+		  atexit(3). */
+	 static void DumpProfiles();
+
+	 /** Start recording what each thread does in every Update(), as
+		  the worldfile property "trace" does: the event queues each
+		  thread consumes, the updates of each model, the Move() loop,
+		  the update callbacks and the charging of models. Each thread
+		  keeps up to the given number of its most recent spans. While
+		  not tracing, the cost is a test of a flag per event. A program that exits while any
+		  world is tracing writes the trace of each such world to
+		  <world>.trace.json. */
+	 void StartTrace( size_t spans=1<<20 );
+
+	 void StopTrace() { tracing = false; }
+
+	 bool IsTracing() const { return tracing; }
+
+	 /** Write the spans recorded so far in the Trace Event JSON format
+		  of chrome://tracing and Perfetto, with a thread for each event
+		  queue. Returns true on success. */
+	 bool WriteTrace( const std::string& filename ) const;
+
+	 /** Write the trace of each tracing world to <world>.trace.json.
+		  Only the first call does anything, as DumpProfiles(). */
+	 static void DumpTraces();
+
 	 /** Return the floor model */
 	 Model* GetGround() {return ground;};
 	
@@ -1195,6 +2058,7 @@ namespace Stg
     friend class World;
     friend class Canvas;
 		friend class Cell;
+		friend class Region;
   public:
 		
     /** Block Constructor. A model's body is a list of these
@@ -1211,6 +2075,11 @@ namespace Stg
     /** A from-file  constructor */
     Block(  Model* mod,  Worldfile* wf, int entity);
 		
+    /** A copy of the shape and color of block proto, for model mod,
+				which is a copy of proto's model. See Model::CopyConfig(). The
+				points are shared with proto until either block changes them. */
+    Block( Model* mod, const Block& proto );
+		
     ~Block();
 	 
     /** render the block into the world's raytrace data structure */
@@ -1262,7 +2131,8 @@ namespace Stg
     Model* mod; ///< model to which this block belongs
 	 std::vector<point_t> mpts; ///< cache of this->pts in model coordindates
     size_t pt_count; ///< the number of points	 
-	 std::vector<point_t> pts; ///< points defining a polygonx	 
+	 std::vector<point_t>* pts; ///< points defining a polygon, shared by copies of this block
+		unsigned int* shared; ///< reference count of pts
     Size size;	 
     Bounds local_z; ///<  z extent in local coords
     Color color;
@@ -1291,6 +2161,14 @@ namespace Stg
 	
 	 /** invalidate the cache of points in model coordinates */
 	 void InvalidateModelPointCache();
+
+		/** give this block its own copy of pts before changing them */
+		void UnsharePoints();
+
+		/** Private copy constructor and assignment operator declared but
+				not defined, since pts is reference counted. */
+		Block( const Block& original );
+		Block& operator=( const Block& original );
 		
   };
 
@@ -1303,8 +2181,29 @@ namespace Stg
   private:
     int displaylist;
 		
+		/** A display list drawn by several groups, and the number of
+				groups using it */
+		class SharedList
+		{
+		public:
+			int displaylist;
+			unsigned int users;
+			SharedList() : displaylist(0), users(0) {}
+		};
+		
+		/** the display list shared with the groups of models copied
+				along with ours, or NULL. See ShareDisplayList(). */
+		SharedList* shared;
+		
+		/** stop using the shared display list, deleting it if no other
+				group uses it */
+		void ReleaseShared();
+		
     void BuildDisplayList( Model* mod );
 		
+		/** draw the blocks of mod into display list number list */
+		void CompileDisplayList( Model* mod, int list );
+		
 		BlockPtrSet blocks;
     Size size;
     point3_t offset;
@@ -1324,6 +2223,11 @@ namespace Stg
 	 
     void AppendBlock( Block* block );
     void CallDisplayList( Model* mod );
+		
+		/** Draw with the same display list as other, the group of a
+				model that looks the same as ours, until either model
+				changes. Used by World::InstantiatePrototype(). */
+		void ShareDisplayList( BlockGroup& other );
     void Clear() ; /** deletes all blocks from the group */
 	 
 	 void AppendTouchingModels( ModelPtrSet& touchers );
@@ -1510,6 +2414,12 @@ namespace Stg
 	 /** Number of updates between measuring elapsed real time. */
 	 uint64_t timing_interval;
 
+	 /** The total of MemoryStats(), shown with the clock, and the
+		  real time it was measured. It is measured at most every few
+		  seconds, since it visits every cell. */
+	 uint64_t memory_bytes;
+	 usec_t memory_time;
+
     // static callback functions
     static void windowCb( Fl_Widget* w, WorldGui* wg );	
     static void fileLoadCb( Fl_Widget* w, WorldGui* wg );
@@ -1532,8 +2442,6 @@ namespace Stg
     bool saveAsDialog();
     bool closeWindowQuery();
 	
-    virtual void AddModel( Model* mod );
-	
 	 void SetTimeouts();
 
   protected:
@@ -1544,6 +2452,10 @@ namespace Stg
 	
     void DrawOccupancy() const;
     void DrawVoxels() const;
+
+    // top-level models are added to and removed from the canvas
+    virtual void AttachChild( Model* mod );
+    virtual void DetachChild( Model* mod );
 	 
   public:
 	
@@ -1575,7 +2487,6 @@ namespace Stg
 
     /** Get human readable string that describes the current global energy state. */
     std::string EnergyString( void ) const;	
-    virtual void RemoveChild( Model* mod );	 
 
 	 bool IsTopView();
   };
@@ -1714,6 +2625,10 @@ namespace Stg
 	 
 	 /** Lose energy as work or heat, and record the event */
 	 void Dissipate( joules_t j, const Pose& p );
+	 
+	 /** Read or write the charge and energy accounts. See
+		  Model::ArchiveState(). */
+	 void ArchiveState( StateArchive& ar );
   };
 
    
@@ -1730,6 +2645,7 @@ namespace Stg
     friend class BlockGroup;
     friend class PowerPack;
     friend class Ray;
+    friend class RangerBatch;
 	 friend class ModelFiducial;
 		
   private:
@@ -1740,6 +2656,45 @@ namespace Stg
 		/** records if this model has been mapped into the world bitmap*/
 		bool mapped;
 
+		/** if true, this model is never mapped, because the world
+				borrows the blocks of the model it was cloned from (see
+				World::Clone()), or because it is a copy that is still being
+				made (see World::InstantiatePrototype()). */
+		bool shares_map;
+		
+		/** true if this model is a copy made by
+				World::InstantiatePrototype(), so it keeps its generated
+				name instead of the one in its worldfile entity */
+		bool cloned;
+
+		/** true if this model has been retired by
+				World::RetireModel(), and is waiting to be reused */
+		bool retired;
+
+		/** the position of this model in the children of its parent,
+				or of the world if it has no parent, so that it can be
+				removed without searching for it */
+		unsigned int child_index;
+
+		/** the number of events queued for this model. A retired model
+				is not reused until they have been handled, since they
+				would reach the new model. */
+		unsigned int queued_events;
+
+		/** the work counted for this model while its world is
+				profiling. Mutable so that the raytraces of const models
+				can be counted. */
+		mutable ProfileCounters profile;
+
+		/** the rays this model has cast since the end of the last
+				World::Update(), if Stage was built with RAYTRACE_STATS.
+				Created by the first ray. */
+		mutable RaytraceStats::Counters* raytrace_stats;
+
+		/** Add the memory used by this model's blocks, display list
+				and trail to usage */
+		void AddMemoryUsage( MemoryUsage::Models& usage ) const;
+
 	 std::vector<Option*> drawOptions;
 	 const std::vector<Option*>& getOptions() const { return drawOptions; }
 	 
@@ -1766,14 +2721,16 @@ namespace Stg
 	 public:
 		model_callback_t callback;
 		void* arg;
+		/** iff true, the callback may be called in a worker thread */
+		bool threadsafe;
 			
-		cb_t( model_callback_t cb, void* arg ) 
-		  : callback(cb), arg(arg) {}
+		cb_t( model_callback_t cb, void* arg, bool threadsafe = false ) 
+		  : callback(cb), arg(arg), threadsafe(threadsafe) {}
 			
 		cb_t( world_callback_t cb, void* arg ) 
-		  : callback(NULL), arg(arg) { (void)cb; }
+		  : callback(NULL), arg(arg), threadsafe(false) { (void)cb; }
 			
-		cb_t() : callback(NULL), arg(NULL) {}
+		cb_t() : callback(NULL), arg(NULL), threadsafe(false) {}
 			
 		 /** for placing in a sorted container */
 		 bool operator<( const cb_t& other ) const
@@ -1828,11 +2785,30 @@ namespace Stg
 			__CB_TYPE_COUNT // must be the last entry: counts the number of types
 		} callback_type_t;
 		
+		/** The callbacks of one type attached to a model, stored
+				contiguously in the order they were added. Callbacks
+				removed while the list is being called are only marked
+				(with a NULL function), and swept out when the outermost
+				call returns, so calling the list never allocates. */
+		class CallbackList
+		{
+		public:
+			std::vector<cb_t> cbs;
+			unsigned int calling; ///< depth of CallCallbacks() calls running on this list
+			size_t removed; ///< number of entries marked for removal
+			
+			CallbackList() : cbs(), calling(0), removed(0) {}
+			
+			/** Returns the number of callbacks not marked for removal */
+			size_t size() const { return cbs.size() - removed; }
+			bool empty() const { return size() == 0; }
+		};
+
   protected:
 		/** A list of callback functions can be attached to any
 				address. When Model::CallCallbacks( void*) is called, the
 				callbacks are called.*/
-		std::vector<std::set<cb_t> > callbacks;
+		std::vector<CallbackList> callbacks;
 		
 
 	 /** Default color of the model's blocks.*/
@@ -1896,6 +2872,21 @@ namespace Stg
 		  global coordinate frame is the parent is NULL. */
 	 Pose pose;
 
+	 /** Cached result of GetGlobalPose(), and the cosine and sine of
+		  its heading. Valid iff global_pose_dirty is false. World::Update()
+		  refreshes the caches of the models on its dirty_poses list
+		  before it starts the worker threads, so the workers only read
+		  them unless they move a model themselves. */
+	 mutable Pose global_pose;
+	 mutable double global_cosa, global_sina;
+	 mutable bool global_pose_dirty;
+
+	 /** Invalidate the cached global pose of this model and all its
+		  descendants, and add them to the world's dirty_poses. Call
+		  this whenever the pose, parent or height of a model
+		  changes. */
+	 void GlobalPoseChanged();
+
 	 /** Optional attached PowerPack, defaults to NULL */
 	 PowerPack* power_pack;
 
@@ -1944,6 +2935,12 @@ namespace Stg
 		  allow parallel Updates(). */
 	 bool thread_safe;
 	 
+	 /** Iff true, the CB_UPDATE callbacks of this model and its
+		  descendants are all thread-safe, as if they were added with
+		  AddCallback( ..., true ). Set with the worldfile property
+		  ctrl_threadsafe. */
+	 bool ctrl_threadsafe;
+	 
 	 /** Cache of recent poses, used to draw the trail. */
 	 class TrailItem 
 	 {																							
@@ -1989,6 +2986,9 @@ namespace Stg
 				to Model::VelocityEnable(). */
 		bool velocity_enable;
 		
+		/** the source of Random() */
+		RandomStream rng;
+		
 		watts_t watts;///< power consumed by this model
 	 
 	 /** If >0, this model can transfer energy to models that have
@@ -2115,7 +3115,57 @@ namespace Stg
 		virtual void Update();
 		virtual void Move();
 		virtual void UpdateCharge();
+
+		/** Read or write the state of this model that changes as the
+				simulation runs, but not what is loaded from the
+				worldfile. Subclasses with changing state of their own
+				extend this. Used by World::Checkpoint(), World::Restore()
+				and CopyState(). */
+		virtual void ArchiveState( StateArchive& ar );
 		
+		/** Copy the changing state of src, the model loaded from the
+				same worldfile entity in another world, into this
+				model. Used by World::Clone(). */
+		void CopyState( const Model& src );
+
+		/** Copy the configuration that Load() does not read from this
+				model's own worldfile entity - its blocks - from proto, the
+				model this one is a copy of. Subclasses with more of it,
+				such as the sensors of a ranger, extend this. Used by
+				World::InstantiatePrototype(). */
+		virtual void CopyConfig( const Model& proto );
+
+		/** Make a copy of this model and its descendants under parent
+				in world into, which is this model's world for
+				World::InstantiatePrototype() and another for
+				World::Clone(). The copy is not mapped until MapClone() is
+				called. firsts records the first copy made of each model,
+				whose display list the later copies share. */
+		Model* CloneUnmapped( World* into, Model* parent, 
+									 std::map<Model*,Model*>& firsts );
+
+		/** Map a copy made by CloneUnmapped(), with its descendants,
+				into the world */
+		void MapClone();
+
+		/** Take this model out of the simulation, for
+				World::RetireModel(). Subclasses that are known to other
+				parts of the world, such as rangers in a batch, extend
+				this. The children must already have been retired. */
+		virtual void Retire();
+
+		/** Put a retired model back into the simulation, under
+				parent, for World::CreateModel() */
+		void Reuse( Model* parent );
+
+		/** Remove all the callbacks, even while they are being called */
+		void ClearCallbacks();
+
+		/** Replace our callbacks with those of src, the model this one
+				is a copy of in another world. Used by World::Clone() when
+				asked to copy callbacks. */
+		void CopyCallbacks( const Model& src );
+
 		static int UpdateWrapper( Model* mod, void* arg ){ mod->Update(); return 0; }
 		static int MoveWrapper( Model* mod, void* arg ){ mod->Move(); return 0; }
 
@@ -2166,13 +3216,30 @@ namespace Stg
 	 void PlaceInFreeSpace( meters_t xmin, meters_t xmax, 
 									meters_t ymin, meters_t ymax );
 	
+	 /** Returns a random number uniformly distributed in [0,1), from
+		  this model's own stream. The numbers a model draws depend only
+		  on the world's random seed, the model's name, the update
+		  number and how many numbers the model has already drawn
+		  during this update. They don't depend on the order in which
+		  models are updated, or on the thread that updates them, so
+		  runs with worker threads are repeatable. Controllers should use
+		  this instead of rand() or drand48(). */
+	 double Random();
+	 
+	 /** As Random(), but returns a random 32 bit unsigned integer */
+	 uint32_t RandomInt();
+
+	 /** Create a copy of this model and its descendants, beside this
+		  model and at its current pose, and start its controllers. See
+		  World::InstantiatePrototype(). */
+	 Model* Clone();
+
 	 /** Return a human-readable string describing the model's pose */
 	 std::string PoseString()
 	 { return pose.String(); }
 	
 	 /** Look up a model pointer by a unique model ID */
-	 static Model* LookupId( uint32_t id )
-	 { return modelsbyid[id]; }
+	 static Model* LookupId( uint32_t id );
 	 
 	 /** Constructor */
 	 Model( World* world, 
@@ -2184,7 +3251,7 @@ namespace Stg
 		
 		/** Alternate constructor that created dummy models with only a pose */
 		Model() 
-			: parent(NULL), world(NULL) 
+			: raytrace_stats(NULL), parent(NULL), world(NULL)
 		{}
 		
 	 void Say( const std::string& str );
@@ -2386,17 +3453,69 @@ namespace Stg
 				indicated model method is called, and passed the user
 				data.  @param cb Pointer the function to be called.  @param
 				user Pointer to arbitrary user data, passed to the callback
-				when called.
+				when called. @param threadsafe If true, a CB_UPDATE
+				callback of a thread-safe model is called as soon as the
+				model updates, before the models move, possibly in a worker
+				thread in parallel with other callbacks, instead of in
+				series in the main thread after the models move. Only use
+				this if the callback touches nothing but its own models and
+				data.
 		*/
 		void AddCallback( callback_type_t type, 
 											model_callback_t cb, 
-											void* user );
+											void* user,
+											bool threadsafe = false );
 		
+		/** Add a callback that calls a function object, i.e. an object
+				with a method int operator()( Model* mod ). The object is
+				not copied, so it must remain valid until the callback is
+				removed. As with function callbacks, returning non-zero
+				removes the callback. */
+		template <class F>
+		void AddCallback( callback_type_t type, F& functor, bool threadsafe = false )
+		{ AddCallback( type, &CallFunctor<F>, &functor, threadsafe ); }
+		
+		/** Remove all callbacks of this type that call the function
+				callback. Returns the number of callbacks of this type that
+				remain. */
 		int RemoveCallback( callback_type_t type,
 												model_callback_t callback );
 		
+		/** Remove the callback added with AddCallback( type, functor ). */
+		template <class F>
+		int RemoveCallback( callback_type_t type, F& functor )
+		{ return RemoveCallback( type, cb_t( &CallFunctor<F>, &functor ) ); }
+		
 		int CallCallbacks(  callback_type_t type );
 		
+  private:
+		/** Calls a function object attached by AddCallback() */
+		template <class F>
+		static int CallFunctor( Model* mod, void* functor )
+		{ return (*static_cast<F*>(functor))( mod ); }
+		
+		/** Remove the callbacks of this type equal to cb, or matching
+				cb.callback if all_args is true. */
+		int RemoveCallback( callback_type_t type, const cb_t& cb, bool all_args = false );
+		
+		/** Which callbacks CallCallbacks() should call */
+		typedef enum { 
+			CALL_ALL, ///< all of them
+			CALL_THREADSAFE, ///< only those safe to call in a worker thread
+			CALL_UNSAFE ///< only those not safe to call in a worker thread
+		} call_filter_t;
+		
+		/** Call the callbacks of this type selected by filter. Returns
+				the number of callbacks remaining that were not
+				selected. */
+		int CallCallbacks( callback_type_t type, call_filter_t filter );
+		
+		/** Returns true iff this model or one of its ancestors has the
+				ctrl_threadsafe property set. */
+		bool CtrlThreadSafe() const;
+		
+  public:
+		
 		
 	 virtual void Print( char* prefix ) const;
 	 virtual const char* PrintWithPose() const;
@@ -2482,9 +3601,19 @@ namespace Stg
 	 std::vector<Blob> blobs;
 	 std::vector<Color> colors;
 
+	 bool lazy; ///< iff true, scans are done when the data is read, rather than when they are scheduled
+	 bool stale; ///< iff true, the blob data is out of date
+	 Pose scan_pose; ///< global pose at which the pending scan was scheduled
+
 	 // predicate for ray tracing
 	 static bool BlockMatcher( Block* testblock, Model* finder );
 
+	 /** Find the blobs visible from global pose gp. */
+	 void Scan( const Pose& gp );
+
+	 /** If the data is stale, scan from the scheduled pose now. */
+	 void Freshen() const;
+
   public:
 	 radians_t fov;
 	 radians_t pan;
@@ -2506,11 +3635,12 @@ namespace Stg
 		
 	 Blob* GetBlobs( unsigned int* count )
 	 { 
+		Freshen();
 		if( count ) *count = blobs.size();
 		return &blobs[0];
 	 }
 
-     std::vector<Blob> GetBlobs() const { return blobs; }
+     std::vector<Blob> GetBlobs() const { Freshen(); return blobs; }
 
 	 /** Start finding blobs with this color.*/
 	 void AddColor( Color col );
@@ -2521,6 +3651,14 @@ namespace Stg
 	 /** Stop tracking all colors. Call this to clear the defaults, then
 		  add colors individually with AddColor(); */
 	 void RemoveAllColors();
+
+	 /** If true, Update() only records the pose at which a scan was
+		  due, and the image is scanned the first time the blobs are
+		  read. Only the blobfinder's own pose is kept from the update:
+		  the other models are seen where they are when the blobs are
+		  read. Defaults to false. */
+	 void SetLazy( bool lazy ){ this->lazy = lazy; }
+	 bool GetLazy() const { return lazy; }
   };
 
 
@@ -2622,6 +3760,7 @@ namespace Stg
   
 	 virtual void Load();
 	 virtual void Save();
+	 virtual void CopyConfig( const Model& proto );
 
 	 /** Configure the gripper */
 	 void SetConfig( config_t & newcfg ){ this->cfg = newcfg; FixBlocks(); }
@@ -2702,8 +3841,14 @@ namespace Stg
 	 };
 
   private:
-	 // if neighbor is visible, add him to the fiducial scan
-	 void AddModelIfVisible( Model* him );
+	 // if neighbor is visible from global pose gp, add him to the fiducial scan
+	 void AddModelIfVisible( Model* him, const Pose& gp );
+
+	 /** Find all the visible fiducials from global pose gp. */
+	 void Scan( const Pose& gp );
+
+	 /** If the data is stale, scan from the scheduled pose now. */
+	 void Freshen();
 
 	 virtual void Update();
 	 virtual void DataVisualize( Camera* cam );
@@ -2712,6 +3857,10 @@ namespace Stg
 	 static Option showFov;
 	 
 	 std::vector<Fiducial> fiducials;
+
+	 bool lazy; ///< iff true, scans are done when the data is read, rather than when they are scheduled
+	 bool stale; ///< iff true, the fiducial data is out of date
+	 Pose scan_pose; ///< global pose at which the pending scan was scheduled
 		
   public:		
 	 ModelFiducial( World* world, 
@@ -2731,14 +3880,23 @@ namespace Stg
     bool ignore_zloc;  ///< Are we ignoring the Z-loc of the fiducials we detect compared to the fiducial detector?	
 		
 	 /** Access the dectected fiducials. C++ style. */
-	 std::vector<Fiducial>& GetFiducials() { return fiducials; }
+	 std::vector<Fiducial>& GetFiducials() { Freshen(); return fiducials; }
 		
 	 /** Access the dectected fiducials, C style. */
 	 Fiducial* GetFiducials( unsigned int* count )
 	 {
+		Freshen();
 		if( count ) *count = fiducials.size();
 		return &fiducials[0];
 	 }
+
+	 /** If true, Update() only records the pose at which a scan was
+		  due, and the scan is done the first time the fiducials are
+		  read. The finder's pose is the one recorded at the update, but
+		  the fiducials are found where they are at read time. Defaults
+		  to false. */
+	 void SetLazy( bool lazy ){ this->lazy = lazy; }
+	 bool GetLazy() const { return lazy; }
   };
 	
 	
@@ -2782,6 +3940,41 @@ namespace Stg
 			
 			std::vector<meters_t> ranges;
 			std::vector<double> intensities;
+
+			/** A scan remembered for reuse, along with the change stamps
+					of every region its rays crossed. While the stamps and
+					the ray origin are unchanged, tracing again would give
+					the same result. */
+			class Coherence
+			{
+			public:
+				bool valid;
+				Pose origin; ///< global pose of the first ray
+				radians_t fov;
+				meters_t range;
+				unsigned int sample_count;
+				size_t superregions; ///< world superregion count at scan time
+				std::vector<Region*> regions; ///< regions crossed by the scan
+				std::vector<unsigned long> stamps; ///< their change stamps at scan time
+				std::vector<meters_t> ranges;
+				std::vector<Model*> hits; ///< model struck by each ray, if any
+				std::vector<Region*> seen; ///< scratch space for removing duplicate regions
+				
+				Coherence() : valid(false), origin(), fov(0), range(0), 
+											sample_count(0), superregions(0), 
+											regions(), stamps(), ranges(), hits(), seen()
+				{}
+
+				/** Returns true iff a scan with these parameters would give
+						the same result as the one stored here. */
+				bool Matches( const Pose& origin, radians_t fov, meters_t range,
+											unsigned int sample_count, size_t superregions,
+											unsigned int layer ) const;
+			};
+			
+			/** Cached scans, one for each world layer, since rays
+					alternate between the layers on successive updates. */
+			Coherence cache[2];
 			
 			Sensor() : pose( 0,0,0,0 ), 
 								 size( 0.02, 0.02, 0.02 ), // teeny transducer
@@ -2793,7 +3986,9 @@ namespace Stg
 								 intensities()
 			{}
 			
-			void Update( ModelRanger* rgr );			
+			/** Raytrace a new scan from the sensor's mounting point,
+					given the global pose of the ranger's origin. */
+			void Update( ModelRanger* rgr, const Pose& origin );			
 			void Visualize( Vis* vis, ModelRanger* rgr ) const;
 			std::string String() const;			
 			void Load( Worldfile* wf, int entity );
@@ -2801,12 +3996,13 @@ namespace Stg
 
 	 /** returns a const reference to a vector of range and reflectance samples */
 	 const std::vector<Sensor>& GetSensors() const
-	 { return sensors; }
+	 { Freshen(); return sensors; }
 	 
 	 /** returns a const reference to the vector of range samples from
 		  the indicated sensor (defaults to zero) */
 	 const std::vector<meters_t>& GetRanges( unsigned int sensor=0) const 
 	 { 
+		Freshen();
 		if( sensor < sensors.size() )
 		  return sensors[sensor].ranges;
 		
@@ -2818,6 +4014,7 @@ namespace Stg
 		  the indicated sensor (defaults to zero). Mutating the range data in place allows controllers to act as filters. */
 	 std::vector<meters_t>& GetRangesMutable( unsigned int sensor=0) 
 	 { 
+		Freshen();
 		if( sensor < sensors.size() )
 		  return sensors[sensor].ranges;
 		
@@ -2830,6 +4027,7 @@ namespace Stg
 		meters_t* GetRangesArr( unsigned int sensor, uint32_t* count )
 		{
 			assert(count);
+			Freshen();
 			*count = sensors[sensor].ranges.size();
 			return &sensors[sensor].ranges[0];
 		}
@@ -2839,6 +4037,7 @@ namespace Stg
 		meters_t* GetIntensitiesArr( unsigned int sensor, uint32_t* count )
 		{
 			assert(count);
+			Freshen();
 			*count = sensors[sensor].intensities.size();
 			return &sensors[sensor].intensities[0];
 		}
@@ -2847,6 +4046,7 @@ namespace Stg
 		  (defaults to zero) */
 	 const std::vector<double>& GetIntensities( unsigned int sensor=0) const 
 	 { 
+		Freshen();
 		if( sensor < sensors.size() )
 		  return sensors[sensor].intensities;
 		
@@ -2855,15 +4055,42 @@ namespace Stg
 	 }
 	 
 		void LoadSensor( Worldfile* wf, int entity );
+
+		/** If true, Update() only records the pose at which a scan was
+				due, and the rays are traced the first time the data is
+				read. Saves raytracing for controllers that poll the
+				sensor less often than it updates. Only the sensor's own
+				pose is the snapshot taken at the update: the world is
+				traced as it is at read time. Defaults to false. */
+		void SetLazy( bool lazy ){ this->lazy = lazy; }
+		bool GetLazy() const { return lazy; }
+
+		/** If true, each sensor remembers which regions its last scan
+				crossed, and reuses the scan while the sensor hasn't moved
+				and nothing in those regions has changed. Defaults to
+				false. */
+		void SetScanCache( bool enable ){ scan_cache = enable; }
+		bool GetScanCache() const { return scan_cache; }
 		
   private:
 		std::vector<Sensor> sensors;		
+
+		bool lazy; ///< iff true, scans are traced on demand
+		bool scan_cache; ///< iff true, unchanged scans are reused
+		bool stale; ///< iff true, the sensor data is out of date
+		Pose scan_pose; ///< global pose at which the pending scan was scheduled
+
+		/** If the data is stale, trace the pending scan now. */
+		void Freshen() const;
 		
   protected:
 		
 		virtual void Startup();
 		virtual void Shutdown();
 		virtual void Update();		
+		virtual void ArchiveState( StateArchive& ar );
+		virtual void CopyConfig( const Model& proto );
+		virtual void Retire();
   };
 	
   // BLINKENLIGHT MODEL ----------------------------------------------------
@@ -2973,6 +4200,7 @@ namespace Stg
   class ModelPosition : public Model
   {
 	 friend class Canvas;
+	 friend class RangerBatch;
 
   public:
 	 /** Define a position  control method */
@@ -3014,6 +4242,7 @@ namespace Stg
 	 virtual void Shutdown();
 	 virtual void Update();
 	 virtual void Load();
+	 virtual void ArchiveState( StateArchive& ar );
 	 	
 	 /** Specify a point in space. Arrays of Waypoints can be attached to
 		  Models and visualized. */
@@ -3137,6 +4366,71 @@ namespace Stg
   };
 
 
+  /** Writes synthetic worldfiles for stress tests and scaling
+			sweeps: a walled square arena scattered with box obstacles and
+			robots, with the size, clutter, number of robots, their sensors
+			and their motion set by the public members. The layout depends
+			only on these members, so any world of a sweep can be made
+			again. The moving robots use the "stress" controller from
+			worlds/benchmark. See also the stageworldgen program. */
+  class WorldGen
+  {
+  public:
+	 /** How the robots move */
+	 typedef enum
+		{
+		  MOTION_STILL = 0, ///< no controller; the robots only sense
+		  MOTION_CONSTANT, ///< straight ahead until stalled
+		  MOTION_RANDOM, ///< a new random speed and turn rate every few seconds
+		  MOTION_WANDER ///< obstacle avoidance using the ranger
+		} motion_t;
+
+	 /** Side of the square arena in meters, or 0 to make it just big
+			 enough that the robots fill half the free space. */
+	 meters_t size;
+	 /** Fraction of the arena's 1m cells that contain an obstacle, in [0,1) */
+	 double obstacle_density;
+	 unsigned int robots;
+	 /** Samples per ranger scan, or 0 for robots without rangers */
+	 unsigned int ranger_samples;
+	 meters_t ranger_range;
+	 /** Fraction of the robots that carry a fiducial finder */
+	 double fiducial_fraction;
+	 /** Fraction of the robots that carry a blobfinder */
+	 double blobfinder_fraction;
+	 motion_t motion;
+	 /** Top forward speed of moving robots, in meters per second */
+	 double speed;
+	 /** The world's worker threads */
+	 unsigned int threads;
+	 /** The world's raytracing resolution, in meters */
+	 meters_t resolution;
+	 /** Simulated seconds after which the world quits, or 0 to run forever */
+	 double quit_time;
+	 /** Seeds the placement of obstacles and robots and their sensors */
+	 uint32_t seed;
+
+	 WorldGen();
+
+	 /** Returns the side of the arena that Write() will use */
+	 meters_t ArenaSize() const;
+
+	 /** Writes the worldfile to file. Returns false, having printed an
+			 error, if the robots don't fit in the arena. */
+	 bool Write( FILE* file ) const;
+
+	 /** As Write(), to the named file */
+	 bool Save( const std::string& filename ) const;
+
+	 /** Returns the name of motion, as used by ParseMotion() and the
+			 stress controller */
+	 static const char* MotionName( motion_t motion );
+
+	 /** Sets motion from its name. Returns false if name is unknown. */
+	 static bool ParseMotion( const std::string& name, motion_t& motion );
+  };
+
+
 }; // end namespace stg
 
 #endif
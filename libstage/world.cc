@@ -18,11 +18,16 @@
 
 	 name                     <worldfile name>
 	 interval_sim            100
+	 occupancy_mipmap          0
+	 profile                   0
 	 quit_time                 0
+    random_seed               0
     resolution                0.02
 	 show_clock                0
 	 show_clock_interval     100
     threads                   0
+	 trace                     0
+	 trace_spans         1048576
 
     @endverbatim
 
@@ -40,12 +45,34 @@
 	 callbacks. You are not likely to need to change the default of 100
 	 msec: this is used internally by clients such as Player and WebSim.
 
+    - occupancy_mipmap <int>\n
+	 If non-zero, keep occupancy maps at 2, 4 and 8 times coarser than
+	 $resolution. Rays step over empty coarse cells without examining
+	 the fine cells inside them. This speeds up long-range sensors in
+	 high-resolution worlds with sparse obstacles, at the cost of a
+	 little memory and a little extra work whenever a model moves.
+
+    - profile <int>\n
+	 If non-zero, count the time spent updating and moving each model
+	 and in its callbacks and controller, and the rays it casts. When
+	 Stage exits it prints the counts summed for each model type and
+	 for the most expensive models, and writes them all as JSON to
+	 <world name>.profile.json in the current directory. The
+	 command-line option --profile does the same for every world. See
+	 World::GetProfile().
+
     - quit_time <float>\n
 	 Stop the simulation after this many simulated seconds have
 	 elapsed. In libstage, World::Update() returns true. In Stage with
 	 a GUI, the simulation is paused.wo In Stage without a GUI, Stage
 	 quits.
  
+    - random_seed <int>\n
+	 Seeds the random numbers drawn by models, such as position
+	 odometry errors and random colors, and by controllers that use
+	 Model::Random(). Runs with the same seed are repeatable, even with
+	 worker threads.
+
     - resolution <float>\n
     The resolution (in meters) of the underlying bitmap model. Larger
     values speed up raytracing at the expense of fidelity in collision
@@ -70,6 +97,21 @@
     parallel-enabled high-resolution models, e.g. a laser with
     hundreds or thousands of samples, or lots of models.
 	 
+    - trace <int>\n
+	 If non-zero, record spans of time for what each thread does in
+	 every update: the event queue it consumes, the update of each
+	 model, and in the main thread the Move() loop, the update
+	 callbacks and the charging of models. When Stage exits it writes
+	 them to <world name>.trace.json in the current directory, in the
+	 Trace Event format read by chrome://tracing and Perfetto. The
+	 command-line option --trace does the same for every world. See
+	 World::StartTrace().
+
+    - trace_spans <int>\n
+	 The number of spans each thread keeps while $trace is enabled.
+	 Once a thread has recorded this many, its oldest spans are
+	 overwritten.
+
     @par More examples
     The Stage source distribution contains several example world files in
     <tt>(stage src)/worlds</tt> along with the worldfile properties
@@ -84,12 +126,17 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 #include <string.h> // for strdup(3)
 #include <locale.h> 
 #include <limits.h>
 #include <libgen.h> // for dirname(3)
+#include <sys/time.h> // for gettimeofday(2)
+#include <memory> // for std::auto_ptr
+#include <algorithm> // for std::sort
 
 #include "stage.hh"
+#include "config.h"
 #include "file_manager.hh"
 #include "worldfile.hh"
 #include "region.hh"
@@ -103,7 +150,7 @@ bool World::ltx::operator()(const Model* a, const Model* b) const
 	const meters_t bx = b->GetGlobalPose().x;
 	
 	if( ax == bx )
-		return a < b; // tie breaker
+		return a->id < b->id; // tie breaker
 	
 	return ax < bx;
 }
@@ -113,10 +160,14 @@ bool World::lty::operator()(const Model* a, const Model* b) const
 	const meters_t by = b->GetGlobalPose().y;
 	
 	if( ay == by )
-		return a < b; // tie breaker
+		return a->id < b->id; // tie breaker
 	
 	return ay < by;
 }
+bool World::ltid::operator()(const Model* a, const Model* b) const
+{
+	return a->id < b->id;
+}
 		
 // static data members
 unsigned int World::next_id = 0;
@@ -131,17 +182,29 @@ World::World( const std::string& name,
   // private
   destroy( false ),
   dirty( true ),
+  time_phases( false ),
+  profiling( false ),
+  world_callback_time( 0 ),
+  tracing( false ),
+  trace_start( 0 ),
+  trace_rings(),
+  raytrace_stats(),
+  raytrace_totals(),
+  raytrace_unowned(),
   models(),
   models_by_name(),
   models_with_fiducials(),
   models_with_fiducials_byx(),
   models_with_fiducials_byy(),
   ppm( ppm ), // raytrace resolution
+  occupancy_mipmap( false ),
   quit( false ),
   show_clock( false ),
   show_clock_interval( 100 ), // 10 simulated seconds using defaults
   sync_mutex(),
   threads_working( 0 ),
+  worker_rounds( 0 ),
+  worker_rounds_at_start( 0 ),
   threads_start_cond(),
   threads_done_cond(),
   total_subs( 0 ), 
@@ -160,9 +223,12 @@ World::World( const std::string& name,
   sr_cached(NULL),
   updates( 0 ),
   wf( NULL ),
+  random_seed( 0 ),
   paused( false ),
   event_queues(1), // use 1 thread by default
 	pending_update_callbacks(),
+	cancelled_update_callbacks(),
+	batches(),
 	active_energy(),
 	active_velocity(),
   sim_interval( 1e5 ), // 100 msec has proved a good default
@@ -174,7 +240,11 @@ World::World( const std::string& name,
       exit(-1);
     }
  
+  bzero( phase_times, sizeof(phase_times) );
+
   pthread_mutex_init( &sync_mutex, NULL );
+  pthread_mutex_init( &raytrace_stats_mutex, NULL );
+  pthread_mutex_init( &dirty_poses_mutex, NULL );
   pthread_cond_init( &threads_start_cond, NULL );
   pthread_cond_init( &threads_done_cond, NULL );
  
@@ -192,7 +262,15 @@ World::~World( void )
 {
   PRINT_DEBUG2( "destroying world %d %s", next_id, token.c_str() );
   if( ground ) delete ground;
-  if( wf ) delete wf;
+  
+  // delete the models while the world they remove themselves from is
+  // still intact, rather than leaving them to ~Ancestor()
+  World::UnLoad();
+  
+  FOR_EACH( it, batches )
+	 delete *it;
+  FOR_EACH( it, superregions )
+	 delete it->second;
   World::world_set.erase( this );
 }
 
@@ -210,8 +288,170 @@ void World::DestroySuperRegion( SuperRegion* sr )
   delete sr;
 }
 
-bool World::UpdateAll()
+/** Shares the worlds among a fixed set of threads, so that
+		World::UpdateAll() can update several worlds at once. The calling
+		thread updates worlds too. Worlds do not share any state that is
+		changed during an update, so they need no locking of their own. */
+class WorldPool
+{
+public:
+	WorldPool( unsigned int threads );
+	
+	/** Stops and joins the pool threads */
+	~WorldPool();
+	
+	/** Returns the number of threads in the pool, not counting the
+			calling thread */
+	unsigned int Threads() const { return threads; }
+	
+	/** Update each world once. Returns true iff every world is ready
+			to quit. */
+	bool Update( const std::set<World*>& worlds );
+	
+private:
+	pthread_mutex_t mutex; ///< protects everything below
+	pthread_cond_t start_cond; ///< signalled to start a round of updates
+	pthread_cond_t done_cond; ///< signalled by the last thread to finish a round
+	std::vector<World*> worlds; ///< the worlds to update this round
+	std::vector<pthread_t> pool_threads; ///< the threads, for joining
+	size_t next; ///< index of the next world to be taken by a thread
+	unsigned int threads; ///< the number of threads in the pool
+	unsigned int working; ///< the number of threads not yet finished this round
+	uint64_t round; ///< incremented to start each round
+	bool quit; ///< true until a world's Update() returns false
+	bool stop; ///< set to make the threads exit
+	
+	/** Update worlds until there are none left this round */
+	void Work();
+	
+	static void* ThreadEntry( WorldPool* pool );
+};
+
+WorldPool::WorldPool( unsigned int threads ) :
+	mutex(),
+	start_cond(),
+	done_cond(),
+	worlds(),
+	pool_threads( threads ),
+	next( 0 ),
+	threads( threads ),
+	working( 0 ),
+	round( 0 ),
+	quit( true ),
+	stop( false )
+{
+  pthread_mutex_init( &mutex, NULL );
+  pthread_cond_init( &start_cond, NULL );
+  pthread_cond_init( &done_cond, NULL );
+
+	for( unsigned int t=0; t<threads; ++t )
+		pthread_create( &pool_threads[t], NULL, 
+										(void* (*)(void*))&WorldPool::ThreadEntry, 
+										this );
+}
+
+WorldPool::~WorldPool()
+{
+	pthread_mutex_lock( &mutex );
+	stop = true;
+	pthread_cond_broadcast( &start_cond );
+	pthread_mutex_unlock( &mutex );
+	
+	for( unsigned int t=0; t<threads; ++t )
+		pthread_join( pool_threads[t], NULL );
+	
+	pthread_cond_destroy( &done_cond );
+	pthread_cond_destroy( &start_cond );
+	pthread_mutex_destroy( &mutex );
+}
+
+void WorldPool::Work()
+{
+	bool all_quit( true );
+	
+	pthread_mutex_lock( &mutex );
+	while( next < worlds.size() )
+		{
+			World* world( worlds[next++] );
+			pthread_mutex_unlock( &mutex );
+			
+			if( world->Update() == false )
+				all_quit = false;
+			
+			pthread_mutex_lock( &mutex );
+		}
+	
+	if( ! all_quit )
+		quit = false;
+	pthread_mutex_unlock( &mutex );
+}
+
+bool WorldPool::Update( const std::set<World*>& set )
+{
+	pthread_mutex_lock( &mutex );
+	worlds.assign( set.begin(), set.end() );
+	next = 0;
+	quit = true;
+	working = threads;
+	++round;
+	pthread_cond_broadcast( &start_cond );
+	pthread_mutex_unlock( &mutex );
+	
+	Work();
+	
+	// wait for the pool threads to finish the round
+	pthread_mutex_lock( &mutex );
+	while( working > 0 )
+		pthread_cond_wait( &done_cond, &mutex );
+	const bool all_quit( quit );
+	pthread_mutex_unlock( &mutex );
+	
+	return all_quit;
+}
+
+void* WorldPool::ThreadEntry( WorldPool* pool )
+{
+	uint64_t seen( 0 );
+	
+	pthread_mutex_lock( &pool->mutex );
+	while( 1 )
+		{
+			// wait until the calling thread starts a new round
+			while( pool->round == seen && ! pool->stop )
+				pthread_cond_wait( &pool->start_cond, &pool->mutex );
+			if( pool->stop )
+				break;
+			seen = pool->round;
+			pthread_mutex_unlock( &pool->mutex );
+			
+			pool->Work();
+			
+			pthread_mutex_lock( &pool->mutex );
+			if( --pool->working == 0 )
+				pthread_cond_signal( &pool->done_cond );
+			// keep lock going round the loop
+		}
+	pthread_mutex_unlock( &pool->mutex );
+	
+	return NULL;
+}
+
+bool World::UpdateAll( unsigned int threads )
 {  
+	// created on first use and kept between calls, so that the threads
+	// aren't started every update. Replaced if the number of threads
+	// changes, and freed at exit.
+	static std::auto_ptr<WorldPool> pool;
+	
+	if( threads > 1 && World::world_set.size() > 1 )
+		{
+			// this thread is the last one
+			if( pool.get() == NULL || pool->Threads() != threads-1 )
+				pool.reset( new WorldPool( threads-1 ) );
+			
+			return pool->Update( World::world_set );
+		}
+	
   bool quit = true;
   
   FOR_EACH( world_it, World::world_set )
@@ -234,15 +474,22 @@ void* World::update_thread_entry( std::pair<World*,int> *thread_info )
 
   pthread_mutex_lock( &world->sync_mutex );  
 
+  // the rounds of work started before this thread was created
+  unsigned int rounds_done( world->worker_rounds_at_start );
+
   while( 1 )
     {
 		//printf( "thread ID %d waiting for start\n", thread_instance );
 		
-      // wait until the main thread signals us
+      // wait until the main thread starts a round we haven't done.
+      // Checking the count, rather than only waiting for the signal,
+      // keeps a thread that wakes spuriously, or is still starting up
+      // when the first round is signalled, in step.
       //puts( "worker waiting for start signal" );
 		
-      pthread_cond_wait( &world->threads_start_cond, &world->sync_mutex );
-		
+      while( world->worker_rounds == rounds_done )
+		  pthread_cond_wait( &world->threads_start_cond, &world->sync_mutex );
+		++rounds_done;
 		
       pthread_mutex_unlock( &world->sync_mutex );
 		
@@ -273,6 +520,7 @@ void World::AddModel( Model*  mod )
 {
   models.insert( mod );
   models_by_name[mod->token] = mod;
+  dirty_poses.push_back( mod ); // a new model's global pose is unknown
 }
 
 void World::AddModelName( Model* mod, const std::string& name )
@@ -284,6 +532,7 @@ void World::RemoveModel( Model* mod )
 {
   models.erase( mod );
   models_by_name.erase( mod->token );
+  EraseAll( mod, dirty_poses );
 }
 
 void World::LoadBlock( Worldfile* wf, int entity )
@@ -311,7 +560,92 @@ void World::LoadSensor( Worldfile* wf, int entity )
 }
 
 
+void World::Enqueue( unsigned int queue_num, usec_t delay, Model* mod, model_callback_t cb, void* arg )
+{
+  event_queues[queue_num].push( Event( sim_time + delay, mod, cb, arg ) );
+  ++mod->queued_events;
+}
+
+void World::Dequeue( Model* mod )
+{
+  for( size_t q=0; q<event_queues.size(); ++q )
+	 {
+		std::vector<Event>& events( EventHeap( event_queues[q] ) );
+		
+		size_t kept(0);
+		FOR_EACH( it, events )
+		  if( it->mod != mod )
+			 events[kept++] = *it;
+		
+		if( kept < events.size() )
+		  {
+			 events.erase( events.begin() + kept, events.end() );
+			 std::make_heap( events.begin(), events.end() );
+		  }
+	 }
+  
+  mod->queued_events = 0;
+}
+
+void World::ClearQueues()
+{
+  for( size_t q=0; q<event_queues.size(); ++q )
+	 {
+		std::vector<Event>& events( EventHeap( event_queues[q] ) );
+		FOR_EACH( it, events )
+		  --it->mod->queued_events;
+		events.clear();
+	 }
+}
+
 Model* World::CreateModel( Model* parent, const std::string& typestr )
+{
+  std::map<std::string,ModelPtrVec>::iterator pool( retired_models.find( typestr ) );
+  
+  if( pool != retired_models.end() )
+	 {
+		ModelPtrVec& retired( pool->second );
+		
+		// the most recently retired models may still have events
+		// queued, so look for one that hasn't
+		for( size_t i=retired.size(); i>0; --i )
+		  {
+			 Model* mod( retired[i-1] );
+			 if( mod->queued_events )
+				continue;
+			 
+			 retired[i-1] = retired.back();
+			 retired.pop_back();
+			 
+			 mod->Reuse( parent );
+			 return mod;
+		  }
+	 }
+  
+  return NewModel( parent, typestr );
+}
+
+void World::RetireModel( Model* mod )
+{
+  assert( mod );
+  assert( mod->world == this );
+  
+  if( mod->retired )
+	 {
+		PRINT_WARN1( "model %s is already retired", mod->Token() );
+		return;
+	 }
+  
+  // children first, so that each is detached from a parent that is
+  // still in the world
+  while( mod->children.size() )
+	 RetireModel( mod->children.back() );
+  
+  mod->Retire();
+  retired_models[mod->type].push_back( mod );
+}
+
+Model* World::NewModel( Model* parent, const std::string& typestr )
 {
   Model* mod = NULL; // new model to return
   
@@ -362,7 +696,7 @@ void World::LoadModel( Worldfile* wf, int entity )
   const char *typestr = (char*)wf->GetEntityType(entity);      	  
   assert(typestr);
   
-  Model* mod = CreateModel( parent, typestr );
+  Model* mod = NewModel( parent, typestr );
   
   // configure the model with properties from the world file
   mod->Load(wf, entity );
@@ -371,6 +705,79 @@ void World::LoadModel( Worldfile* wf, int entity )
   models_by_wfentity[entity] = mod;
 }
 
+ModelPtrVec World::InstantiatePrototype( Model* proto,
+																				 unsigned int count,
+																				 const std::vector<Pose>& poses )
+{
+  assert( proto );
+  assert( proto->world == this );
+
+  ModelPtrVec copies;
+  copies.reserve( count );
+
+  std::map<Model*,Model*> firsts;
+
+  for( unsigned int i=0; i<count; ++i )
+	 {
+		Model* mod( proto->CloneUnmapped( this, proto->parent, firsts ) );
+		mod->SetPose( i < poses.size() ? poses[i] : proto->pose );
+		copies.push_back( mod );
+	 }
+
+  // as in Load(), map everything before any controller starts
+  FOR_EACH( it, copies )
+	 (*it)->MapClone();
+
+  FOR_EACH( it, copies )
+	 {
+		std::vector<Model*> stack( 1, *it );
+		while( stack.size() )
+		  {
+			 Model* mod( stack.back() );
+			 stack.pop_back();
+
+			 mod->InitControllers();
+			 stack.insert( stack.end(), mod->children.begin(), mod->children.end() );
+		  }
+	 }
+
+  dirty = true;
+  return copies;
+}
+
+void World::StartWorkerThreads()
+{
+	pending_update_callbacks.resize( worker_threads + 1 );
+	cancelled_update_callbacks.resize( worker_threads + 1 );
+
+  if( worker_threads > 0 )
+    {
+      event_queues.resize( worker_threads + 1 );
+		worker_rounds_at_start = worker_rounds;
+
+		//printf( "worker threads %d\n", worker_threads );
+		
+      // kick off the threads
+      for( unsigned int t=0; t<worker_threads; ++t )
+				{
+					// a little configuration for each thread can't be a local
+					// stack var, since it's accssed in the threads
+					std::pair<World*,int>* infop = new std::pair<World*,int>( this, t+1 );
+					
+					//printf( "starting thread %d with ID %d \n", (int)t, info[t].second );
+					
+					//normal posix pthread C function pointer
+					typedef void* (*func_ptr) (void*);
+					
+					pthread_t pt;
+					pthread_create( &pt,
+													NULL,
+													(func_ptr)World::update_thread_entry, 
+													infop );
+		  }
+    }
+}
+
 void World::Load( const std::string& worldfile_path )
 {
   // note: must call Unload() before calling Load() if a world already
@@ -397,6 +804,9 @@ void World::Load( const std::string& worldfile_path )
   this->ppm = 
     1.0 / wf->ReadFloat( entity, "resolution", 1.0 / this->ppm );
   
+  this->occupancy_mipmap = 
+    wf->ReadInt( entity, "occupancy_mipmap", this->occupancy_mipmap );
+  
   this->show_clock = 
     wf->ReadInt( entity, "show_clock", this->show_clock );
   
@@ -409,35 +819,19 @@ void World::Load( const std::string& worldfile_path )
   
   this->worker_threads = wf->ReadInt( entity, "threads",  this->worker_threads );  
 
-	pending_update_callbacks.resize( worker_threads + 1 );
+  this->random_seed = wf->ReadInt( entity, "random_seed", this->random_seed );
+
+  if( wf->ReadInt( entity, "profile", this->profiling ) )
+	 SetProfiling( true );
+
+  if( wf->ReadInt( entity, "trace", this->tracing ) )
+	 StartTrace( wf->ReadInt( entity, "trace_spans", 1<<20 ) );
+
+  StartWorkerThreads();
 
   if( worker_threads > 0 )
     {
       PRINT_WARN( "\nmulti-thread support is experimental and may not work properly, if at all." );
-      
-      event_queues.resize( worker_threads + 1 );
-
-		//printf( "worker threads %d\n", worker_threads );
-		
-      // kick off the threads
-      for( unsigned int t=0; t<worker_threads; ++t )
-				{
-					// a little configuration for each thread can't be a local
-					// stack var, since it's accssed in the threads
-					std::pair<World*,int>* infop = new std::pair<World*,int>( this, t+1 );
-					
-					//printf( "starting thread %d with ID %d \n", (int)t, info[t].second );
-					
-					//normal posix pthread C function pointer
-					typedef void* (*func_ptr) (void*);
-					
-					pthread_t pt;
-					pthread_create( &pt,
-													NULL,
-													(func_ptr)World::update_thread_entry, 
-													infop );
-		  }
-      
       printf( "[threads %u]", worker_threads );	
     }
   
@@ -459,8 +853,11 @@ void World::Load( const std::string& worldfile_path )
 				LoadModel( wf, entity );
     }
   
-  // call all controller init functions
-  FOR_EACH( it, models )
+  // call all controller init functions. Controllers may create
+  // models of their own, which are mapped as they are made, so
+  // only visit the models that were loaded.
+  const ModelPtrVec loaded( models.begin(), models.end() );
+  FOR_EACH( it, loaded )
 	 {
 		// all this is a hack and shouldn't be necessary
 		(*it)->blockgroup.CalcSize();
@@ -471,16 +868,188 @@ void World::Load( const std::string& worldfile_path )
 		(*it)->InitControllers();
 	 }
 
+  // the bitmaps are read by now, so they can be cached too
+  wf->SaveCache();
+
   putchar( '\n' );
 }
 
+bool World::IsMapModel( Model* mod ) const
+{
+  if( mod->shares_map )
+	 return true;
+  
+  if( mod->parent || mod->gui.move || dynamic_cast<ModelPosition*>( mod ) )
+	 return false;
+  
+  // nothing that drives around may be attached
+  std::vector<Model*> stack( mod->children );
+  while( stack.size() )
+	 {
+		Model* child( stack.back() );
+		stack.pop_back();
+		
+		if( dynamic_cast<ModelPosition*>( child ) )
+		  return false;
+		
+		stack.insert( stack.end(), child->children.begin(), child->children.end() );
+	 }
+  
+  return true;
+}
+
+World* World::Clone( bool copy_callbacks )
+{
+  World* clone = new World( token, ppm );
+  
+  // the grid is shared, so must have the same layout
+  clone->ppm = ppm;
+  clone->occupancy_mipmap = occupancy_mipmap;
+  
+  std::set<Model*> map_models;
+  FOR_EACH( it, children )
+	 if( IsMapModel( *it ) )
+		map_models.insert( *it );
+  
+  // share or copy the map blocks of every region, leaving out
+  // everything else. The clone's grid is empty, though the ground
+  // model may have created some superregions.
+  FOR_EACH( it, superregions )
+	 clone->GetSuperRegionCreate( it->first )->CopyMap( *it->second, map_models );
+  
+  clone->sim_time = sim_time;
+  clone->updates = updates;
+  clone->quit_time = quit_time;
+  clone->sim_interval = sim_interval;
+  clone->paused = paused;
+  clone->random_seed = random_seed;
+  clone->show_clock = show_clock;
+  clone->show_clock_interval = show_clock_interval;
+  clone->worker_threads = worker_threads;
+  clone->StartWorkerThreads();
+  
+  // copy the model tree as Model::Clone() does, so each copy reads
+  // its configuration from its original's worldfile entity and takes
+  // its original's blocks. Nothing is mapped yet. Copies of the map
+  // models are never mapped, since the clone borrows their blocks.
+  std::map<Model*,Model*> copies;
+  FOR_EACH( it, children )
+	 (*it)->CloneUnmapped( clone, NULL, copies );
+  
+  // the copies were given generated names, so rename them all after
+  // their originals, which may have taken each other's names
+  FOR_EACH( it, copies )
+	 clone->models_by_name.erase( it->second->token );
+  
+  FOR_EACH( it, copies )
+	 {
+		Model* copy( it->second );
+		copy->token = it->first->token;
+		copy->child_type_counts = it->first->child_type_counts;
+		clone->AddModelName( copy, copy->token );
+	 }
+  clone->child_type_counts = child_type_counts;
+  
+  FOR_EACH( it, models_by_wfentity )
+	 {
+		std::map<Model*,Model*>::iterator copy( copies.find( it->second ) );
+		if( copy != copies.end() )
+		  clone->models_by_wfentity[ it->first ] = copy->second;
+	 }
+  
+  if( copy_callbacks )
+	 {
+		FOR_EACH( it, copies )
+		  it->second->CopyCallbacks( *it->first );
+		
+		clone->cb_list = cb_list;
+		
+		FOR_EACH( batch, batches )
+		  for( size_t i(0); i<(*batch)->Size(); ++i )
+			 clone->AddBatchMember( (*batch)->cb, (*batch)->user,
+											(ModelRanger*)copies[ (*batch)->rangers[i] ],
+											(ModelPosition*)copies[ (*batch)->positions[i] ] );
+		
+		for( size_t b(0); b<batches.size() && b<clone->batches.size(); ++b )
+		  clone->batches[b]->last_call = batches[b]->last_call;
+	 }
+  else
+	 {
+		// start the copies' controllers again, in tree order as Load()
+		// does, so that they find the copies and not our models. This
+		// comes before the state is copied, since a controller may
+		// subscribe, and CopyState() then matches our subscriptions.
+		std::vector<Model*> stack( clone->children.rbegin(), clone->children.rend() );
+		while( stack.size() )
+		  {
+			 Model* mod( stack.back() );
+			 stack.pop_back();
+			 
+			 mod->InitControllers();
+			 stack.insert( stack.end(), mod->children.rbegin(), mod->children.rend() );
+		  }
+	 }
+  
+  // copy model state. Subscribing may queue events, which are
+  // replaced by copies of ours below.
+  FOR_EACH( it, copies )
+	 it->second->CopyState( *it->first );
+  
+  // replace the events queued while copying with copies of ours,
+  // keeping their heap order so that events due at the same time are
+  // handled in the same order in both worlds
+  clone->ClearQueues();
+  
+  for( size_t q=0; q<event_queues.size() && q<clone->event_queues.size(); ++q )
+	 {
+		clone->event_queues[q] = event_queues[q];
+		std::vector<Event>& events( EventHeap( clone->event_queues[q] ) );
+		
+		size_t kept(0);
+		FOR_EACH( it, events )
+		  {
+			 std::map<Model*,Model*>::iterator copy( copies.find( it->mod ) );
+			 if( copy == copies.end() )
+				continue;
+			 
+			 events[kept] = *it;
+			 events[kept++].mod = copy->second;
+			 ++copy->second->queued_events;
+		  }
+		
+		if( kept < events.size() )
+		  {
+			 events.erase( events.begin() + kept, events.end() );
+			 std::make_heap( events.begin(), events.end() );
+		  }
+	 }
+  
+  // map the copies at the poses just copied
+  FOR_EACH( it, children )
+	 if( ! map_models.count( *it ) )
+		copies[*it]->MapClone();
+  
+  return clone;
+}
+
 void World::UnLoad()
 {
   if( wf ) delete wf;
+  wf = NULL;
 
-  FOR_EACH( it, children )
+  // no events can be handled for the models we are about to delete
+  ClearQueues();
+
+  ModelPtrVec doomed( children );
+  FOR_EACH( it, doomed )
     delete (*it);
   children.clear();
+
+  std::map<std::string,ModelPtrVec> retired;
+  retired.swap( retired_models );
+  FOR_EACH( pool, retired )
+	 FOR_EACH( it, pool->second )
+		delete *it;
  
   models_by_name.clear();
   models_by_wfentity.clear();
@@ -551,31 +1120,225 @@ int World::RemoveUpdateCallback( world_callback_t cb,
   return cb_list.size();
 }
 
+RangerBatch::RangerBatch( callback_t cb, void* user ) :
+	rangers(),
+	positions(),
+	x(), y(), a(),
+	ranges(),
+	bearings(),
+	offsets(),
+	vx(), vy(), va(),
+	cb( cb ),
+	user( user ),
+	last_call( 0 ),
+	preset()
+{
+}
+
+void RangerBatch::Add( ModelRanger* ranger, ModelPosition* position )
+{
+	rangers.push_back( ranger );
+	positions.push_back( position );
+}
+
+bool RangerBatch::Remove( ModelRanger* ranger )
+{
+	for( size_t i(0); i<rangers.size(); ++i )
+		if( rangers[i] == ranger )
+			{
+				rangers.erase( rangers.begin() + i );
+				positions.erase( positions.begin() + i );
+				return true;
+			}
+	return false;
+}
+
+bool RangerBatch::Pack( usec_t now )
+{
+	// call only when there is something new to act on, as the
+	// per-robot ranger callbacks would be
+	bool fresh( false );
+	FOR_EACH( it, rangers )
+		if( (*it)->last_update > last_call )
+			{
+				fresh = true;
+				break;
+			}
+	
+	if( ! fresh )
+		return false;
+	
+	last_call = now;
+	
+	const size_t n( rangers.size() );
+	
+	x.resize( n );
+	y.resize( n );
+	a.resize( n );
+	vx.resize( n );
+	vy.resize( n );
+	va.resize( n );
+	offsets.resize( n+1 );
+	preset.resize( n );
+
+	// the sample arrays keep their storage from call to call
+	ranges.clear();
+	bearings.clear();
+	
+	for( size_t i(0); i<n; ++i )
+		{
+			const Pose pose( positions[i]->GetGlobalPose() );
+			x[i] = pose.x;
+			y[i] = pose.y;
+			a[i] = pose.a;
+			
+			// the current command, or the current velocity of a model
+			// that is driving to a goal pose
+			const ModelPosition* pos( positions[i] );
+			preset[i] = pos->control_mode == ModelPosition::CONTROL_VELOCITY ? 
+				Velocity( pos->goal.x, pos->goal.y, pos->goal.z, pos->goal.a ) : pos->GetVelocity();
+			vx[i] = preset[i].x;
+			vy[i] = preset[i].y;
+			va[i] = preset[i].a;
+			
+			// heading of the ranger relative to the position model
+			const radians_t heading( normalize( rangers[i]->GetGlobalPose().a + 
+																					rangers[i]->GetGeom().pose.a - 
+																					pose.a ) );
+			offsets[i] = ranges.size();
+			
+			const std::vector<ModelRanger::Sensor>& sensors( rangers[i]->GetSensors() );
+			FOR_EACH( it, sensors )
+				{
+					const ModelRanger::Sensor& s( *it );
+					
+					// same ray directions as ModelRanger::Sensor::Update()
+					const size_t count( s.ranges.size() );
+					const radians_t incr( s.fov / std::max( count-1, (size_t)1 ) );
+					radians_t bearing( heading + s.pose.a - (count > 1 ? s.fov/2.0 : 0.0) );
+					
+					for( size_t j(0); j<count; ++j, bearing += incr )
+						{
+							ranges.push_back( s.ranges[j] );
+							bearings.push_back( bearing );
+						}
+				}
+		}
+	
+	offsets[n] = ranges.size();
+	return true;
+}
+
+void RangerBatch::Apply()
+{
+	for( size_t i(0); i<positions.size(); ++i )
+		if( vx[i] != preset[i].x || vy[i] != preset[i].y || va[i] != preset[i].a )
+			positions[i]->SetSpeed( vx[i], vy[i], va[i] );
+}
+
+void World::AddBatchMember( RangerBatch::callback_t cb, void* user,
+														ModelRanger* ranger, ModelPosition* position )
+{
+	assert( ranger );
+	assert( position );
+	
+	FOR_EACH( it, batches )
+		if( (*it)->cb == cb && (*it)->user == user )
+			{
+				(*it)->Add( ranger, position );
+				return;
+			}
+	
+	RangerBatch* batch( new RangerBatch( cb, user ) );
+	batch->Add( ranger, position );
+	batches.push_back( batch );
+}
+
+int World::RemoveBatchMember( RangerBatch::callback_t cb, void* user,
+															ModelRanger* ranger )
+{
+	for( size_t i(0); i<batches.size(); ++i )
+		{
+			RangerBatch* batch( batches[i] );
+			if( batch->cb != cb || batch->user != user )
+				continue;
+			
+			batch->Remove( ranger );
+			
+			const int remaining( batch->Size() );
+			if( remaining == 0 )
+				{
+					delete batch;
+					batches.erase( batches.begin() + i );
+				}
+			return remaining;
+		}
+	return 0;
+}
+
+void World::RemoveBatchMember( ModelRanger* ranger )
+{
+	for( size_t i(0); i<batches.size(); )
+		{
+			RangerBatch* batch( batches[i] );
+			batch->Remove( ranger );
+			
+			if( batch->Size() == 0 )
+				{
+					delete batch;
+					batches.erase( batches.begin() + i );
+				}
+			else
+				++i;
+		}
+}
+
 void World::CallUpdateCallbacks()
 {
 	// call model CB_UPDATE callbacks queued up by worker threads
 	size_t threads( pending_update_callbacks.size() );
-	int cbcount( 0 );
+	
+	// gather the lists from all the threads and call them in id order,
+	// so that the order doesn't depend on the number of threads
+	ModelPtrVec& q( pending_update_callbacks[0] );
 	
 	for( size_t t(0); t<threads; ++t )
 		{
-			std::queue<Model*>& q( pending_update_callbacks[t] );
-			
-// 			printf( "pending callbacks for thread %u: %u\n", 
-// 							(unsigned int)t, 
-// 							(unsigned int)q.size() );
-			
-			cbcount += q.size();
+			update_cb_count -= cancelled_update_callbacks[t];
+			cancelled_update_callbacks[t] = 0;
 
-			while( ! q.empty() )
+			if( t > 0 )
 				{
-					q.front()->CallUpdateCallbacks();
-					q.pop();
+					q.insert( q.end(), 
+										pending_update_callbacks[t].begin(), 
+										pending_update_callbacks[t].end() );
+					pending_update_callbacks[t].clear(); // keeps its storage for next time
 				}
 		}
-	//	printf( "cb total %u (global %d)\n\n", (unsigned int)cbcount,update_cb_count );
 	
-	assert( update_cb_count >= cbcount );
+	std::sort( q.begin(), q.end(), ltid() );
+	
+	assert( update_cb_count >= (int)q.size() );
+	
+	// index rather than iterate, in case a callback adds to q
+	for( size_t i(0); i<q.size(); ++i )
+		q[i]->CallUpdateCallbacks();
+	
+	q.clear(); // keeps its storage for next time
+
+	const double start( profiling ? WallSeconds() : 0 );
+
+	// batch controllers, each called once for all its members. Index
+	// rather than iterate, in case a callback changes the batches.
+	for( size_t i(0); i<batches.size(); ++i )
+		{
+			RangerBatch* batch( batches[i] );
+			if( batch->Pack( sim_time ) )
+				{
+					(*batch->cb)( this, *batch, batch->user );
+					batch->Apply();
+				}
+		}
 
 	// world callbacks
   FOR_EACH( it, cb_list )
@@ -583,6 +1346,9 @@ void World::CallUpdateCallbacks()
       if( ((*it).first )( this, (*it).second ) )
 				it = cb_list.erase( it );
     }      
+
+  if( profiling )
+	 world_callback_time += WallSeconds() - start;
 }
 
 void World::ConsumeQueue( unsigned int queue_num )
@@ -592,6 +1358,8 @@ void World::ConsumeQueue( unsigned int queue_num )
   if( queue.empty() )
     return;
   
+  const double queue_start( tracing ? WallSeconds() : 0 );
+
   //printf( "event queue len %d\n", (int)queue.size() );
   
   // update everything on the event queue that happens at this time or earlier
@@ -605,9 +1373,200 @@ void World::ConsumeQueue( unsigned int queue_num )
       //std::string modelType = ev.mod->GetModelType();
       //printf( "@ %llu next event <%s %llu %s>\n",  sim_time, modelType.c_str(), ev.time, ev.mod->Token() ); 
       
-			ev.cb( ev.mod, ev.arg); // call the event's callback on the model			
+			--ev.mod->queued_events;
+			
+			// retired models are left out of the simulation
+			if( ev.mod->retired )
+			  continue;
+
+			if( ! ( profiling || tracing ) )
+			  {
+				 ev.cb( ev.mod, ev.arg); // call the event's callback on the model
+				 continue;
+			  }
+
+			ProfileCounters& p( ev.mod->profile );
+			const double callbacks( p.callback_time );
+			const double start( WallSeconds() );
+
+			ev.cb( ev.mod, ev.arg);
+
+			if( tracing )
+			  Trace( queue_num, "update", ev.mod->id, start );
+
+			if( profiling )
+			  {
+				 // count the model's callbacks only as callbacks
+				 p.update_time += WallSeconds() - start - ( p.callback_time - callbacks );
+				 ++p.updates;
+			  }
     }
   while( !queue.empty() );
+
+  if( tracing )
+	 Trace( queue_num, "ConsumeQueue", TraceRing::NO_MODEL, queue_start );
+}
+
+double World::WallSeconds()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return( tv.tv_sec + tv.tv_usec / 1e6 );
+}
+
+void World::EndPhase( phase_t phase, double& start )
+{
+  if( ! time_phases )
+	 return;
+
+  const double now( WallSeconds() );
+  phase_times[phase] += now - start;
+  start = now;
+}
+
+const char* World::PhaseName( phase_t phase )
+{
+  switch( phase )
+	 {
+	 case PHASE_FIDUCIALS: return "fiducials";
+	 case PHASE_MAIN_QUEUE: return "main_queue";
+	 case PHASE_WORKER_QUEUES: return "worker_queues";
+	 case PHASE_MOVE: return "move";
+	 case PHASE_CALLBACKS: return "callbacks";
+	 case PHASE_ENERGY: return "energy";
+	 default: return "unknown";
+	 }
+}
+
+void World::SetProfiling( bool enable )
+{
+  // the first world to profile arranges for the profiles to be
+  // dumped, however the program exits
+  static bool registered( false );
+  if( enable && ! registered )
+	 {
+		atexit( DumpProfiles );
+		registered = true;
+	 }
+
+  profiling = enable;
+  if( enable )
+	 time_phases = true;
+}
+
+void World::ClearProfile()
+{
+  FOR_EACH( it, models )
+	 (*it)->profile.Clear();
+
+  world_callback_time = 0;
+  bzero( phase_times, sizeof(phase_times) );
+}
+
+// sorts profile entries, most expensive first
+static bool MoreExpensive( const Profile::Entry& a, const Profile::Entry& b )
+{
+  return( a.counters.TotalTime() > b.counters.TotalTime() );
+}
+
+Profile World::GetProfile() const
+{
+  Profile profile;
+  // worlds without a "name" are known by their worldfile
+  profile.world = ( token.empty() && wf ) ? wf->filename : token;
+  profile.sim_seconds = sim_time / 1e6;
+  profile.world_callback_time = world_callback_time;
+  profile.phase_times.assign( phase_times, phase_times + PHASE_COUNT );
+
+  std::map<std::string,Profile::Entry> types;
+
+  FOR_EACH( it, models )
+	 {
+		const Model* mod( *it );
+		if( mod->retired )
+		  continue;
+
+		Profile::Entry entry;
+		entry.name = mod->token;
+		entry.type = mod->GetModelType();
+		entry.count = 1;
+		entry.counters = mod->profile;
+		profile.models.push_back( entry );
+
+		Profile::Entry& type( types[ entry.type ] );
+		type.name = type.type = entry.type;
+		++type.count;
+		type.counters += mod->profile;
+	 }
+
+  FOR_EACH( it, types )
+	 profile.types.push_back( it->second );
+
+  std::stable_sort( profile.types.begin(), profile.types.end(), MoreExpensive );
+  std::stable_sort( profile.models.begin(), profile.models.end(), MoreExpensive );
+
+  return profile;
+}
+
+MemoryUsage World::MemoryStats() const
+{
+  MemoryUsage usage;
+
+  FOR_EACH( it, superregions )
+	 it->second->AddMemoryUsage( usage );
+
+  FOR_EACH( it, models )
+	 (*it)->AddMemoryUsage( usage.types[ (*it)->type ] );
+
+  usage.logs = LogEntry::log.capacity() * sizeof(LogEntry);
+
+  return usage;
+}
+
+std::string World::ReportFilename( const char* suffix ) const
+{
+  // worlds without a "name" are known by their worldfile
+  std::string filename( ( token.empty() && wf ) ? wf->filename : token );
+
+  const size_t slash( filename.rfind( '/' ) );
+  if( slash != std::string::npos )
+	 filename.erase( 0, slash + 1 );
+
+  return filename + suffix;
+}
+
+void World::DumpProfiles()
+{
+  static bool dumped( false );
+  if( dumped )
+	 return;
+  dumped = true;
+
+  FOR_EACH( it, world_set )
+	 {
+		World* world( *it );
+		if( ! world->profiling )
+		  continue;
+
+		const Profile profile( world->GetProfile() );
+		profile.Print( stdout );
+
+		const std::string filename( world->ReportFilename( ".profile.json" ) );
+
+		FILE* file( fopen( filename.c_str(), "w" ) );
+		if( file == NULL )
+		  {
+			 PRINT_ERR2( "unable to write profile %s : %s",
+							 filename.c_str(), strerror(errno) );
+			 continue;
+		  }
+
+		profile.PrintJSON( file );
+		fclose( file );
+		printf( "[Profile written to %s]\n", filename.c_str() );
+	 }
+
+  fflush( stdout );
 }
 
 bool World::Update()
@@ -626,6 +1585,7 @@ bool World::Update()
 	
   sim_time += sim_interval; 
 	
+  double phase_start( time_phases ? WallSeconds() : 0 );
   
 	// rebuild the sets sorted by position on x,y axis
 	models_with_fiducials_byx.clear(); 
@@ -640,23 +1600,33 @@ bool World::Update()
 	//printf( "x %lu y %lu\n", models_with_fiducials_byy.size(),
 	//			models_with_fiducials_byx.size() );
 
+  EndPhase( PHASE_FIDUCIALS, phase_start );
+
   // handle the zeroth queue synchronously in the main thread
   ConsumeQueue( 0 );
+
+  EndPhase( PHASE_MAIN_QUEUE, phase_start );
+  
+  // bring the cached global poses of the models that have moved up
+  // to date here, so that the workers only ever read them. Models may
+  // be on the list twice, or have been brought up to date since.
+  if( worker_threads > 0 )
+	 FOR_EACH( it, dirty_poses )
+		if( (*it)->global_pose_dirty )
+		  (*it)->GetGlobalPose();
+  dirty_poses.clear(); // keeps its storage for next time
   
   // handle all the remaining queues asynchronously in worker threads
   if( worker_threads > 0 )
 	 {
 		pthread_mutex_lock( &sync_mutex );
 		threads_working = worker_threads; 
+		++worker_rounds;
 		// unblock the workers - they are waiting on this condition var
 		//puts( "main thread signalling workers" );
 		pthread_cond_broadcast( &threads_start_cond );
 		pthread_mutex_unlock( &sync_mutex );		 
 		
-		// todo - take the 1th thread work here?
-		FOR_EACH( it, active_velocity )
-		  (*it)->Move();
-		
 		pthread_mutex_lock( &sync_mutex );
 		// wait for all the last update job to complete - it will
 		// signal the worker_threads_done condition var
@@ -668,9 +1638,40 @@ bool World::Update()
 		pthread_mutex_unlock( &sync_mutex );		 
 		//puts( "main thread awakes" );
 		
-		// TODO: allow threadsafe callbacks to be called in worker
-		// threads		
+		// thread-safe update callbacks have been called in the worker
+		// threads. The rest are called below.
 	 }
+
+  EndPhase( PHASE_WORKER_QUEUES, phase_start );
+  
+  // move only once the sensors are done, as with no worker threads,
+  // so that no sensor sees a model part way through its move and the
+  // results don't depend on the timing of the threads
+  double span_start( tracing ? WallSeconds() : 0 );
+
+  if( profiling )
+	 FOR_EACH( it, active_velocity )
+		{
+		  ProfileCounters& p( (*it)->profile );
+		  const double callbacks( p.callback_time );
+		  const double start( WallSeconds() );
+
+		  (*it)->Move();
+
+		  p.move_time += WallSeconds() - start - ( p.callback_time - callbacks );
+		  ++p.moves;
+		}
+  else
+	 FOR_EACH( it, active_velocity )
+		(*it)->Move();
+
+  if( tracing )
+	 {
+		Trace( 0, "Move", TraceRing::NO_MODEL, span_start );
+		span_start = WallSeconds();
+	 }
+
+  EndPhase( PHASE_MOVE, phase_start );
   
   dirty = true; // need redraw 
   
@@ -678,9 +1679,26 @@ bool World::Update()
   
   // world callbacks
   CallUpdateCallbacks();
+
+  if( tracing )
+	 {
+		Trace( 0, "CallUpdateCallbacks", TraceRing::NO_MODEL, span_start );
+		span_start = WallSeconds();
+	 }
+
+  EndPhase( PHASE_CALLBACKS, phase_start );
   
   FOR_EACH( it, active_energy )
 	 (*it)->UpdateCharge();
+
+  if( tracing )
+	 Trace( 0, "UpdateCharge", TraceRing::NO_MODEL, span_start );
+
+  EndPhase( PHASE_ENERGY, phase_start );
+
+#ifdef RAYTRACE_STATS
+  CollectRaytraceStats();
+#endif
   
   ++updates;  
     
@@ -689,9 +1707,12 @@ bool World::Update()
 
 unsigned int World::GetEventQueue( Model* mod ) const
 {
+  // draw from the model's stream even when it isn't needed, so that
+  // the model's later draws don't depend on the number of threads
+  const uint32_t r( mod->RandomInt() );
   if( worker_threads < 1 )
     return 0;
-  return( (random() % worker_threads) + 1);
+  return( (r % worker_threads) + 1);
 }
 
 Model* World::GetModel( const std::string& name ) const
@@ -700,7 +1721,7 @@ Model* World::GetModel( const std::string& name ) const
 	
   std::map<std::string,Model*>::const_iterator it( models_by_name.find( name ) );
 	
-  if( it == models_by_name.end() )
+  if( it == models_by_name.end() || it->second->retired )
     {
       PRINT_WARN1( "lookup of model name %s: no matching name", name.c_str() );
       return NULL;
@@ -740,6 +1761,20 @@ void World::Raytrace( const Pose &gpose, // global pose
 							 RaytraceResult* samples, // preallocated storage for samples
 							 const uint32_t sample_count, // number of samples
 							 const bool ztest ) 
+{
+  Raytrace( gpose, range, fov, FuncRayMatch( func, model, arg ), model,
+						samples, sample_count, ztest );
+}
+
+template <class Match>
+void World::Raytrace( const Pose &gpose, // global pose
+							 const meters_t range,
+							 const radians_t fov,
+							 const Match& match,
+							 const Model* mod,
+							 RaytraceResult* samples, // preallocated storage for samples
+							 const uint32_t sample_count, // number of samples
+							 const bool ztest ) 
 {
   // find the direction of the first ray
   Pose raypose = gpose;
@@ -748,7 +1783,7 @@ void World::Raytrace( const Pose &gpose, // global pose
   for( uint32_t s=0; s < sample_count; ++s )
     {
       raypose.a = (s * fov / (double)(sample_count-1)) - starta;
-      samples[s] = Raytrace( raypose, range, func, model, arg, ztest );
+      samples[s] = Raytrace( Ray( mod, raypose, range, NULL, NULL, ztest ), match );
     }
 }
 
@@ -763,8 +1798,56 @@ RaytraceResult World::Raytrace( const Pose &gpose,
   return Raytrace( Ray( mod, gpose, range, func, arg, ztest ));
 }
 
-
 RaytraceResult World::Raytrace( const Ray& r )
+{
+  return Raytrace( r, FuncRayMatch( r.func, r.mod, r.arg ) );
+}
+
+template <class Match>
+RaytraceResult World::Raytrace( const Ray& r, const Match& match )
+{
+  // hoist the z test out of the loop by choosing a kernel here
+  if( r.ztest )
+		return RaytraceKernel<Match,true>( r, match );
+  else
+		return RaytraceKernel<Match,false>( r, match );
+}
+
+// Ray predicates. These are defined here so that they can be inlined
+// into the kernels below.
+
+inline bool FuncRayMatch::operator()( Model* candidate ) const
+{
+  return (*func)( candidate, finder, arg );
+}
+
+// two models are related iff they have the same top-level ancestor
+static inline const Model* TopLevel( const Model* mod )
+{
+  while( mod->Parent() )
+		mod = mod->Parent();
+  return mod;
+}
+
+UnrelatedRayMatch::UnrelatedRayMatch( const Model* finder ) 
+  : root( TopLevel( finder ) )
+{}
+
+inline bool UnrelatedRayMatch::operator()( Model* candidate ) const
+{
+  return( TopLevel( candidate ) != root );
+}
+
+inline bool RangerRayMatch::operator()( Model* candidate ) const
+{
+  // Ignore the model that's looking and things that are invisible to
+  // rangers 
+  return( sgn(candidate->vis.ranger_return) != -1 && 
+					UnrelatedRayMatch::operator()( candidate ) );
+}
+
+template <class Match, bool ztest>
+RaytraceResult World::RaytraceKernel( const Ray& r, const Match& match )
 {
   //rt_cells.clear();
   //rt_candidate_cells.clear();
@@ -814,6 +1897,12 @@ RaytraceResult World::Raytrace( const Ray& r )
 
   const unsigned int layer( (updates+1) % 2 );
   
+  // for the profile of the ray's model
+  uint64_t cells(0), regions_skipped(0);
+#ifdef RAYTRACE_STATS
+  uint64_t predicate_calls(0);
+#endif
+
   // these are updated as we go along the ray
   double xcrossx(0), xcrossy(0);
   double ycrossx(0), ycrossy(0);
@@ -828,7 +1917,15 @@ RaytraceResult World::Raytrace( const Ray& r )
 			SuperRegion* sr( GetSuperRegion(point_int_t(GETSREG(globx),GETSREG(globy))));
 			Region* reg( sr ?	sr->GetRegion(GETREG(globx),GETREG(globy)) : NULL );
 			
-      if( reg && reg->count ) // if the region contains any objects
+			// record our path for the caller if requested
+			if( r.regions && reg && (r.regions->empty() || r.regions->back() != reg) )
+				r.regions->push_back( reg );
+
+      // if the region contains any objects. Z-tested rays also skip
+      // regions with nothing at the ray's height.
+      if( reg && reg->count && 
+					( !ztest || ( sr->Occupied( layer, r.origin.z ) && 
+												reg->Occupied( layer, r.origin.z ) ) ) )
 				{
 					//assert( reg->cells.size() );
 					
@@ -844,25 +1941,79 @@ RaytraceResult World::Raytrace( const Ray& r )
 			 Cell* c( &reg->cells[ cx + cy * REGIONWIDTH ] );
 			 assert(c); // should be good: we know the region contains objects
 
+			 // if the region has coarse occupancy maps, the level of the
+			 // empty coarse cell we are crossing (0 if none), and the
+			 // coarse cell we last looked up
+			 int32_t level(0), shift(0), mx(-1), my(-1);
+
 			 // while within the bounds of this region and while some ray remains
 			 // we'll tweak the cell pointer directly to move around quickly
 			 while( (cx>=0) && (cx<REGIONWIDTH) && 
 					  (cy>=0) && (cy<REGIONWIDTH) && 
 					  n > 0 )
 				{			 
+				  // look for the coarsest empty cell containing this
+				  // one, unless we're still in the last one we looked up.
+				  // Cells in an occupied 2x2 cell are examined one by one.
+				  if( reg->mip && ( (cx>>shift) != mx || (cy>>shift) != my ) )
+					 {
+						level = reg->EmptyMipLevel( layer, cx, cy );
+						shift = level ? level : 1;
+						mx = cx >> shift;
+						my = cy >> shift;
+					 }
+
+				  // step out of an empty coarse cell in one go: find how
+				  // many steps along X and along Y the line algorithm
+				  // takes before it leaves the cell, and take them all
+				  if( level > 0 )
+					 {
+						// steps to the first cell outside the coarse cell
+						// along each axis
+						const int32_t kx( sx > 0 ? ((mx+1) << level) - cx : cx - (mx << level) + 1 );
+						const int32_t ky( sy > 0 ? ((my+1) << level) - cy : cy - (my << level) + 1 );
+
+						// we step along X while exy < 0, so before the kx'th
+						// X step we have taken this many Y steps
+						const int32_t ex( exy + (kx-1) * by );
+						const int32_t jx( ex < 0 ? 0 : (bx ? ex / bx + 1 : ky) );
+
+						int32_t i(kx), j(jx);
+						if( jx >= ky ) // we leave through the top or bottom first
+						  {
+							 // X steps taken before the ky'th Y step
+							 const int32_t ey( (ky-1) * bx - exy );
+							 i = ey <= 0 ? 0 : (ey + by - 1) / by;
+							 j = ky;
+						  }
+
+						globx += sx * i;
+						globy += sy * j;
+						exy += i * by - j * bx;
+						c += sx * i + sy * j * REGIONWIDTH;
+						cx += sx * i;
+						cy += sy * j;
+						n -= i + j;
+						++cells;
+						continue;
+					 }
+
 				  FOR_EACH( it, c->blocks[layer] )
 					 {	      	      
 						Block* block( *it );
 						assert( block );
 
 						// skip if not in the right z range
-						if( r.ztest && 
+						if( ztest && 
 							 ( r.origin.z < block->global_z.min || 
 								r.origin.z > block->global_z.max ) )
 						  continue; 
 									
+#ifdef RAYTRACE_STATS
+						++predicate_calls;
+#endif
 						// test the predicate we were passed
-						if( (*r.func)( block->mod, (Model*)r.mod, r.arg )) 
+						if( match( block->mod ) ) 
 						  {
 							 // a hit!
 							 sample.color = block->GetColor();
@@ -873,6 +2024,11 @@ RaytraceResult World::Raytrace( const Ray& r )
 							 else
 								sample.range = fabs((globy-starty) / sina) / ppm;
 											
+							 if( profiling )
+								CountRaytrace( r.mod, cells, regions_skipped );
+#ifdef RAYTRACE_STATS
+							 CountRaytraceStats( r.mod, true, cells, regions_skipped, predicate_calls );
+#endif
 							 return sample;
 						  }				  
 					 }
@@ -893,6 +2049,7 @@ RaytraceResult World::Raytrace( const Ray& r )
 						cy += sy; // cell coordinate for bounds checking
 					 }			 
 				  --n; // decrement the manhattan distance remaining
+				  ++cells;
 													 							
 				  //rt_cells.push_back( point_int_t( globx, globy ));
 				}					
@@ -900,6 +2057,8 @@ RaytraceResult World::Raytrace( const Ray& r )
 		  }							 
       else // jump over the empty region
 		  {		  		  		  
+			 ++regions_skipped;
+
 			 // on the first run, and when we've been iterating over
 			 // cells, we need to calculate the next crossing of a region
 			 // boundary along each axis
@@ -979,9 +2138,94 @@ RaytraceResult World::Raytrace( const Ray& r )
     } 
   // hit nothing
   sample.mod = NULL;
+  if( profiling )
+	 CountRaytrace( r.mod, cells, regions_skipped );
+#ifdef RAYTRACE_STATS
+  CountRaytraceStats( r.mod, false, cells, regions_skipped, predicate_calls );
+#endif
   return sample;
 }
 
+void World::CountRaytrace( const Model* mod, uint64_t cells, uint64_t regions_skipped ) const
+{
+  if( mod == NULL )
+	 return;
+
+  ProfileCounters& p( mod->profile );
+  ++p.raytraces;
+  p.cells += cells;
+  p.regions_skipped += regions_skipped;
+}
+
+bool World::RaytraceStatsEnabled()
+{
+#ifdef RAYTRACE_STATS
+  return true;
+#else
+  return false;
+#endif
+}
+
+void World::CountRaytraceStats( const Model* mod, bool hit, uint64_t cells,
+										  uint64_t region_jumps, uint64_t predicate_calls )
+{
+  // a model's rays are cast by the one thread that updates it
+  if( mod )
+	 {
+		if( mod->raytrace_stats == NULL )
+		  mod->raytrace_stats = new RaytraceStats::Counters;
+		mod->raytrace_stats->Add( hit, cells, region_jumps, predicate_calls );
+		return;
+	 }
+
+  // but rays cast by no model may come from any thread
+  pthread_mutex_lock( &raytrace_stats_mutex );
+  raytrace_unowned.Add( hit, cells, region_jumps, predicate_calls );
+  pthread_mutex_unlock( &raytrace_stats_mutex );
+}
+
+void World::CollectRaytraceStats()
+{
+  raytrace_stats.Clear();
+
+  pthread_mutex_lock( &raytrace_stats_mutex );
+  if( raytrace_unowned.rays )
+	 {
+		raytrace_stats.types[""] = raytrace_unowned;
+		raytrace_unowned.Clear();
+	 }
+  pthread_mutex_unlock( &raytrace_stats_mutex );
+
+  FOR_EACH( it, models )
+	 {
+		RaytraceStats::Counters* counters( (*it)->raytrace_stats );
+		if( counters && counters->rays )
+		  {
+			 raytrace_stats.types[ (*it)->type ] += *counters;
+			 counters->Clear();
+		  }
+	 }
+
+  FOR_EACH( it, raytrace_stats.types )
+	 raytrace_stats.total += it->second;
+
+  raytrace_totals += raytrace_stats;
+}
+
+// build the kernels for the predicates declared in stage.hh
+template RaytraceResult World::Raytrace( const Ray&, const FuncRayMatch& );
+template RaytraceResult World::Raytrace( const Ray&, const UnrelatedRayMatch& );
+template RaytraceResult World::Raytrace( const Ray&, const RangerRayMatch& );
+template void World::Raytrace( const Pose&, const meters_t, const radians_t, 
+															 const FuncRayMatch&, const Model*, RaytraceResult*,
+															 const uint32_t, const bool );
+template void World::Raytrace( const Pose&, const meters_t, const radians_t, 
+															 const UnrelatedRayMatch&, const Model*, RaytraceResult*,
+															 const uint32_t, const bool );
+template void World::Raytrace( const Pose&, const meters_t, const radians_t, 
+															 const RangerRayMatch&, const Model*, RaytraceResult*,
+															 const uint32_t, const bool );
+
 static int _save_cb( Model* mod, void* dummy )
 {
   mod->Save();
@@ -1142,6 +2386,13 @@ inline SuperRegion* World::GetSuperRegionCreate( const point_int_t& org )
   return sr;
 }
 
+Cell* World::GetCellCreate( const point_int_t& glob )
+{
+  return( GetSuperRegionCreate( point_int_t( GETSREG(glob.x), GETSREG(glob.y) ))
+					->GetRegion( GETREG(glob.x), GETREG(glob.y) )
+					->GetCell( GETCELL(glob.x), GETCELL(glob.y) ));
+}
+
 
 void World::Extend( point3_t pt )
 {
@@ -1177,6 +2428,18 @@ void World::Log( Model* mod )
   //LogEntry::Print();
 }
 
+std::vector<World::Event>& World::EventHeap( std::priority_queue<Event>& queue )
+{
+  // the container is a protected member of std::priority_queue
+  struct Heap : public std::priority_queue<Event>
+  {
+	 static container_type& Of( std::priority_queue<Event>& q )
+	 { return q.*(&Heap::c); }
+  };
+  
+  return Heap::Of( queue );
+}
+
 bool World::Event::operator<( const Event& other ) const 
 {
   return( time > other.time );
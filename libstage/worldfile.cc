@@ -36,6 +36,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 //#define DEBUG
 
@@ -50,6 +53,18 @@ using namespace Stg;
 #define isblank(a) (a == ' ' || a == '\t')
 #endif
 
+// characters that may continue a word, after its leading letter
+static inline bool isword( int ch )
+{
+  return( isalnum(ch) || ch == '.' || ch == '-' || ch == '_' || ch == '[' || ch == ']' );
+}
+
+// characters that make up a number
+static inline bool isnum( int ch )
+{
+  return( isdigit(ch) || ch == '+' || ch == '-' || ch == '.' );
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Useful macros for dumping parser errors
 #define TOKEN_ERR(z, l)				\
@@ -58,13 +73,29 @@ using namespace Stg;
   PRINT_ERR2("%s:%d : " z, this->filename.c_str(), l)
 
 
+// No cache unless one is asked for
+std::string Worldfile::cache_dir;
+
+
 ///////////////////////////////////////////////////////////////////////////
 // Default constructor
 Worldfile::Worldfile() :
   tokens(),
+  token_strings(),
+  value_copies(),
+  buffers(),
+  cached_types(),
+  cached_includes(),
+  cached_offsets(),
+  cached_values( NULL ),
+  inputs(),
+  bitmaps(),
+  cache_dirty( false ),
   macros(),
   entities(),
 	properties(),
+  names(),
+  name_table(),
   filename(),
   unit_length( 1.0 ),
   unit_angle( M_PI / 180.0 )
@@ -135,22 +166,36 @@ bool Worldfile::Load(const std::string& filename )
     }
 
   ClearTokens();
+  bitmaps.clear();
 
   // Read tokens from the file
-  if (!LoadTokens(file, 0))
+  const char *start, *end;
+  if (!MapFile(file, &start, &end))
     {
-      //DumpTokens();
+      PRINT_ERR2("unable to read world file %s : %s",
+					  this->filename.c_str(), strerror(errno));
       fclose(file);
       return false;
     }
 
   fclose(file);
+  AddInput(this->filename, start, end);
 
-  // Parse the tokens to identify entities
-  if (!ParseTokens())
+  const bool cached = LoadCache();
+  if (!cached)
     {
-      //DumpTokens();
-      return false;
+      if (!LoadTokens(start, end, 0))
+	{
+	  //DumpTokens();
+	  return false;
+	}
+
+      // Parse the tokens to identify entities
+      if (!ParseTokens())
+	{
+	  //DumpTokens();
+	  return false;
+	}
     }
 
   // Dump contents and exit if this file is meant for debugging only.
@@ -179,9 +224,8 @@ bool Worldfile::Load(const std::string& filename )
     this->unit_angle = M_PI / 180;
   else if( unita == "radians")
     this->unit_angle = 1;
-  
-	printf( "f: %s\n", this->filename.c_str() );
 
+  this->cache_dirty = !cached;
   return true;
 }
 
@@ -225,10 +269,10 @@ bool Worldfile::WarnUnused()
 
 	FOR_EACH( it, properties )
 		{
-			if( ! it->second->used )
+			if( ! it->used )
 				{
 					PRINT_WARN3("worldfile %s:%d : property [%s] is defined but not used",
-									this->filename.c_str(), it->second->line, it->second->name.c_str());
+									this->filename.c_str(), it->line, it->name);
 					unused = true;
 				}
 		}
@@ -238,222 +282,205 @@ bool Worldfile::WarnUnused()
 
 
 ///////////////////////////////////////////////////////////////////////////
-// Load tokens from a file.
-bool Worldfile::LoadTokens(FILE *file, int include)
+// Map a file into memory for the token list. Files that can't be
+// mapped, such as pipes, are read into the heap instead.
+bool Worldfile::MapFile(FILE *file, const char** start, const char** end)
 {
-  int ch;
-  int line;
-  char token[256];
-
-  line = 1;
+  const int fd = fileno(file);
+  struct stat st;
 
-  while (true)
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
     {
-      ch = fgetc(file);
-      if (ch == EOF)
-	break;
-
-      if ((char) ch == '#')
-	{
-	  ungetc(ch, file);
-	  if (!LoadTokenComment(file, &line, include))
-	    return false;
-	}
-      else if (isalpha(ch))
-	{
-	  ungetc(ch, file);
-	  if (!LoadTokenWord(file, &line, include))
-	    return false;
-	}
-      else if (strchr("+-.0123456789", ch))
-	{
-	  ungetc(ch, file);
-	  if (!LoadTokenNum(file, &line, include))
-	    return false;
-	}
-      else if (isblank(ch))
+      const size_t size = st.st_size;
+      if (size == 0)
 	{
-	  ungetc(ch, file);
-	  if (!LoadTokenSpace(file, &line, include))
-	    return false;
-	}
-      else if (ch == '"')
-	{
-	  ungetc(ch, file);
-	  if (!LoadTokenString(file, &line, include))
-	    return false;
-	}
-      else if (strchr("(", ch))
-	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenOpenEntity, token, include);
-	}
-      else if (strchr(")", ch))
-	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenCloseEntity, token, include);
-	}
-      else if (strchr("[", ch))
-	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenOpenTuple, token, include);
-	}
-      else if (strchr("]", ch))
-	{
-	  token[0] = ch;
-	  token[1] = 0;
-	  AddToken(TokenCloseTuple, token, include);
-	}
-      else if ( 0x0d == ch )
-	{
-	  ch = fgetc(file);
-	  if ( 0x0a != ch )
-	    ungetc(ch, file);
-	  line++;
-	  AddToken(TokenEOL, "\n", include);
-	}
-      else if ( 0x0a == ch )
-	{
-	  ch = fgetc(file);
-	  if ( 0x0d != ch )
-	    ungetc(ch, file);
-	  line++;
-	  AddToken(TokenEOL, "\n", include);
+	  *start = *end = NULL;
+	  return true;
 	}
-      else
+
+      void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED)
 	{
-	  TOKEN_ERR("syntax error", line);
-	  return false;
+	  // we read it once, front to back
+	  madvise(data, size, MADV_SEQUENTIAL);
+	  this->buffers.push_back(CBuffer(data, size, true));
+	  *start = (const char*)data;
+	  *end = *start + size;
+	  return true;
 	}
     }
 
+  size_t size = 0;
+  size_t capacity = 64 * 1024;
+  char* data = (char*)malloc(capacity);
+  size_t len;
+
+  while ((len = fread(data + size, 1, capacity - size, file)) > 0)
+    {
+      size += len;
+      if (size == capacity)
+	data = (char*)realloc(data, capacity *= 2);
+    }
+
+  if (ferror(file))
+    {
+      free(data);
+      return false;
+    }
+
+  this->buffers.push_back(CBuffer(data, size, false));
+  *start = data;
+  *end = data + size;
   return true;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
-// Read in a comment token
-bool Worldfile::LoadTokenComment(FILE *file, int *line, int include)
+// Load tokens from a buffer in a single pass. The tokens point into
+// the buffer rather than copying their values.
+bool Worldfile::LoadTokens(const char* start, const char* end, int include)
 {
-  char token[256];
-  int len;
-  int ch;
+  const char* pos = start;
+  int line = 1;
 
-  len = 0;
-  memset(token, 0, sizeof(token));
+  // worldfiles average a few bytes per token
+  if (include == 0)
+    this->tokens.reserve((end - start) / 2);
 
-  while (true)
+  while (pos < end)
     {
-      ch = fgetc(file);
+      const char* token = pos;
+      const int ch = (unsigned char)*pos;
 
-      if (ch == EOF)
+      switch (ch)
 	{
-	  AddToken(TokenComment, token, include);
-	  return true;
-	}
-      else if ( 0x0a == ch || 0x0d == ch )
-	{
-	  ungetc(ch, file);
-	  AddToken(TokenComment, token, include);
-	  return true;
-	}
-      else
-	token[len++] = ch;
-    }
-  return true;
-}
+	case '#':
+	  while (pos < end && *pos != 0x0a && *pos != 0x0d)
+	    pos++;
+	  AddToken(TokenComment, token, pos - token, include);
+	  break;
 
+	case '"':
+	  token = ++pos;
+	  while (pos < end && *pos != '"' && *pos != 0x0a && *pos != 0x0d)
+	    pos++;
+	  if (pos == end || *pos != '"')
+	    {
+	      TOKEN_ERR("unterminated string constant", line);
+	      return false;
+	    }
+	  AddToken(TokenString, token, pos - token, include);
+	  pos++;
+	  break;
 
-///////////////////////////////////////////////////////////////////////////
-// Read in a word token
-bool Worldfile::LoadTokenWord(FILE *file, int *line, int include)
-{
-  char token[256];
-  int len;
-  int ch;
+	case '(':
+	  AddToken(TokenOpenEntity, pos++, 1, include);
+	  break;
+	case ')':
+	  AddToken(TokenCloseEntity, pos++, 1, include);
+	  break;
+	case '[':
+	  AddToken(TokenOpenTuple, pos++, 1, include);
+	  break;
+	case ']':
+	  AddToken(TokenCloseTuple, pos++, 1, include);
+	  break;
 
-  len = 0;
-  memset(token, 0, sizeof(token));
+	case 0x0d:
+	  if (++pos < end && *pos == 0x0a)
+	    pos++;
+	  line++;
+	  AddToken(TokenEOL, "\n", 1, include);
+	  break;
+	case 0x0a:
+	  if (++pos < end && *pos == 0x0d)
+	    pos++;
+	  line++;
+	  AddToken(TokenEOL, "\n", 1, include);
+	  break;
 
-  while (true)
-    {
-      ch = fgetc(file);
+	default:
+	  if (isalpha(ch))
+	    {
+	      while (++pos < end && isword((unsigned char)*pos))
+		;
+	      AddToken(TokenWord, token, pos - token, include);
 
-      if (ch == EOF)
-	{
-	  AddToken(TokenWord, token, include);
-	  return true;
-	}
-      else if (isalpha(ch) || isdigit(ch) || strchr(".-_[]", ch))
-	{
-	  token[len++] = ch;
-	}
-      else
-	{
-	  if (strcmp(token, "include") == 0)
+	      // an include at the very end of the file is just a word
+	      if (pos < end && this->tokens.back().Is("include"))
+		if (!LoadTokenInclude(&pos, end, &line, include))
+		  return false;
+	    }
+	  else if (isnum(ch))
 	    {
-	      ungetc(ch, file);
-	      AddToken(TokenWord, token, include);
-	      if (!LoadTokenInclude(file, line, include))
-		return false;
+	      while (++pos < end && isnum((unsigned char)*pos))
+		;
+	      AddToken(TokenNum, token, pos - token, include);
+	    }
+	  else if (isblank(ch))
+	    {
+	      while (++pos < end && isblank(*pos))
+		;
+	      AddToken(TokenSpace, token, pos - token, include);
 	    }
 	  else
 	    {
-	      ungetc(ch, file);
-	      AddToken(TokenWord, token, include);
+	      TOKEN_ERR("syntax error", line);
+	      return false;
 	    }
-	  return true;
 	}
     }
-  assert(false);
-  return false;
+
+  return true;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Load an include token; this will load the include file.
-bool Worldfile::LoadTokenInclude(FILE *file, int *line, int include)
+bool Worldfile::LoadTokenInclude(const char** pos, const char* end, int *line, int include)
 {
-  int ch;
+  const char* p = *pos;
+  const char* token;
   const char *filename;
   char *fullpath;
 
-  ch = fgetc(file);
-
-  if (ch == EOF)
+  if (p == end)
     {
       TOKEN_ERR("incomplete include statement", *line);
       return false;
     }
-  else if (!isblank(ch))
+  else if (!isblank(*p))
     {
       TOKEN_ERR("syntax error in include statement", *line);
       return false;
     }
 
-  ungetc(ch, file);
-  if (!LoadTokenSpace(file, line, include))
-    return false;
-
-  ch = fgetc(file);
+  token = p;
+  while (p < end && isblank(*p))
+    p++;
+  AddToken(TokenSpace, token, p - token, include);
 
-  if (ch == EOF)
+  if (p == end)
     {
       TOKEN_ERR("incomplete include statement", *line);
       return false;
     }
-  else if (ch != '"')
+  else if (*p != '"')
     {
       TOKEN_ERR("syntax error in include statement", *line);
       return false;
     }
 
-  ungetc(ch, file);
-  if (!LoadTokenString(file, line, include))
-    return false;
+  token = ++p;
+  while (p < end && *p != '"' && *p != 0x0a && *p != 0x0d)
+    p++;
+  if (p == end || *p != '"')
+    {
+      TOKEN_ERR("unterminated string constant", *line);
+      return false;
+    }
+  AddToken(TokenString, token, p - token, include);
+  p++;
 
   // This is the basic filename
   filename = GetTokenValue(this->tokens.size() - 1);
@@ -514,139 +541,46 @@ bool Worldfile::LoadTokenInclude(FILE *file, int *line, int include)
     }
 
   // Terminate the include line
-  AddToken(TokenEOL, "\n", include);
+  AddToken(TokenEOL, "\n", 1, include);
 
   //DumpTokens();
 
   // Read tokens from the file
-  if (!LoadTokens(infile, include + 1))
+  const char *start, *stop;
+  if (!MapFile(infile, &start, &stop))
     {
-		fclose( infile );
-      //DumpTokens();
-      //free(fullpath);
+      PRINT_ERR2("unable to read include file %s : %s",
+		 fullpath, strerror(errno));
+      fclose( infile );
 		delete[] fullpath;
       return false;
     }
 
   // done with the include file
   fclose( infile );
+  AddInput(fullpath, start, stop);
 
-  // consume the rest of the include line XX a bit of a hack - assumes
-  // that an include is the last thing on a line
-  while ( ch != '\n' )
-    ch = fgetc(file);
-
-  delete[] fullpath;
-  return true;
-}
-
-
-///////////////////////////////////////////////////////////////////////////
-// Read in a number token
-bool Worldfile::LoadTokenNum(FILE *file, int *line, int include)
-{
-  char token[256];
-  int len;
-  int ch;
-
-  len = 0;
-  memset(token, 0, sizeof(token));
-
-  while (true)
+  if (!LoadTokens(start, stop, include + 1))
     {
-      ch = fgetc(file);
-
-      if (ch == EOF)
-	{
-	  AddToken(TokenNum, token, include);
-	  return true;
-	}
-      else if (strchr("+-.0123456789", ch))
-	{
-	  token[len++] = ch;
-	}
-      else
-	{
-	  AddToken(TokenNum, token, include);
-	  ungetc(ch, file);
-	  return true;
-	}
+      //DumpTokens();
+      //free(fullpath);
+		delete[] fullpath;
+      return false;
     }
-  assert(false);
-  return false;
-}
-
-
-///////////////////////////////////////////////////////////////////////////
-// Read in a string token
-bool Worldfile::LoadTokenString(FILE *file, int *line, int include)
-{
-  int ch;
-  int len;
-  char token[256];
-
-  len = 0;
-  memset(token, 0, sizeof(token));
-
-  ch = fgetc(file);
 
-  while (true)
+  // consume the rest of the include line XX a bit of a hack - assumes
+  // that an include is the last thing on a line
+  while (p < end && *p != '\n')
+    p++;
+  if (p < end)
     {
-      ch = fgetc(file);
-
-      if ( EOF == ch || 0x0a == ch || 0x0d == ch )
-	{
-	  TOKEN_ERR("unterminated string constant", *line);
-	  return false;
-	}
-      else if (ch == '"')
-	{
-	  AddToken(TokenString, token, include);
-	  return true;
-	}
-      else
-	{
-	  token[len++] = ch;
-	}
+      p++;
+      (*line)++;
     }
-  assert(false);
-  return false;
-}
-
-
-///////////////////////////////////////////////////////////////////////////
-// Read in a whitespace token
-bool Worldfile::LoadTokenSpace(FILE *file, int *line, int include)
-{
-  int ch;
-  int len;
-  char token[256];
-
-  len = 0;
-  memset(token, 0, sizeof(token));
-
-  while (true)
-    {
-      ch = fgetc(file);
+  *pos = p;
 
-      if (ch == EOF)
-	{
-	  AddToken(TokenSpace, token, include);
-	  return true;
-	}
-      else if (isblank(ch))
-	{
-	  token[len++] = ch;
-	}
-      else
-	{
-	  AddToken(TokenSpace, token, include);
-	  ungetc(ch, file);
-	  return true;
-	}
-    }
-  assert(false);
-  return false;
+  delete[] fullpath;
+  return true;
 }
 
 
@@ -657,6 +591,8 @@ bool Worldfile::SaveTokens(FILE *file)
   unsigned int i;
   CToken *token;
 
+  UnpackCachedTokens();
+
   for (i = 0; i < this->tokens.size(); i++)
     {
       token = &this->tokens[i];
@@ -664,27 +600,66 @@ bool Worldfile::SaveTokens(FILE *file)
       if (token->include > 0)
 	continue;
       if (token->type == TokenString)
-				fprintf(file, "\"%s\"", token->value.c_str());
+				fprintf(file, "\"%.*s\"", (int)token->length, token->value);
       else
-				fprintf(file, "%s", token->value.c_str());
+				fwrite(token->value, 1, token->length, file);
     }
   return true;
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// Build the token list from the tokens loaded from the cache
+void Worldfile::UnpackCachedTokens()
+{
+  if( cached_offsets.empty() )
+    return;
+
+  const size_t count = cached_types.size();
+  tokens.reserve( count );
+  for( size_t i=0; i<count; ++i )
+    {
+      AddToken( cached_types[i], cached_values + cached_offsets[i],
+		cached_offsets[i+1] - cached_offsets[i] - 1, cached_includes[i] );
+      tokens.back().terminated = true;
+    }
+
+  cached_types.clear();
+  cached_includes.clear();
+  cached_offsets.clear();
+  cached_values = NULL;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // Clear the token list
 void Worldfile::ClearTokens()
 {
 	tokens.clear();
+	token_strings.clear();
+	value_copies.clear();
+	cached_types.clear();
+	cached_includes.clear();
+	cached_offsets.clear();
+	cached_values = NULL;
+
+	FOR_EACH( it, buffers )
+		{
+			if( it->mapped )
+				munmap( it->data, it->size );
+			else
+				free( it->data );
+		}
+	buffers.clear();
+	inputs.clear();
 }
 
 
 ///////////////////////////////////////////////////////////////////////////
 // Add a token to the token list
-bool Worldfile::AddToken(int type, const char *value, int include)
+bool Worldfile::AddToken(int type, const char *value, size_t length, int include)
 {
-	tokens.push_back( CToken( include, type, value ));
+	tokens.push_back( CToken( include, type, value, length ));
   return true;
 }
 
@@ -693,8 +668,13 @@ bool Worldfile::AddToken(int type, const char *value, int include)
 // Set a token value in the token list
 bool Worldfile::SetTokenValue(int index, const char *value)
 {
+  UnpackCachedTokens();
+
   assert(index >= 0 && index < (int)this->tokens.size() );
-	tokens[index].value = value;
+	token_strings.push_back( value );
+	tokens[index].value = token_strings.back().c_str();
+	tokens[index].length = token_strings.back().size();
+	tokens[index].terminated = true;
   return true;
 }
 
@@ -703,8 +683,89 @@ bool Worldfile::SetTokenValue(int index, const char *value)
 // Get the value of a token
 const char *Worldfile::GetTokenValue(int index)
 {
+  // the values of packed tokens are terminated already
+  if( ! cached_offsets.empty() )
+    {
+      assert(index >= 0 && index + 1 < (int)cached_offsets.size());
+      return cached_values + cached_offsets[index];
+    }
+
+  assert(index >= 0 && index < (int)this->tokens.size());
+  CToken& token = this->tokens[index];
+
+  // copy the value out of the file buffer the first time it's asked for
+  if (!token.terminated)
+    {
+      token_strings.push_back( std::string( token.value, token.length ));
+      token.value = token_strings.back().c_str();
+      token.terminated = true;
+    }
+  return token.value;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Get the value and length of a token
+void Worldfile::GetTokenView(int index, const char **value, size_t *length) const
+{
+  if( ! cached_offsets.empty() )
+    {
+      assert(index >= 0 && index + 1 < (int)cached_offsets.size());
+      *value = cached_values + cached_offsets[index];
+      *length = cached_offsets[index+1] - cached_offsets[index] - 1;
+      return;
+    }
+
   assert(index >= 0 && index < (int)this->tokens.size());
-  return this->tokens[index].value.c_str();
+  *value = this->tokens[index].value;
+  *length = this->tokens[index].length;
+}
+
+
+// guards the value copies of every Worldfile; they are rarely made
+static pthread_mutex_t value_copies_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+///////////////////////////////////////////////////////////////////////////
+// Get the value of a token as a C string for a reader
+const char *Worldfile::GetTokenCString(int index)
+{
+  // packed values, and values set since loading, are terminated
+  // already, and nothing changes them while there are readers
+  if( ! cached_offsets.empty() || this->tokens[index].terminated )
+    {
+      const char* value;
+      size_t length;
+      GetTokenView( index, &value, &length );
+      return value;
+    }
+
+  pthread_mutex_lock( &value_copies_mutex );
+  const char*& copy = value_copies[index];
+  if( copy == NULL )
+    {
+      const CToken& token = this->tokens[index];
+      token_strings.push_back( std::string( token.value, token.length ));
+      copy = token_strings.back().c_str();
+    }
+  const char* value = copy;
+  pthread_mutex_unlock( &value_copies_mutex );
+  return value;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Get the value of a token as a C string, in buf if it fits there
+const char *Worldfile::GetTokenCString(int index, char* buf, size_t size)
+{
+  const char* value;
+  size_t length;
+  GetTokenView( index, &value, &length );
+  if( length >= size ) // too long for buf, so make a copy
+    return GetTokenCString( index );
+
+  memcpy( buf, value, length );
+  buf[length] = '\0';
+  return buf;
 }
 
 
@@ -714,6 +775,8 @@ void Worldfile::DumpTokens()
 {
   int line;
 
+  UnpackCachedTokens();
+
   line = 1;
   printf("\n## begin tokens\n");
   printf("## %4d : ", line);
@@ -724,7 +787,7 @@ void Worldfile::DumpTokens()
       if ( it->value[0] == '\n')
 				printf("[\\n]\n## %4d : %02d ", ++line, it->include);
       else
-				printf("[%s] ", it->value.c_str());
+				printf("[%.*s] ", (int)it->length, it->value);
     }
   printf("\n");
   printf("## end tokens\n");
@@ -754,12 +817,12 @@ bool Worldfile::ParseTokens()
       switch (token->type)
 				{
 				case TokenWord:
-					if ( token->value == "include") 
+					if ( token->Is("include") ) 
 						{
 							if (!ParseTokenInclude(&i, &line))
 								return false;
 						}
-					else if ( token->value == "define" )
+					else if ( token->Is("define") )
 						{
 							if (!ParseTokenDefine(&i, &line))
 								return false;
@@ -1234,10 +1297,10 @@ int Worldfile::LookupEntity(const char *type)
 }
 
 
-void PrintProp( const char* key, CProperty* prop )
+void PrintProp( CProperty* prop )
 {
   if( prop )
-    printf( "Print key %s prop ent %d name %s\n", key, prop->entity, prop->name.c_str() );
+    printf( "Print key %d%s prop ent %d name %s\n", prop->entity, prop->name, prop->entity, prop->name );
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -1247,7 +1310,7 @@ void Worldfile::DumpEntities()
   printf("\n## begin entities\n");
 
 	FOR_EACH( it, properties )
-		PrintProp( it->first.c_str(), it->second );
+		PrintProp( &*it );
 
   printf("## end entities\n");
 }
@@ -1257,9 +1320,119 @@ void Worldfile::DumpEntities()
 // Clear the property list
 void Worldfile::ClearProperties()
 {
-	FOR_EACH( it, properties )
-		delete it->second;	
+	FOR_EACH( it, entities )
+		{
+			it->properties.clear();
+			it->property_count = 0;
+		}
+
 	properties.clear();
+	names.clear();
+	name_table.clear();
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Hash a property name (FNV-1a)
+static inline uint32_t HashName( const char* name )
+{
+  uint32_t hash = 2166136261u;
+  while( *name )
+    hash = ( hash ^ (unsigned char)*name++ ) * 16777619u;
+  return hash;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Look up the key of an interned property name
+int Worldfile::LookupName(const char *name) const
+{
+  if( name_table.empty() )
+    return -1;
+
+  const size_t mask = name_table.size() - 1;
+  for( size_t i = HashName( name ) & mask;; i = (i+1) & mask )
+    {
+      const int key = name_table[i] - 1;
+      if( key < 0 || names[key] == name )
+        return key;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Intern a property name
+int Worldfile::InternName(const char *name)
+{
+  int key = LookupName( name );
+  if( key >= 0 )
+    return key;
+
+  // keep the table at most half full, so that probes stay short
+  if( 2 * ( names.size() + 1 ) > name_table.size() )
+    {
+      name_table.assign( std::max( (size_t)64, 2 * name_table.size() ), 0 );
+      const size_t mask = name_table.size() - 1;
+      for( size_t k = 0; k < names.size(); k++ )
+        {
+          size_t i = HashName( names[k].c_str() ) & mask;
+          while( name_table[i] )
+            i = (i+1) & mask;
+          name_table[i] = k + 1;
+        }
+    }
+
+  key = names.size();
+  names.push_back( name );
+
+  const size_t mask = name_table.size() - 1;
+  size_t i = HashName( name ) & mask;
+  while( name_table[i] )
+    i = (i+1) & mask;
+  name_table[i] = key + 1;
+
+  return key;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Find an entity's property by its interned name. Keys are small
+// consecutive numbers, so they serve as their own hashes.
+CProperty* Worldfile::CEntity::FindProperty( int key ) const
+{
+  if( properties.empty() )
+    return NULL;
+
+  const size_t mask = properties.size() - 1;
+  for( size_t i = key & mask;; i = (i+1) & mask )
+    {
+      CProperty* property = properties[i];
+      if( property == NULL || property->key == key )
+        return property;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Add a property to an entity's table
+void Worldfile::CEntity::InsertProperty( CProperty* property )
+{
+  if( 2 * ( property_count + 1 ) > properties.size() )
+    {
+      std::vector<CProperty*> old( std::max( (size_t)8, 2 * properties.size() ), (CProperty*)NULL );
+      old.swap( properties );
+      property_count = 0;
+      FOR_EACH( it, old )
+        if( *it )
+          InsertProperty( *it );
+    }
+
+  const size_t mask = properties.size() - 1;
+  size_t i = property->key & mask;
+  while( properties[i] )
+    i = (i+1) & mask;
+  properties[i] = property;
+  property_count++;
 }
 
 
@@ -1267,14 +1440,26 @@ void Worldfile::ClearProperties()
 // Add an property
 CProperty* Worldfile::AddProperty(int entity, const char *name, int line)
 {
-  char key[128];
-  snprintf( key, 127, "%d%s", entity, name );
-
-  CProperty *property = new CProperty( entity, name, line );
+  assert(entity >= 0 && entity < (int)this->entities.size());
+  CEntity& ent = this->entities[entity];
+  const int key = InternName( name );
 
-	properties[ key ] = property;
+  // a property set again, such as one given by a macro and then by
+  // the entity that uses it, takes its new values
+  CProperty* property = ent.FindProperty( key );
+  if( property )
+    {
+      property->values.clear();
+      property->numbers.clear();
+      property->line = line;
+      property->used = false;
+      return property;
+    }
 
-	return property;
+  properties.push_back( CProperty( entity, names[key].c_str(), key, line ));
+  property = &properties.back();
+  ent.InsertProperty( property );
+  return property;
 }
 
 
@@ -1298,28 +1483,14 @@ void Worldfile::AddPropertyValue( CProperty* property, int index, int value_toke
 // Get an property
 CProperty* Worldfile::GetProperty(int entity, const char *name)
 {
-  char key[128];
-  snprintf( key, 127, "%d%s", entity, name );
-  
-  //printf( "looking up key %s for entity %d name %s\n", key, entity, name );
-  
-  static char cache_key[128] = { 0 }; 
-  static CProperty* cache_property = NULL;
-  
-  if( strncmp( key, cache_key, 128 ) != 0 ) // different to last time
-	 {		
-		strncpy( cache_key, key, 128 ); // remember for next time		
-		
-		std::map<std::string,CProperty*>::iterator it = properties.find( key );	
-		if( it == properties.end() ) // not found
-		  cache_property = NULL;
-		else
-		  cache_property = it->second;		
-	 }
-  //else
-  // printf( "cache hit with %s\n", cache_key );
-	
-  return cache_property;
+  if( entity < 0 || entity >= (int)this->entities.size() )
+    return NULL;
+
+  const int key = LookupName( name );
+  if( key < 0 ) // no entity has a property of this name
+    return NULL;
+
+  return this->entities[entity].FindProperty( key );
 }
 
 bool Worldfile::PropertyExists( int section, const char* token )
@@ -1339,6 +1510,8 @@ void Worldfile::SetPropertyValue( CProperty* property, int index, const char *va
   assert(index >= 0 && index < (int)property->values.size() );
   // Set the relevant value
   SetTokenValue( property->values[index], value);
+  if( ! property->numbers.empty() )
+    property->numbers[index] = atof( value );
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -1346,8 +1519,53 @@ void Worldfile::SetPropertyValue( CProperty* property, int index, const char *va
 const char *Worldfile::GetPropertyValue(CProperty* property, int index)
 {
   assert(property);
-  property->used = true;
-  return GetTokenValue(property->values[index]);
+  MarkUsed( property );
+  return GetTokenCString(property->values[index]);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Get the value of an property, terminated in buf if it fits
+const char *Worldfile::GetPropertyValue(CProperty* property, int index, char* buf, size_t size)
+{
+  assert(property);
+  MarkUsed( property );
+  return GetTokenCString(property->values[index], buf, size);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Get the value of an property as a string
+std::string Worldfile::GetPropertyString(CProperty* property, int index)
+{
+  assert(property);
+  MarkUsed( property );
+  const char* value;
+  size_t length;
+  GetTokenView( property->values[index], &value, &length );
+  return std::string( value, length );
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Get the value of an property as a number
+double Worldfile::GetPropertyNumber(CProperty* property, int index)
+{
+  assert(property);
+  if( property->numbers.empty() )
+    {
+      char buf[64];
+      return atof(GetPropertyValue(property, index, buf, sizeof(buf)));
+    }
+
+  MarkUsed( property );
+  return property->numbers[index];
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Set the property's used flag
+void Worldfile::MarkUsed(CProperty* property)
+{
+  // atomic, as readers in several threads may get here at once
+  if( ! __atomic_load_n( &property->used, __ATOMIC_RELAXED ) )
+    __atomic_store_n( &property->used, true, __ATOMIC_RELAXED );
 }
 
 
@@ -1379,7 +1597,7 @@ const std::string Worldfile::ReadString(int entity, const char *name, const std:
   CProperty* property = GetProperty(entity, name);
   if (property == NULL )
     return value;
-  return GetPropertyValue(property, 0);
+  return GetPropertyString(property, 0);
 }
 
 
@@ -1401,7 +1619,8 @@ int Worldfile::ReadInt(int entity, const char *name, int value)
   CProperty* property = GetProperty(entity, name);
   if (property == NULL )
     return value;
-  return atoi(GetPropertyValue(property, 0));
+  char buf[64];
+  return atoi(GetPropertyValue(property, 0, buf, sizeof(buf)));
 }
 
 
@@ -1437,7 +1656,7 @@ double Worldfile::ReadFloat(int entity, const char *name, double value)
   CProperty* property = GetProperty(entity, name);
   if (property == NULL )
     return value;
-  return atof(GetPropertyValue(property, 0));
+  return GetPropertyNumber(property, 0);
 }
 
 
@@ -1448,7 +1667,7 @@ double Worldfile::ReadLength(int entity, const char *name, double value)
   CProperty* property = GetProperty(entity, name);
   if (property == NULL )
     return value;
-  return atof(GetPropertyValue(property, 0)) * this->unit_length;
+  return GetPropertyNumber(property, 0) * this->unit_length;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -1476,7 +1695,7 @@ double Worldfile::ReadAngle(int entity, const char *name, double value)
   CProperty* property = GetProperty(entity, name);
   if (property == NULL )
     return value;
-  return atof(GetPropertyValue(property, 0)) * this->unit_angle;
+  return GetPropertyNumber(property, 0) * this->unit_angle;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -1577,7 +1796,7 @@ double Worldfile::ReadTupleFloat(int entity, const char *name,
   CProperty* property = GetProperty(entity, name);
   if (property == NULL )
     return value;
-  return atof(GetPropertyValue(property, index));
+  return GetPropertyNumber(property, index);
 }
 
 
@@ -1605,7 +1824,7 @@ double Worldfile::ReadTupleLength(int entity, const char *name,
   CProperty* property = GetProperty(entity, name);
   if (property == NULL )
     return value;
-  return atof(GetPropertyValue(property, index)) * this->unit_length;
+  return GetPropertyNumber(property, index) * this->unit_length;
 }
 
 
@@ -1636,7 +1855,7 @@ double Worldfile::ReadTupleAngle(int entity, const char *name,
   CProperty* property = GetProperty(entity, name);
   if (property == NULL)
     return value;
-  return atof(GetPropertyValue(property, index)) * this->unit_angle;
+  return GetPropertyNumber(property, index) * this->unit_angle;
 }
 
 
@@ -1661,3 +1880,461 @@ void Worldfile::WriteTupleAngle(int entity, const char *name,
 
 
 
+
+
+///////////////////////////////////////////////////////////////////////////
+// The compiled worldfile cache
+
+// first bytes of every compiled worldfile
+static const char cache_magic[8] = { 'S','T','G','W','F','C','\0','\0' };
+
+// increment whenever the layout of a compiled worldfile changes
+static const uint32_t cache_version = 3;
+
+static const uint64_t hash_basis = 14695981039346656037ULL;
+
+// Hash some bytes, continuing from hash (FNV-1a, 64 bits)
+static uint64_t HashBytes( const void* data, size_t len, uint64_t hash )
+{
+  const unsigned char* p = (const unsigned char*)data;
+  for( const unsigned char* end = p + len; p < end; ++p )
+    hash = ( hash ^ *p ) * 1099511628211ULL;
+  return hash;
+}
+
+// Hash the contents of a file. Returns false if it can't be read.
+static bool HashFile( const std::string& path, uint64_t* hash )
+{
+  FILE* fp = fopen( path.c_str(), "rb" );
+  if( fp == NULL )
+    return false;
+
+  char buf[64*1024];
+  size_t len;
+  *hash = hash_basis;
+  while( (len = fread( buf, 1, sizeof(buf), fp )) > 0 )
+    *hash = HashBytes( buf, len, *hash );
+
+  const bool ok = ! ferror( fp );
+  fclose( fp );
+  return ok;
+}
+
+// Read or write the rectangles of a bitmap. Pose has a vtable, so
+// they are stored field by field rather than copied as one block.
+static void ArchiveRects( StateArchive& ar, std::vector<rotrect_t>& rects )
+{
+  uint32_t count = rects.size();
+  ar.Field( count );
+  if( ! ar.Ok() )
+    return;
+
+  if( ar.Reading() )
+    {
+      // don't let a damaged count allocate more than the file holds
+      if( count > ar.Size() )
+	{
+	  ar.Fail();
+	  return;
+	}
+      rects.resize( count );
+    }
+
+  FOR_EACH( it, rects )
+    {
+      ar.Field( it->pose );
+      ar.Field( it->size.x );
+      ar.Field( it->size.y );
+      ar.Field( it->size.z );
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Remember a file the tokens were loaded from
+void Worldfile::AddInput(const std::string& path, const char* start, const char* end)
+{
+  if( cache_dir.empty() )
+    return;
+
+  inputs.push_back( CInput( path, HashBytes( start, end - start, hash_basis )));
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// The path of the compiled form of this worldfile. It is named after
+// the worldfile's path and contents, so that editing a worldfile
+// doesn't lose the compiled form of the previous version.
+std::string Worldfile::CachePath() const
+{
+  assert( ! inputs.empty() );
+  uint64_t key = HashBytes( inputs[0].path.data(), inputs[0].path.size(), hash_basis );
+  key = HashBytes( &inputs[0].hash, sizeof(inputs[0].hash), key );
+
+  char name[32];
+  snprintf( name, sizeof(name), "%016llx.wfc", (unsigned long long)key );
+  return cache_dir + "/" + name;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Load the worldfile from its compiled form. Everything is read and
+// checked before any of it replaces the current contents, so that a
+// stale or damaged file leaves the worldfile to be parsed as usual.
+bool Worldfile::LoadCache()
+{
+  if( cache_dir.empty() || inputs.size() != 1 )
+    return false;
+
+  const std::string path = CachePath();
+  if( access( path.c_str(), R_OK ) != 0 ) // not cached yet
+    return false;
+
+  StateArchive ar;
+  if( ! ar.Load( path ) )
+    return false;
+
+  char magic[8] = { 0 };
+  uint32_t version(0);
+  ar.Field( magic );
+  ar.Field( version );
+  if( ! ar.Ok() || memcmp( magic, cache_magic, sizeof(magic) ) || version != cache_version )
+    return false;
+
+  // everything the worldfile was built from must be unchanged, the
+  // worldfile itself included, in case two paths hash alike
+  uint32_t count(0);
+  ar.Field( count );
+  std::vector<CInput> cached_inputs;
+  for( uint32_t i=0; i<count && ar.Ok(); ++i )
+    {
+      CInput input( "", 0 );
+      ar.Field( input.path );
+      ar.Field( input.hash );
+
+      uint64_t hash;
+      if( i == 0 ? ( input.path != inputs[0].path || input.hash != inputs[0].hash )
+	  : ( ! HashFile( input.path, &hash ) || hash != input.hash ))
+	return false;
+
+      cached_inputs.push_back( input );
+    }
+
+  count = 0;
+  ar.Field( count );
+  std::map<std::string,CBitmap> cached_bitmaps;
+  for( uint32_t i=0; i<count && ar.Ok(); ++i )
+    {
+      std::string bitmap_path;
+      ar.Field( bitmap_path );
+      CBitmap& bitmap = cached_bitmaps[bitmap_path];
+      ar.Field( bitmap.hash );
+      ar.Field( bitmap.width );
+      ar.Field( bitmap.height );
+
+      ArchiveRects( ar, bitmap.rects );
+
+      uint64_t hash;
+      if( ! ar.Ok() || ! HashFile( bitmap_path, &hash ) || hash != bitmap.hash )
+	return false;
+    }
+
+  // the token values are stored one after another, each followed by
+  // a NUL, so that the tokens can point straight into them
+  std::vector<uint8_t> types;
+  std::vector<int32_t> includes;
+  std::vector<uint32_t> lengths;
+  std::string values;
+  ar.Array( types );
+  ar.Array( includes );
+  ar.Array( lengths );
+  ar.Field( values );
+
+  std::vector<int32_t> parents;
+  std::vector<std::string> entity_types;
+  ar.Array( parents );
+  count = 0;
+  ar.Field( count );
+  for( uint32_t i=0; i<count && ar.Ok(); ++i )
+    {
+      entity_types.push_back( std::string() );
+      ar.Field( entity_types.back() );
+    }
+
+  // properties refer to their names by key, and their values follow
+  // one another in a single list
+  std::vector<std::string> cached_names;
+  count = 0;
+  ar.Field( count );
+  for( uint32_t i=0; i<count && ar.Ok(); ++i )
+    {
+      cached_names.push_back( std::string() );
+      ar.Field( cached_names.back() );
+    }
+
+  std::vector<int32_t> prop_entities, prop_keys, prop_lines, prop_counts, prop_values;
+  std::vector<double> prop_numbers;
+  ar.Array( prop_entities );
+  ar.Array( prop_keys );
+  ar.Array( prop_lines );
+  ar.Array( prop_counts );
+  ar.Array( prop_values );
+  ar.Array( prop_numbers );
+
+  if( ! ar.Ok() ||
+      includes.size() != types.size() || lengths.size() != types.size() ||
+      entity_types.size() != parents.size() || parents.empty() ||
+      prop_keys.size() != prop_entities.size() ||
+      prop_lines.size() != prop_entities.size() ||
+      prop_counts.size() != prop_entities.size() )
+    return false;
+
+  size_t total = 0;
+  FOR_EACH( it, lengths )
+    total += *it + 1;
+  if( total != values.size() )
+    return false;
+
+  total = 0;
+  for( size_t i=0; i<prop_entities.size(); ++i )
+    {
+      if( prop_entities[i] < 0 || prop_entities[i] >= (int)parents.size() ||
+	  prop_keys[i] < 0 || prop_keys[i] >= (int)cached_names.size() ||
+	  prop_counts[i] < 0 )
+	return false;
+      total += prop_counts[i];
+    }
+  if( total != prop_values.size() || prop_numbers.size() != prop_values.size() )
+    return false;
+
+  FOR_EACH( it, prop_values )
+    if( *it < 0 || *it >= (int)types.size() )
+      return false;
+
+  // each name must be interned once, to keep its key
+  if( std::set<std::string>( cached_names.begin(), cached_names.end() ).size() != cached_names.size() )
+    return false;
+
+  // all is well, so take it. The tokens are only unpacked if they
+  // are needed, which they aren't unless the world is saved.
+  token_strings.push_back( std::string() );
+  token_strings.back().swap( values );
+  cached_values = token_strings.back().data();
+  cached_types.swap( types );
+  cached_includes.swap( includes );
+
+  cached_offsets.resize( lengths.size() + 1 );
+  cached_offsets[0] = 0;
+  for( size_t i=0; i<lengths.size(); ++i )
+    cached_offsets[i+1] = cached_offsets[i] + lengths[i] + 1;
+
+  ClearEntities();
+  ClearProperties();
+
+  for( size_t i=0; i<parents.size(); ++i )
+    AddEntity( parents[i], entity_types[i].c_str() );
+
+  // size each entity's table for its properties up front, so that
+  // none has to grow
+  std::vector<unsigned int> counts( parents.size(), 0 );
+  FOR_EACH( it, prop_entities )
+    counts[*it]++;
+  for( size_t e=0; e<counts.size(); ++e )
+    if( counts[e] )
+      {
+	size_t size = 8;
+	while( size < 2 * counts[e] )
+	  size *= 2;
+	this->entities[e].properties.assign( size, (CProperty*)NULL );
+      }
+
+  // interning the names in order gives them their cached keys
+  FOR_EACH( it, cached_names )
+    InternName( it->c_str() );
+
+  // the values are terminated already, so the properties are built
+  // directly rather than with AddProperty() and AddPropertyValue()
+  std::vector<int32_t>::const_iterator value = prop_values.begin();
+  std::vector<double>::const_iterator number = prop_numbers.begin();
+  for( size_t i=0; i<prop_entities.size(); ++i )
+    {
+      const int key = prop_keys[i];
+      properties.push_back( CProperty( prop_entities[i], names[key].c_str(), key, prop_lines[i] ));
+      properties.back().values.assign( value, value + prop_counts[i] );
+      properties.back().numbers.assign( number, number + prop_counts[i] );
+      value += prop_counts[i];
+      number += prop_counts[i];
+      this->entities[prop_entities[i]].InsertProperty( &properties.back() );
+    }
+
+  inputs.swap( cached_inputs );
+  bitmaps.swap( cached_bitmaps );
+
+  printf( "[Cached %s]", path.c_str() );
+  fflush( stdout );
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Save the worldfile in its compiled form
+bool Worldfile::SaveCache()
+{
+  if( cache_dir.empty() || ! cache_dirty || inputs.empty() )
+    return true;
+
+  StateArchive ar;
+
+  char magic[8];
+  memcpy( magic, cache_magic, sizeof(magic) );
+  uint32_t version( cache_version );
+  ar.Field( magic );
+  ar.Field( version );
+
+  uint32_t count( inputs.size() );
+  ar.Field( count );
+  FOR_EACH( it, inputs )
+    {
+      ar.Field( it->path );
+      ar.Field( it->hash );
+    }
+
+  count = bitmaps.size();
+  ar.Field( count );
+  FOR_EACH( it, bitmaps )
+    {
+      std::string bitmap_path( it->first );
+      CBitmap& bitmap = it->second;
+      ar.Field( bitmap_path );
+      ar.Field( bitmap.hash );
+      ar.Field( bitmap.width );
+      ar.Field( bitmap.height );
+      ArchiveRects( ar, bitmap.rects );
+    }
+
+  std::vector<uint8_t> types;
+  std::vector<int32_t> includes;
+  std::vector<uint32_t> lengths;
+  std::string values;
+  if( ! cached_offsets.empty() ) // still packed as they were loaded
+    {
+      types = cached_types;
+      includes = cached_includes;
+      for( size_t i=0; i+1<cached_offsets.size(); ++i )
+	lengths.push_back( cached_offsets[i+1] - cached_offsets[i] - 1 );
+      values.assign( cached_values, cached_offsets.back() );
+    }
+  else
+    FOR_EACH( it, tokens )
+      {
+	types.push_back( it->type );
+	includes.push_back( it->include );
+	lengths.push_back( it->length );
+	values.append( it->value, it->length );
+	values += '\0';
+      }
+  ar.Array( types );
+  ar.Array( includes );
+  ar.Array( lengths );
+  ar.Field( values );
+
+  std::vector<int32_t> parents;
+  FOR_EACH( it, entities )
+    parents.push_back( it->parent );
+  ar.Array( parents );
+  count = entities.size();
+  ar.Field( count );
+  FOR_EACH( it, entities )
+    ar.Field( it->type );
+
+  count = names.size();
+  ar.Field( count );
+  FOR_EACH( it, names )
+    ar.Field( *it );
+
+  std::vector<int32_t> prop_entities, prop_keys, prop_lines, prop_counts, prop_values;
+  std::vector<double> prop_numbers;
+  FOR_EACH( it, properties )
+    {
+      prop_entities.push_back( it->entity );
+      prop_keys.push_back( it->key );
+      prop_lines.push_back( it->line );
+      prop_counts.push_back( it->values.size() );
+      prop_values.insert( prop_values.end(), it->values.begin(), it->values.end() );
+      FOR_EACH( v, it->values )
+	{
+	  char buf[64];
+	  prop_numbers.push_back( atof( GetTokenCString( *v, buf, sizeof(buf) )));
+	}
+    }
+  ar.Array( prop_entities );
+  ar.Array( prop_keys );
+  ar.Array( prop_lines );
+  ar.Array( prop_counts );
+  ar.Array( prop_values );
+  ar.Array( prop_numbers );
+
+  // write a file of our own and move it into place, so that another
+  // simulation reading the cache never sees half a file
+  mkdir( cache_dir.c_str(), 0755 );
+
+  const std::string path = CachePath();
+  char suffix[32];
+  snprintf( suffix, sizeof(suffix), ".%d.tmp", (int)getpid() );
+  const std::string tmp = path + suffix;
+
+  if( ! ar.Save( tmp ) )
+    {
+      unlink( tmp.c_str() );
+      return false;
+    }
+
+  if( rename( tmp.c_str(), path.c_str() ) != 0 )
+    {
+      PRINT_ERR2( "unable to save compiled worldfile %s : %s",
+		  path.c_str(), strerror(errno) );
+      unlink( tmp.c_str() );
+      return false;
+    }
+
+  cache_dirty = false;
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Get the rectangles of a bitmap from the cache
+bool Worldfile::GetCachedBitmap(const std::string& path,
+				std::vector<rotrect_t>& rects,
+				unsigned int& width, unsigned int& height)
+{
+  std::map<std::string,CBitmap>::const_iterator it = bitmaps.find( path );
+  if( it == bitmaps.end() )
+    return false;
+
+  rects = it->second.rects;
+  width = it->second.width;
+  height = it->second.height;
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Add the rectangles of a bitmap to the cache
+void Worldfile::CacheBitmap(const std::string& path,
+			    const std::vector<rotrect_t>& rects,
+			    unsigned int width, unsigned int height)
+{
+  if( cache_dir.empty() )
+    return;
+
+  CBitmap bitmap;
+  if( ! HashFile( path, &bitmap.hash ) )
+    return;
+
+  bitmap.rects = rects;
+  bitmap.width = width;
+  bitmap.height = height;
+  bitmaps[path] = bitmap;
+  cache_dirty = true;
+}
@@ -30,6 +30,8 @@
 
 #include <stdint.h> // for portable int types eg. uint32_t
 #include <stdio.h> // for FILE ops
+#include <string.h>
+#include <deque>
 
 namespace Stg {
 
@@ -40,22 +42,34 @@ namespace Stg {
     /// Index of entity this property belongs to
     int entity;
 
-    /// Name of property
-	 std::string name;
+    /// Name of property, interned by the Worldfile
+	 const char* name;
+
+    /// The interned name's number, unique within the Worldfile
+	 int key;
     
     /// A list of token indexes
 	 std::vector<int> values;
 
+    /// The values read as numbers, as atof() reads them. Only
+    /// properties loaded from the cache have them; the others are
+    /// read as they are asked for.
+	 std::vector<double> numbers;
+
     /// Line this property came from
     int line;
 
-    /// Flag set if property has been used
+    /// Flag set if property has been used. Readers in several
+    /// threads may set it at once, so it is only set through
+    /// Worldfile::MarkUsed().
     bool used;
 		
-	 CProperty( int entity, const char* name, int line ) :
+	 CProperty( int entity, const char* name, int key, int line ) :
 		entity(entity), 
 		name(name),
+		key(key),
 		values(),
+		numbers(),
 		line(line),
 		used(false) {}
   };
@@ -85,6 +99,29 @@ namespace Stg {
 
 	 // Check for unused properties and print warnings
   public: bool WarnUnused();
+
+	 // Directory of compiled worldfiles. When it is set, Load() reads
+	 // a worldfile from its compiled form there if none of the files
+	 // it was built from have changed, and SaveCache() writes it.
+	 // Empty to parse every worldfile.
+  public: static std::string cache_dir;
+
+	 // Save the parsed worldfile, and the bitmaps read for it, to the
+	 // cache directory. Does nothing if there is no cache directory or
+	 // everything came from the cache unchanged. Call once the world is
+	 // built, so that its bitmaps are included.
+  public: bool SaveCache();
+
+	 // Get the rectangles of a bitmap from the cache. Returns false if
+	 // the bitmap is not cached.
+  public: bool GetCachedBitmap(const std::string& path,
+										 std::vector<rotrect_t>& rects,
+										 unsigned int& width, unsigned int& height);
+
+	 // Add the rectangles of a bitmap to the cache
+  public: void CacheBitmap(const std::string& path,
+									 const std::vector<rotrect_t>& rects,
+									 unsigned int width, unsigned int height);
 	 
 	 // Read a string
   public: const std::string ReadString(int entity, const char* name, const std::string& value);
@@ -160,42 +197,59 @@ namespace Stg {
 	 ////////////////////////////////////////////////////////////////////////////
 	 // Private methods used to load stuff from the world file
   
-	 // Load tokens from a file.
-  private: bool LoadTokens(FILE *file, int include);
+	 // Map a file into memory (or read it, if it can't be mapped) and
+	 // keep it for the life of the token list.
+  private: bool MapFile(FILE *file, const char** start, const char** end);
 
-	 // Read in a comment token
-  private: bool LoadTokenComment(FILE *file, int *line, int include);
-
-	 // Read in a word token
-  private: bool LoadTokenWord(FILE *file, int *line, int include);
+	 // Load tokens from a buffer holding a whole file.
+  private: bool LoadTokens(const char* start, const char* end, int include);
 
 	 // Load an include token; this will load the include file.
-  private: bool LoadTokenInclude(FILE *file, int *line, int include);
+  private: bool LoadTokenInclude(const char** pos, const char* end, int *line, int include);
+
+	 // Save tokens to a file.
+  private: bool SaveTokens(FILE *file);
 
-	 // Read in a number token
-  private: bool LoadTokenNum(FILE *file, int *line, int include);
+	 // Remember a file the tokens were loaded from, for the cache
+  private: void AddInput(const std::string& path, const char* start, const char* end);
 
-	 // Read in a string token
-  private: bool LoadTokenString(FILE *file, int *line, int include);
+	 // The path of the compiled form of this worldfile in the cache
+  private: std::string CachePath() const;
 
-	 // Read in a whitespace token
-  private: bool LoadTokenSpace(FILE *file, int *line, int include);
+	 // Load the tokens, entities and properties from the cache instead
+	 // of parsing the file. Returns false if the file is not cached,
+	 // or it or anything it includes has changed since.
+  private: bool LoadCache();
 
-	 // Save tokens to a file.
-  private: bool SaveTokens(FILE *file);
+	 // Build the token list from the tokens loaded from the cache
+  private: void UnpackCachedTokens();
 
 	 // Clear the token list
   private: void ClearTokens();
 
-	 // Add a token to the token list
-  private: bool AddToken(int type, const char *value, int include);
+	 // Add a token to the token list. The value is not copied, so it
+	 // must outlive the token list.
+  private: bool AddToken(int type, const char *value, size_t length, int include);
 
 	 // Set a token in the token list
   private: bool SetTokenValue(int index, const char *value);
 
-	 // Get the value of a token
+	 // Get the value of a token, terminating it if it isn't already.
+	 // This changes the token, so it is only for the parser.
   private: const char *GetTokenValue(int index);
 
+	 // Get the value and length of a token without changing anything
+  private: void GetTokenView(int index, const char **value, size_t *length) const;
+
+	 // Get the value of a token as a C string for a reader. A value
+	 // that isn't terminated is copied once into value_copies, so that
+	 // readers in other threads never see the token change.
+  private: const char *GetTokenCString(int index);
+
+	 // Get the value of a token as a C string, terminated in buf if it
+	 // fits there
+  private: const char *GetTokenCString(int index, char* buf, size_t size);
+
 	 // Dump the token list (for debugging).
   private: void DumpTokens();
 
@@ -267,7 +321,8 @@ namespace Stg {
 	 // Add an property value.
   private: void AddPropertyValue( CProperty* property, int index, int value_token);
   
-	 // Get an property
+	 // Get an property. Properties and their values may be read from
+	 // any number of threads at once, as long as none is writing.
   public: CProperty* GetProperty(int entity, const char *name);
 
 	 // returns true iff the property exists in the file, so that you can
@@ -280,6 +335,20 @@ namespace Stg {
 	 // Get the value of an property.
   public: const char *GetPropertyValue( CProperty* property, int index);
 
+	 // Get the value of an property, terminated in buf if it fits
+	 // there, so that reading it copies nothing into the worldfile
+  private: const char *GetPropertyValue( CProperty* property, int index, char* buf, size_t size );
+
+	 // Get the value of an property as a string
+  private: std::string GetPropertyString( CProperty* property, int index );
+
+	 // Set the property's used flag. Any number of readers may do this
+	 // at once.
+  private: static void MarkUsed( CProperty* property );
+
+	 // Get the value of an property as a number
+  public: double GetPropertyNumber( CProperty* property, int index);
+
 	 // Dump the property list for debugging
   private: void DumpProperties();
 
@@ -304,11 +373,24 @@ namespace Stg {
 		// Token type (enumerated value).
 		int type;
 		
-		// Token value
-		std::string value;
+		// Token value. This points into the buffer the token was read
+		// from, so it is not NUL-terminated until GetTokenValue() or
+		// SetTokenValue() copies it into the string store. Property
+		// values are read by length and never terminated here.
+		const char* value;
+
+		// Length of the value
+		uint32_t length;
+
+		// True if value is NUL-terminated
+		bool terminated;
 		
-		CToken( int include, int type, const char* value ) :
-		  include(include), type(type), value(value) {}
+		CToken( int include, int type, const char* value, size_t length ) :
+		  include(include), type(type), value(value), length(length), terminated(false) {}
+
+		// True if the value is the given string
+		bool Is( const char* str ) const
+		{ return( strlen( str ) == length && memcmp( value, str, length ) == 0 ); }
 	 };
 	 
 	 // A list of tokens loaded from the file.
@@ -316,6 +398,72 @@ namespace Stg {
 	 //private: int token_size, token_count;
   private:  std::vector<CToken> tokens;
 
+	 // The terminated copies of token values. A deque never moves its
+	 // elements, so the values stay put as it grows.
+  private: std::deque<std::string> token_strings;
+
+	 // Terminated copies of the values readers have asked for as C
+	 // strings, by token index, pointing into token_strings. Guarded by
+	 // a mutex, as readers may run in several threads.
+  private: std::map<int,const char*> value_copies;
+
+	 // A file mapped into memory (or read into the heap) for the tokens
+  private:
+	 class CBuffer
+	 {
+	 public:
+		void* data;
+		size_t size;
+		bool mapped;
+
+		CBuffer( void* data, size_t size, bool mapped ) :
+		  data(data), size(size), mapped(mapped) {}
+	 };
+
+	 // The buffers the token values point into
+  private: std::vector<CBuffer> buffers;
+
+	 // The tokens loaded from the cache, left packed until something
+	 // needs the token list itself, to write values back or dump it.
+	 // Token i's value starts at cached_offsets[i] in cached_values.
+  private: std::vector<uint8_t> cached_types;
+  private: std::vector<int32_t> cached_includes;
+  private: std::vector<uint32_t> cached_offsets;
+  private: const char* cached_values;
+
+	 // A file the worldfile was built from, and a hash of its contents
+  private:
+	 class CInput
+	 {
+	 public:
+		std::string path;
+		uint64_t hash;
+
+		CInput( const std::string& path, uint64_t hash ) :
+		  path(path), hash(hash) {}
+	 };
+
+	 // The worldfile and its include files, in the order they were read
+  private: std::vector<CInput> inputs;
+
+	 // The rectangles found in a bitmap
+  private:
+	 class CBitmap
+	 {
+	 public:
+		uint64_t hash;
+		unsigned int width, height;
+		std::vector<rotrect_t> rects;
+
+		CBitmap() : hash(0), width(0), height(0), rects() {}
+	 };
+
+	 // The bitmaps read for this worldfile, by path
+  private: std::map<std::string,CBitmap> bitmaps;
+
+	 // True if the cache lacks something parsed or rasterized since
+  private: bool cache_dirty;
+
 	 // Private macro class
   private: 
 	 class CMacro
@@ -356,14 +504,43 @@ namespace Stg {
 		// Type of entity (i.e. position, laser, etc).
 		std::string type;
 		
-		CEntity( int parent, const char* type ) : parent(parent), type(type) {} 
+		// This entity's properties, in an open-addressed hash table
+		// keyed on their interned names. Its size is a power of two
+		// and it is never more than half full.
+		std::vector<CProperty*> properties;
+		unsigned int property_count;
+		
+		CEntity( int parent, const char* type ) :
+		  parent(parent), type(type), properties(), property_count(0) {} 
+
+		// Returns the property with this interned name, or NULL
+		CProperty* FindProperty( int key ) const;
+
+		// Adds a property to the table
+		void InsertProperty( CProperty* property );
 	 };
 	 
-	 // Entity list
-  private: std::vector<CEntity> entities;
+	 // Entity list. A deque, so that adding an entity doesn't copy
+	 // the property tables of all the others.
+  private: std::deque<CEntity> entities;
 	 
-	 // Property list
-  private: std::map<std::string,CProperty*> properties;	
+	 // Property list, in the order the properties were parsed
+  private: std::deque<CProperty> properties;
+
+	 // Interned property names. A property's key indexes this.
+  private: std::deque<std::string> names;
+
+	 // Open-addressed hash table of the interned names, holding their
+	 // keys plus one, so that zero marks an empty slot. Its size is a
+	 // power of two and it is never more than half full.
+  private: std::vector<int> name_table;
+
+	 // Returns the key of an interned name, or -1 if no property has
+	 // this name
+  private: int LookupName(const char* name) const;
+
+	 // Interns a name and returns its key
+  private: int InternName(const char* name);
 	 
 	 // Name of the file we loaded
   public: std::string filename;
@@ -0,0 +1,204 @@
+/** worldgen.cc
+    Synthetic worlds for stress tests and scaling sweeps. See
+    WorldGen in stage.hh.
+*/
+
+#include <errno.h>
+#include "stage.hh"
+using namespace Stg;
+
+// the arena is divided into cells this big, each holding at most one
+// obstacle or robot
+static const meters_t CELL( 1.0 );
+
+static const meters_t ROBOT_SIZE( 0.4 );
+
+// xorshift64*, so that a world depends only on its parameters and not
+// on the C library's generator or its state
+class WorldGenRandom
+{
+  uint64_t state;
+
+public:
+  WorldGenRandom( uint32_t seed )
+	 : state( seed * 2654435761ULL + 0x9E3779B97F4A7C15ULL )
+  {
+	 if( state == 0 )
+		state = 1;
+  }
+
+  uint64_t Next()
+  {
+	 state ^= state >> 12;
+	 state ^= state << 25;
+	 state ^= state >> 27;
+	 return state * 2685821657736338717ULL;
+  }
+
+  // uniform in [0,1)
+  double Uniform()
+  {
+	 return( (Next() >> 11) * (1.0 / 9007199254740992.0) );
+  }
+
+  // uniform in [0,n)
+  uint32_t Below( uint32_t n )
+  {
+	 return( (uint32_t)( Uniform() * n ) );
+  }
+};
+
+WorldGen::WorldGen() :
+  size( 0 ),
+  obstacle_density( 0.1 ),
+  robots( 100 ),
+  ranger_samples( 16 ),
+  ranger_range( 5.0 ),
+  fiducial_fraction( 0 ),
+  blobfinder_fraction( 0 ),
+  motion( MOTION_WANDER ),
+  speed( 0.5 ),
+  threads( 0 ),
+  resolution( 0.02 ),
+  quit_time( 0 ),
+  seed( 1 )
+{
+}
+
+meters_t WorldGen::ArenaSize() const
+{
+  if( size > 0 )
+	 return( std::max( 1.0, floor( size / CELL ) ) * CELL );
+
+  // the robots fill half of the cells without obstacles
+  const double free( std::max( 0.01, 1.0 - obstacle_density ) );
+  const double cells( ceil( robots / ( 0.5 * free ) ) );
+  return( std::max( 1.0, ceil( sqrt( cells ) ) ) * CELL );
+}
+
+const char* WorldGen::MotionName( motion_t motion )
+{
+  switch( motion )
+	 {
+	 case MOTION_STILL: return "still";
+	 case MOTION_CONSTANT: return "constant";
+	 case MOTION_RANDOM: return "random";
+	 case MOTION_WANDER: return "wander";
+	 }
+  return "unknown";
+}
+
+bool WorldGen::ParseMotion( const std::string& name, motion_t& motion )
+{
+  for( int m=MOTION_STILL; m<=MOTION_WANDER; ++m )
+	 if( name == MotionName( (motion_t)m ) )
+		{
+		  motion = (motion_t)m;
+		  return true;
+		}
+  return false;
+}
+
+bool WorldGen::Write( FILE* file ) const
+{
+  const meters_t side( ArenaSize() );
+  const uint32_t side_cells( (uint32_t)( side / CELL ) );
+  const uint32_t cells( side_cells * side_cells );
+  const uint32_t obstacles( (uint32_t)( std::min( std::max( obstacle_density, 0.0 ), 1.0 ) * cells ) );
+
+  if( robots > cells - obstacles )
+	 {
+		PRINT_ERR3( "%u robots don't fit in the %u free cells of a %.0fm arena",
+						robots, cells - obstacles, side );
+		return false;
+	 }
+
+  WorldGenRandom rng( seed );
+
+  // choose the cells of the obstacles and then the robots, by
+  // shuffling just the front of a list of all the cells
+  std::vector<uint32_t> order( cells );
+  for( uint32_t c=0; c<cells; ++c )
+	 order[c] = c;
+  for( uint32_t c=0; c<obstacles+robots; ++c )
+	 std::swap( order[c], order[ c + rng.Below( cells - c ) ] );
+
+  fprintf( file, "# stress world: %.0fm arena, obstacle density %.3f, %u robots,\n"
+			  "# ranger samples %u, fiducial fraction %.3f, blobfinder fraction %.3f,\n"
+			  "# motion %s at %.2f m/s, seed %u\n\n",
+			  side, obstacle_density, robots, ranger_samples, fiducial_fraction,
+			  blobfinder_fraction, MotionName( motion ), speed, seed );
+
+  fprintf( file, "resolution %.4f\n", resolution );
+  fprintf( file, "threads %u\n", threads );
+  fprintf( file, "interval_sim 100\n" );
+  fprintf( file, "speedup -1\n" );
+  fprintf( file, "paused 0\n" );
+  if( quit_time > 0 )
+	 fprintf( file, "quit_time %.3f\n", quit_time );
+
+  fprintf( file, "\nwindow( size [ 800 800 ] scale %.3f show_data 0 )\n\n", 760.0 / side );
+
+  fprintf( file, "define stress_box model( color_rgba [ 0.4 0.4 0.4 1 ] gui_move 0 )\n" );
+  fprintf( file, "define stress_ranger ranger( sensor( range [ 0 %.3f ] fov 180 samples %u )"
+			  " size [ 0.1 0.1 0.1 ] color_rgba [ 0 0 1 0.15 ] alwayson 1 )\n",
+			  ranger_range, ranger_samples );
+  fprintf( file, "define stress_fiducial fiducial( range_max %.3f alwayson 1 )\n", ranger_range );
+  fprintf( file, "define stress_blobfinder blobfinder( colors_count 1 colors [ \"red\" ]"
+			  " range %.3f alwayson 1 )\n", ranger_range );
+  fprintf( file, "define stress_robot position( size [ %.3f %.3f 0.25 ] drive \"diff\""
+			  " color_rgba [ 1 0 0 1 ] fiducial_return %d",
+			  ROBOT_SIZE, ROBOT_SIZE, fiducial_fraction > 0 ? 1 : 0 );
+  if( motion != MOTION_STILL )
+	 fprintf( file, " ctrl \"stress %s %.3f\"", MotionName( motion ), speed );
+  fprintf( file, " )\n\n" );
+
+  // the walls around the arena
+  const meters_t half( side / 2.0 );
+  fprintf( file, "stress_box( name \"wall_south\" pose [ 0 %.3f 0 0 ] size [ %.3f 0.2 0.5 ] )\n", -half - 0.1, side + 0.4 );
+  fprintf( file, "stress_box( name \"wall_north\" pose [ 0 %.3f 0 0 ] size [ %.3f 0.2 0.5 ] )\n",  half + 0.1, side + 0.4 );
+  fprintf( file, "stress_box( name \"wall_west\" pose [ %.3f 0 0 0 ] size [ 0.2 %.3f 0.5 ] )\n", -half - 0.1, side );
+  fprintf( file, "stress_box( name \"wall_east\" pose [ %.3f 0 0 0 ] size [ 0.2 %.3f 0.5 ] )\n\n",  half + 0.1, side );
+
+  for( uint32_t i=0; i<obstacles+robots; ++i )
+	 {
+		const meters_t x( -half + ( order[i] % side_cells + 0.5 ) * CELL );
+		const meters_t y( -half + ( order[i] / side_cells + 0.5 ) * CELL );
+
+		if( i < obstacles )
+		  {
+			 fprintf( file, "stress_box( pose [ %.3f %.3f 0 %.1f ] size [ %.3f %.3f 0.5 ] )\n",
+						 x, y, 90.0 * rng.Uniform(),
+						 CELL * ( 0.3 + 0.4 * rng.Uniform() ),
+						 CELL * ( 0.3 + 0.4 * rng.Uniform() ) );
+			 continue;
+		  }
+
+		fprintf( file, "stress_robot( name \"r%u\" pose [ %.3f %.3f 0 %.1f ]",
+					i - obstacles, x, y, 360.0 * rng.Uniform() );
+		if( ranger_samples > 0 )
+		  fprintf( file, " stress_ranger()" );
+		if( rng.Uniform() < fiducial_fraction )
+		  fprintf( file, " stress_fiducial()" );
+		if( rng.Uniform() < blobfinder_fraction )
+		  fprintf( file, " stress_blobfinder()" );
+		fprintf( file, " )\n" );
+	 }
+
+  return true;
+}
+
+bool WorldGen::Save( const std::string& filename ) const
+{
+  FILE* file( fopen( filename.c_str(), "w" ) );
+  if( file == NULL )
+	 {
+		PRINT_ERR2( "unable to write world file %s : %s",
+						filename.c_str(), strerror(errno) );
+		return false;
+	 }
+
+  const bool ok( Write( file ) );
+  fclose( file );
+  return ok;
+}
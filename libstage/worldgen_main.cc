@@ -0,0 +1,97 @@
+/**
+  stageworldgen writes synthetic worlds for stress tests and scaling
+  sweeps. See Stg::WorldGen.
+ */
+
+#include <getopt.h>
+
+#include "stage.hh"
+using namespace Stg;
+
+const char* USAGE =
+  "USAGE:  stageworldgen [options] [worldfile]\n"
+  "Writes a generated world to worldfile, or to standard output.\n"
+  "Available [options] are:\n"
+  "  --size M             : side of the square arena in meters, 0 to fit the robots [0]\n"
+  "  --density F          : fraction of the arena's 1m cells holding an obstacle [0.1]\n"
+  "  --robots N           : number of robots [100]\n"
+  "  --ranger-samples N   : samples per ranger scan, 0 for no rangers [16]\n"
+  "  --ranger-range M     : range of the rangers, fiducial finders and blobfinders [5]\n"
+  "  --fiducials F        : fraction of the robots with a fiducial finder [0]\n"
+  "  --blobfinders F      : fraction of the robots with a blobfinder [0]\n"
+  "  --motion NAME        : still, constant, random or wander [wander]\n"
+  "  --speed S            : top speed of moving robots in meters per second [0.5]\n"
+  "  --threads N          : the world's worker threads [0]\n"
+  "  --resolution M       : the world's raytracing resolution in meters [0.02]\n"
+  "  --quit-time S        : simulated seconds to run for, 0 for ever [0]\n"
+  "  --seed N             : seeds the layout [1]\n"
+  "  --help               : print this message\n";
+
+static struct option longopts[] = {
+	{ "size",  required_argument,   NULL,  's' },
+	{ "density",  required_argument,   NULL,  'd' },
+	{ "robots",  required_argument,   NULL,  'n' },
+	{ "ranger-samples",  required_argument,   NULL,  'r' },
+	{ "ranger-range",  required_argument,   NULL,  'R' },
+	{ "fiducials",  required_argument,   NULL,  'f' },
+	{ "blobfinders",  required_argument,   NULL,  'b' },
+	{ "motion",  required_argument,   NULL,  'm' },
+	{ "speed",  required_argument,   NULL,  'v' },
+	{ "threads",  required_argument,   NULL,  't' },
+	{ "resolution",  required_argument,   NULL,  'e' },
+	{ "quit-time",  required_argument,   NULL,  'q' },
+	{ "seed",  required_argument,   NULL,  'S' },
+	{ "help",  no_argument,   NULL,  'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+int main( int argc, char* argv[] )
+{
+  WorldGen gen;
+
+  int ch=0, optindex=0;
+  while ((ch = getopt_long(argc, argv, "s:d:n:r:R:f:b:m:v:t:e:q:S:h?", longopts, &optindex)) != -1)
+	 {
+		switch( ch )
+		  {
+		  case 's': gen.size = atof(optarg); break;
+		  case 'd': gen.obstacle_density = atof(optarg); break;
+		  case 'n': gen.robots = atoi(optarg); break;
+		  case 'r': gen.ranger_samples = atoi(optarg); break;
+		  case 'R': gen.ranger_range = atof(optarg); break;
+		  case 'f': gen.fiducial_fraction = atof(optarg); break;
+		  case 'b': gen.blobfinder_fraction = atof(optarg); break;
+		  case 'v': gen.speed = atof(optarg); break;
+		  case 't': gen.threads = atoi(optarg); break;
+		  case 'e': gen.resolution = atof(optarg); break;
+		  case 'q': gen.quit_time = atof(optarg); break;
+		  case 'S': gen.seed = strtoul(optarg, NULL, 0); break;
+		  case 'm':
+			 if( ! WorldGen::ParseMotion( optarg, gen.motion ) )
+				{
+				  printf( "unknown motion \"%s\"\n", optarg );
+				  puts( USAGE );
+				  exit(1);
+				}
+			 break;
+		  case 'h':
+		  case '?':
+			 puts( USAGE );
+			 exit(0);
+			 break;
+		  default:
+			 printf("unhandled option %c\n", ch );
+			 puts( USAGE );
+			 exit(1);
+		  }
+	 }
+
+  if( optind < argc - 1 )
+	 {
+		puts( USAGE );
+		exit(1);
+	 }
+
+  const bool ok( optind < argc ? gen.Save( argv[optind] ) : gen.Write( stdout ) );
+  return( ok ? 0 : 1 );
+}
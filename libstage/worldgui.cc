@@ -197,7 +197,9 @@ WorldGui::WorldGui(int W,int H,const char* L) :
   real_time_interval( sim_interval ),
   real_time_now( RealTimeNow() ),
   real_time_recorded( real_time_now ),
-  timing_interval( 20 )
+  timing_interval( 20 ),
+  memory_bytes( 0 ),
+  memory_time( 0 )
 {
   Fl::scheme( "" );
   resizable(canvas);
@@ -357,6 +359,12 @@ bool WorldGui::Update()
 		const usec_t timenow = RealTimeNow();	 
 		real_time_interval = timenow - real_time_recorded; 
 		real_time_recorded = timenow;
+
+		if( timenow - memory_time > 5000000 )
+		  {
+			 memory_bytes = MemoryStats().Total();
+			 memory_time = timenow;
+		  }
 	 }   
 
   // inherit
@@ -385,6 +393,12 @@ std::string WorldGui::ClockString() const
   char buf[32];
   snprintf( buf, 32, " [%.1f]", localratio );
   str += buf;
+
+  if( memory_bytes )
+	 {
+		snprintf( buf, 32, " [%.1f MB]", memory_bytes / 1e6 );
+		str += buf;
+	 }
   
   if( paused == true )
 	 str += " [ PAUSED ]";
@@ -393,19 +407,17 @@ std::string WorldGui::ClockString() const
 }
 
 
-void WorldGui::AddModel( Model*  mod  )
+void WorldGui::AttachChild( Model*  mod  )
 {
-  if( mod->parent == NULL )
-	 canvas->AddModel( mod );
-  
-  World::AddModel( mod );
+  canvas->AddModel( mod );
+  World::AttachChild( mod );
 }
 
 
-void WorldGui::RemoveChild( Model* mod )
+void WorldGui::DetachChild( Model* mod )
 {
   canvas->RemoveModel( mod );
-  World::RemoveChild( mod );
+  World::DetachChild( mod );
 }
 
 
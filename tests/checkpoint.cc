@@ -0,0 +1,106 @@
+/////////////////////////////////
+// File: checkpoint.cc
+// Desc: Checks that World::Restore() puts a world back exactly as
+//       World::Checkpoint() saved it, by comparing a hash of the
+//       models' poses. Usage: checkpoint <worldfile> <checkpoint file>
+// License: GPL
+/////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "stage.hh"
+using namespace Stg;
+
+static int AddModel( Model* mod, void* models )
+{
+  ((std::vector<Model*>*)models)->push_back( mod );
+  return 0;
+}
+
+/** FNV-1a hash of the global poses of all the models, visited by
+    name so that two worlds loaded from the same file hash alike */
+static uint64_t PoseHash( World& world, const std::vector<std::string>& names )
+{
+  uint64_t hash( 14695981039346656037ULL );
+
+  for( size_t i(0); i<names.size(); ++i )
+	 {
+		const Pose pose( world.GetModel( names[i] )->GetGlobalPose() );
+		const double v[4] = { pose.x, pose.y, pose.z, pose.a };
+		const unsigned char* bytes( (const unsigned char*)v );
+
+		for( size_t b(0); b<sizeof(v); ++b )
+		  hash = (hash ^ bytes[b]) * 1099511628211ULL;
+	 }
+
+  return hash;
+}
+
+int main( int argc, char* argv[] )
+{
+  if( argc < 3 )
+	 {
+		puts( "USAGE:  checkpoint <worldfile> <checkpoint file>" );
+		return 2;
+	 }
+
+  Stg::Init( &argc, &argv );
+
+  World world;
+  world.Load( argv[1] );
+
+  std::vector<Model*> models;
+  world.ForEachDescendant( AddModel, &models );
+
+  std::vector<std::string> names;
+  for( size_t i(0); i<models.size(); ++i )
+	 names.push_back( models[i]->Token() );
+
+  for( int i(0); i<100; ++i )
+	 world.Update();
+
+  const uint64_t saved( PoseHash( world, names ) );
+
+  if( ! world.Checkpoint( argv[2] ) )
+	 {
+		printf( "FAIL: could not checkpoint to %s\n", argv[2] );
+		return 1;
+	 }
+
+  int failures( 0 );
+
+  // restore into a fresh copy of the world
+  World fresh;
+  fresh.Load( argv[1] );
+
+  if( ! fresh.Restore( argv[2] ) || PoseHash( fresh, names ) != saved )
+	 {
+		printf( "FAIL: restoring into a freshly loaded world\n" );
+		++failures;
+	 }
+
+  // and back into the original, once it has moved on
+  for( int i(0); i<100; ++i )
+	 world.Update();
+
+  if( PoseHash( world, names ) == saved )
+	 {
+		printf( "FAIL: the models did not move\n" );
+		++failures;
+	 }
+
+  if( ! world.Restore( argv[2] ) || PoseHash( world, names ) != saved )
+	 {
+		printf( "FAIL: restoring into the world that was saved\n" );
+		++failures;
+	 }
+
+  remove( argv[2] );
+
+  if( failures == 0 )
+	 printf( "OK: %" PRIx64 "\n", saved );
+
+  return( failures ? 1 : 0 );
+}
@@ -0,0 +1,107 @@
+#!/usr/bin/env python
+#
+# compare.py - compare a "stage --bench" run against a stored baseline
+#
+# usage:
+#   stage --bench 3600 simple.world > run.txt
+#   compare.py run.txt baseline.json          # report, exit 1 on regression
+#   compare.py --save run.txt baseline.json   # store run as the new baseline
+#
+# Either file may be "-" for standard input. The JSON report is found
+# after the "[Stage: done]" line of stage's output, so the whole output
+# can be piped in.
+
+from __future__ import print_function
+
+import json
+import sys
+import optparse
+
+# (key, True if bigger is better)
+TOTALS = [ ( "realtime_factor", True ),
+           ( "ticks_per_second", True ),
+           ( "peak_rss_kb", False ) ]
+
+def parse_report( text, source="the output" ):
+    # the report is the last JSON object in the output
+    start = text.rfind( "\n{" )
+    if start < 0:
+        if not text.startswith( "{" ):
+            raise ValueError( "no stage --bench report in %s" % source )
+    else:
+        text = text[start+1:]
+    return json.loads( text )
+
+def read_report( filename ):
+    if filename == "-":
+        text = sys.stdin.read()
+    else:
+        f = open( filename )
+        text = f.read()
+        f.close()
+    return parse_report( text, filename )
+
+def change( old, new ):
+    if old == 0:
+        return 0.0
+    return 100.0 * ( new - old ) / old
+
+def compare( base, run, tolerance ):
+    regressions = 0
+
+    if base.get( "bench_seconds" ) != run.get( "bench_seconds" ):
+        print( "warning: baseline ran %s seconds, this run %s seconds"
+               % ( base.get( "bench_seconds" ), run.get( "bench_seconds" ) ) )
+
+    print( "%-20s %14s %14s %8s" % ( "", "baseline", "run", "change" ) )
+    for key, bigger_is_better in TOTALS:
+        old, new = base[key], run[key]
+        pct = change( old, new )
+        worse = -pct if bigger_is_better else pct
+        flag = ""
+        if worse > tolerance:
+            flag = "  REGRESSION"
+            regressions += 1
+        print( "%-20s %14.3f %14.3f %+7.1f%%%s" % ( key, old, new, pct, flag ) )
+
+    # phases are informational: they show where a regression went
+    for bworld, rworld in zip( base["worlds"], run["worlds"] ):
+        print( "\n%s (%d models)" % ( rworld["worldfile"], rworld["models"] ) )
+        for phase in sorted( rworld["phases"] ):
+            old = bworld["phases"].get( phase, 0.0 )
+            new = rworld["phases"][phase]
+            print( "  %-18s %14.6f %14.6f %+7.1f%%"
+                   % ( phase, old, new, change( old, new ) ) )
+
+    return regressions
+
+def main():
+    parser = optparse.OptionParser(
+        usage="%prog [options] <run> <baseline.json>" )
+    parser.add_option( "-s", "--save", action="store_true", default=False,
+                       help="store the run as the baseline and exit" )
+    parser.add_option( "-t", "--tolerance", type="float", default=5.0,
+                       help="percentage change allowed before a "
+                       "regression is reported [%default]" )
+    options, args = parser.parse_args()
+    if len( args ) != 2:
+        parser.error( "need a run and a baseline" )
+
+    run = read_report( args[0] )
+
+    if options.save:
+        f = open( args[1], "w" )
+        json.dump( run, f, indent=2, sort_keys=True )
+        f.write( "\n" )
+        f.close()
+        print( "saved baseline %s" % args[1] )
+        return 0
+
+    regressions = compare( read_report( args[1] ), run, options.tolerance )
+    if regressions:
+        print( "\n%d regression(s) beyond %.1f%%" % ( regressions, options.tolerance ) )
+        return 1
+    return 0
+
+if __name__ == "__main__":
+    sys.exit( main() )
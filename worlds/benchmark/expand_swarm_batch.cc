@@ -0,0 +1,95 @@
+/////////////////////////////////
+// File: expand_swarm_batch.cc
+// Desc: expand_swarm controller, driving the whole swarm from one
+//       batch callback per update instead of one callback per robot
+// Author: Richard Vaughan <vaughan@sfu.ca>
+// License: GPL
+/////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stage.hh"
+using namespace Stg;
+
+// swarmbot
+const double VSPEED = 0.3; // meters per second
+const double WGAIN = 1.0; // turn speed gain
+const double SAFE_DIST = 0.5; // meters
+const double SAFE_ANGLE = 0.5; // radians
+
+// forward declare
+void SwarmUpdate( World* world, RangerBatch& batch, void* user );
+
+// Stage calls this when the model starts up
+extern "C" int Init( Model* mod )
+{
+  ModelPosition* position = (ModelPosition*)mod;
+
+  // subscribe to the ranger, which we use for navigating
+  ModelRanger* ranger = (ModelRanger*)mod->GetUnusedModelOfType( "ranger" );
+  assert( ranger );
+
+  // every robot joins the same batch, so SwarmUpdate() is called
+  // once per update for the whole swarm
+  mod->GetWorld()->AddBatchMember( SwarmUpdate, NULL, ranger, position );
+
+  // start the models updating
+  position->Subscribe();
+  ranger->Subscribe();
+
+  return 0; //ok
+}
+
+void SwarmUpdate( World* world, RangerBatch& batch, void* user )
+{
+  const size_t n = batch.Size();
+
+  for( size_t i=0; i<n; i++ )
+	 {
+		const size_t first = batch.offsets[i];
+		const size_t count = batch.offsets[i+1] - first;
+
+		// no scan yet
+		if( count < 12 )
+		  continue;
+
+		const meters_t* ranges = &batch.ranges[first];
+		const radians_t* bearings = &batch.bearings[first];
+
+		// compute the vector sum of the sonar ranges
+		double dx=0, dy=0;
+		for( size_t s=0; s<count; s++ )
+		  {
+			 dx += ranges[s] * cos( bearings[s] );
+			 dy += ranges[s] * sin( bearings[s] );
+		  }
+
+		// leave the previous command in place
+		if( (dx == 0) || (dy == 0) )
+		  continue;
+
+		double resultant_angle = atan2( dy, dx );
+		double forward_speed = 0.0;
+		double side_speed = 0.0;
+		double turn_speed = WGAIN * resultant_angle;
+
+		// if the front is clear, drive forwards
+		if( (ranges[0] > SAFE_DIST) &&
+			 (ranges[1] > SAFE_DIST/1.5) &&
+			 (ranges[2] > SAFE_DIST/3.0) &&
+			 (ranges[3] > SAFE_DIST/5.0) &&
+			 (ranges[9] > SAFE_DIST/5.0) &&
+			 (ranges[10] > SAFE_DIST/3.0) &&
+			 (ranges[11] > SAFE_DIST/1.5) &&
+			 (fabs( resultant_angle ) < SAFE_ANGLE) )
+		  {
+			 forward_speed = VSPEED;
+		  }
+
+		batch.vx[i] = forward_speed;
+		batch.vy[i] = side_speed;
+		batch.va[i] = turn_speed;
+	 }
+}
@@ -0,0 +1,68 @@
+/////////////////////////////////
+// File: instantiate.cc
+// Desc: Times World::InstantiatePrototype() on a large swarm
+// License: GPL
+/////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "stage.hh"
+using namespace Stg;
+
+static double Seconds()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return( tv.tv_sec + tv.tv_usec / 1e6 );
+}
+
+// Stage calls this when the model starts up. The ctrl string names
+// the prototype and the number of copies to make, e.g.
+//   ctrl "instantiate r0 10000"
+// The copies are laid out on a grid centred on this model.
+extern "C" int Init( Model* mod, CtrlArgs* args )
+{
+  char protoname[256];
+  unsigned int count( 0 );
+
+  if( sscanf( args->worldfile.c_str(), "%*s %255s %u", protoname, &count ) != 2 )
+	 {
+		PRINT_ERR1( "usage: ctrl \"instantiate <prototype> <count>\", not \"%s\"",
+						args->worldfile.c_str() );
+		return 1;
+	 }
+
+  Model* proto( mod->GetWorld()->GetModel( protoname ) );
+  if( proto == NULL )
+	 {
+		PRINT_ERR1( "no prototype model named %s", protoname );
+		return 1;
+	 }
+
+  // space the copies a little wider than the prototype
+  const Geom geom( proto->GetGeom() );
+  const double spacing( 1.5 * std::max( geom.size.x, geom.size.y ) );
+  const unsigned int side( (unsigned int)ceil( sqrt( (double)count ) ) );
+  const Pose origin( mod->GetGlobalPose() );
+
+  std::vector<Pose> poses;
+  poses.reserve( count );
+  for( unsigned int i=0; i<count; ++i )
+	 poses.push_back( Pose( origin.x + spacing * ( i % side - side / 2.0 ),
+									origin.y + spacing * ( i / side - side / 2.0 ),
+									0, 0 ) );
+
+  const double start( Seconds() );
+  const ModelPtrVec copies( mod->GetWorld()->InstantiatePrototype( proto, count, poses ) );
+  const double elapsed( Seconds() - start );
+
+  printf( "[instantiate] %u copies of %s in %.3f s (%.1f us per copy)\n",
+			 (unsigned int)copies.size(), protoname, elapsed,
+			 copies.size() ? 1e6 * elapsed / copies.size() : 0.0 );
+
+  return 0; //ok
+}
@@ -0,0 +1,187 @@
+#!/usr/bin/env python
+#
+# scaling.py - measure how Stage's throughput scales with the number
+# of robots and worker threads
+#
+# For each robot count and thread count (the world's "threads"
+# setting, so 0 is the main thread alone), generates a stress world with
+# stageworldgen, runs it with "stage --bench", and records the
+# throughput. The results are written as CSV, printed as a table of
+# robot updates per second with the speedup over the first thread
+# count, and
+# optionally plotted as throughput curves (needs matplotlib).
+#
+# usage:
+#   scaling.py --robots 10,100,1000,10000,100000 --threads 1,2,4,8,16,32,64 \
+#              --csv scaling.csv --plot scaling.png -- --ranger-samples 32
+#
+# Arguments after "--" are passed to stageworldgen, to set the
+# obstacle density, sensor mix and motion of the worlds.
+
+from __future__ import print_function
+
+import csv
+import optparse
+import os
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert( 0, os.path.dirname( os.path.abspath( __file__ ) ) )
+from compare import parse_report
+
+def int_list( text ):
+    return [ int( x ) for x in text.split( "," ) if x ]
+
+def run( options, robots, threads, worldgen_args ):
+    fd, world = tempfile.mkstemp( suffix=".world", prefix="scaling-" )
+    os.close( fd )
+    try:
+        subprocess.check_call( [ options.worldgen,
+                                 "--robots", str( robots ),
+                                 "--threads", str( threads ),
+                                 "--seed", str( options.seed ) ]
+                               + worldgen_args + [ world ] )
+
+        output = subprocess.check_output( [ options.stage, "--bench",
+                                            str( options.seconds ), world ] )
+        if not isinstance( output, str ):
+            output = output.decode( "utf-8", "replace" )
+        report = parse_report( output )
+    finally:
+        os.unlink( world )
+
+    return { "robots": robots,
+             "threads": threads,
+             "ticks_per_second": report["ticks_per_second"],
+             "realtime_factor": report["realtime_factor"],
+             "robot_updates_per_second": robots * report["ticks_per_second"],
+             "peak_rss_kb": report["peak_rss_kb"],
+             "load_seconds": report["worlds"][0]["phases"]["load"] }
+
+def print_table( results, robot_counts, thread_counts ):
+    by_key = dict( ( ( r["robots"], r["threads"] ), r ) for r in results )
+
+    print( "\nrobot updates per second (speedup over %d thread%s)"
+           % ( thread_counts[0], "" if thread_counts[0] == 1 else "s" ) )
+    print( "%10s" % "robots" + "".join( "%20s" % ( "%d threads" % t ) for t in thread_counts ) )
+
+    for n in robot_counts:
+        base = by_key.get( ( n, thread_counts[0] ) )
+        line = "%10d" % n
+        best = None
+        for t in thread_counts:
+            r = by_key.get( ( n, t ) )
+            if r is None:
+                line += "%20s" % "-"
+                continue
+            speedup = r["robot_updates_per_second"] / base["robot_updates_per_second"] \
+                if base and base["robot_updates_per_second"] else 0
+            line += "%20s" % ( "%.4g (%.2fx)" % ( r["robot_updates_per_second"], speedup ) )
+            if best is None or r["robot_updates_per_second"] > best["robot_updates_per_second"]:
+                best = r
+        if best:
+            line += "   peak at %d threads" % best["threads"]
+        print( line )
+
+def plot( results, robot_counts, thread_counts, filename ):
+    try:
+        import matplotlib
+        matplotlib.use( "Agg" )
+        import matplotlib.pyplot as plt
+    except ImportError:
+        print( "matplotlib is not available, so no plot was made" )
+        return
+
+    fig, ( ax1, ax2 ) = plt.subplots( 1, 2, figsize=( 12, 5 ) )
+
+    for t in thread_counts:
+        points = sorted( ( r["robots"], r["robot_updates_per_second"] )
+                         for r in results if r["threads"] == t )
+        if points:
+            ax1.plot( [ p[0] for p in points ], [ p[1] for p in points ],
+                      marker="o", label="%d threads" % t )
+    ax1.set_xscale( "log" )
+    ax1.set_yscale( "log" )
+    ax1.set_xlabel( "robots" )
+    ax1.set_ylabel( "robot updates per second" )
+    ax1.legend()
+    ax1.grid( True, which="both", alpha=0.3 )
+
+    for n in robot_counts:
+        points = sorted( ( r["threads"], r["robot_updates_per_second"] )
+                         for r in results if r["robots"] == n )
+        if points and points[0][1]:
+            ax2.plot( [ p[0] for p in points ], [ p[1] / points[0][1] for p in points ],
+                      marker="o", label="%d robots" % n )
+    # 0 threads means the main thread alone, which is one thread
+    ax2.plot( thread_counts,
+              [ float( max( t, 1 ) ) / max( thread_counts[0], 1 ) for t in thread_counts ],
+              "k--", alpha=0.4, label="linear" )
+    if min( thread_counts ) > 0:
+        ax2.set_xscale( "log" )
+    ax2.set_xlabel( "threads" )
+    ax2.set_ylabel( "speedup" )
+    ax2.legend()
+    ax2.grid( True, which="both", alpha=0.3 )
+
+    fig.tight_layout()
+    fig.savefig( filename )
+    print( "plotted %s" % filename )
+
+def main():
+    parser = optparse.OptionParser(
+        usage="%prog [options] [-- stageworldgen options]" )
+    parser.add_option( "--robots", default="10,100,1000,10000",
+                       help="comma separated robot counts [%default]" )
+    parser.add_option( "--threads", default="1,2,4,8",
+                       help="comma separated worker thread counts [%default]" )
+    parser.add_option( "--seconds", type="float", default=10.0,
+                       help="simulated seconds per run [%default]" )
+    parser.add_option( "--seed", type="int", default=1,
+                       help="seeds the layout of every world [%default]" )
+    parser.add_option( "--stage", default="stage",
+                       help="the stage program [%default]" )
+    parser.add_option( "--worldgen", default="stageworldgen",
+                       help="the stageworldgen program [%default]" )
+    parser.add_option( "--csv", default="scaling.csv",
+                       help="write the results here [%default]" )
+    parser.add_option( "--plot", default=None,
+                       help="plot the throughput curves in this image file" )
+    options, args = parser.parse_args()
+
+    robot_counts = int_list( options.robots )
+    thread_counts = int_list( options.threads )
+
+    results = []
+    for n in robot_counts:
+        for t in thread_counts:
+            print( "[%d robots, %d threads]" % ( n, t ), end="" )
+            sys.stdout.flush()
+            try:
+                r = run( options, n, t, args )
+            except ( subprocess.CalledProcessError, ValueError ) as e:
+                print( " failed: %s" % e )
+                continue
+            print( " %.1f ticks/s" % r["ticks_per_second"] )
+            results.append( r )
+
+    fields = [ "robots", "threads", "ticks_per_second", "realtime_factor",
+               "robot_updates_per_second", "peak_rss_kb", "load_seconds" ]
+    f = open( options.csv, "w" )
+    writer = csv.DictWriter( f, fieldnames=fields )
+    writer.writeheader()
+    for r in results:
+        writer.writerow( r )
+    f.close()
+    print( "wrote %s" % options.csv )
+
+    print_table( results, robot_counts, thread_counts )
+
+    if options.plot:
+        plot( results, robot_counts, thread_counts, options.plot )
+
+    return 0
+
+if __name__ == "__main__":
+    sys.exit( main() )
@@ -0,0 +1,129 @@
+/////////////////////////////////
+// File: stress.cc
+// Desc: Drives the robots of generated stress worlds. See
+//       Stg::WorldGen and the stageworldgen program.
+// License: GPL
+/////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+
+#include "stage.hh"
+using namespace Stg;
+
+// closer than this to something in front, turn away
+const double AVOID_DIST = 0.6; // meters
+const double TURN_SPEED = 1.0; // radians per second
+
+typedef struct
+{
+  ModelPosition* position;
+  ModelRanger* ranger;
+  double speed;
+  int countdown; // updates until the random motion changes
+} robot_t;
+
+int PositionUpdate( Model* mod, robot_t* robot );
+int RangerUpdate( Model* mod, robot_t* robot );
+
+// Stage calls this when the model starts up. The ctrl string names
+// the motion and the top speed, e.g.
+//   ctrl "stress wander 0.5"
+extern "C" int Init( Model* mod, CtrlArgs* args )
+{
+  char motionname[32];
+  double speed(0);
+
+  WorldGen::motion_t motion;
+  if( sscanf( args->worldfile.c_str(), "%*s %31s %lf", motionname, &speed ) != 2 ||
+		! WorldGen::ParseMotion( motionname, motion ) )
+	 {
+		PRINT_ERR1( "usage: ctrl \"stress <still|constant|random|wander> <speed>\", not \"%s\"",
+						args->worldfile.c_str() );
+		return 1;
+	 }
+
+  robot_t* robot = new robot_t;
+  robot->position = dynamic_cast<ModelPosition*>( mod );
+  robot->ranger = (ModelRanger*)mod->GetUnusedModelOfType( "ranger" );
+  robot->speed = speed;
+  robot->countdown = 0;
+
+  if( robot->position == NULL )
+	 {
+		PRINT_ERR1( "the stress controller drives position models, not %s", mod->Token() );
+		delete robot;
+		return 1;
+	 }
+
+  if( motion == WorldGen::MOTION_WANDER && robot->ranger == NULL )
+	 {
+		PRINT_WARN1( "%s has no ranger to wander with, so it moves randomly", mod->Token() );
+		motion = WorldGen::MOTION_RANDOM;
+	 }
+
+  switch( motion )
+	 {
+	 case WorldGen::MOTION_STILL:
+		break;
+	 case WorldGen::MOTION_CONSTANT:
+		robot->position->SetSpeed( speed, 0, 0 );
+		break;
+	 case WorldGen::MOTION_RANDOM:
+		robot->position->AddCallback( Model::CB_UPDATE, (model_callback_t)PositionUpdate, robot );
+		break;
+	 case WorldGen::MOTION_WANDER:
+		robot->ranger->AddCallback( Model::CB_UPDATE, (model_callback_t)RangerUpdate, robot );
+		robot->ranger->Subscribe();
+		break;
+	 }
+
+  robot->position->Subscribe();
+
+  return 0; //ok
+}
+
+// every few seconds, choose a new random speed and turn rate, and
+// back away from whatever stops us
+int PositionUpdate( Model* mod, robot_t* robot )
+{
+  const bool stalled( robot->position->Stalled() );
+  if( --robot->countdown > 0 && ! stalled )
+	 return 0;
+
+  robot->countdown = 20 + mod->RandomInt() % 30;
+  robot->position->SetSpeed( robot->speed * ( stalled ? -0.5 : 1.0 ) * mod->Random(), 0,
+									  TURN_SPEED * ( 2.0 * mod->Random() - 1.0 ) );
+  return 0;
+}
+
+// drive forwards, turning towards the more open side whenever
+// something is close in front, and backing away if stuck
+int RangerUpdate( Model* mod, robot_t* robot )
+{
+  const std::vector<meters_t>& scan = robot->ranger->GetRanges();
+  const size_t count = scan.size();
+  if( count < 1 )
+	 return 0;
+
+  double front(1e6), left(0), right(0);
+  for( size_t i=0; i<count; ++i )
+	 {
+		if( i >= count/4 && i < count - count/4 )
+		  front = std::min( front, scan[i] );
+
+		if( i < count/2 )
+		  right += scan[i];
+		else
+		  left += scan[i];
+	 }
+
+  if( robot->position->Stalled() )
+	 robot->position->SetSpeed( -0.2 * robot->speed, 0, left > right ? TURN_SPEED : -TURN_SPEED );
+  else if( front < AVOID_DIST )
+	 robot->position->SetSpeed( 0, 0, left > right ? TURN_SPEED : -TURN_SPEED );
+  else
+	 robot->position->SetSpeed( robot->speed, 0,
+										 0.2 * TURN_SPEED * ( 2.0 * mod->Random() - 1.0 ) );
+  return 0;
+}